@@ -70,6 +70,96 @@ static int doOnce = 0;
 
 struct buffer **shared_bufs;
 
+/** describeFormat() names of the formats capture_negotiate() can pick */
+static const char *
+vpe_format_name(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case FOURCC('Y','U','Y','V'): return "yuyv";
+	case FOURCC('U','Y','V','Y'): return "uyvy";
+	case FOURCC('N','V','1','2'): return "nv12";
+	default: return NULL;
+	}
+}
+
+/** capture_negotiate() filter: formats VPE can read and write */
+static bool
+vpe_takes(uint32_t fourcc)
+{
+	return vpe_format_name(fourcc) != NULL;
+}
+
+/** VPE output for a given input: the same format if the display shows it */
+static const char *
+pick_output(struct display *disp, uint32_t in)
+{
+	static const uint32_t order[] = {
+		FOURCC('Y','U','Y','V'), FOURCC('U','Y','V','Y'),
+		FOURCC('N','V','1','2'),
+	};
+	unsigned int i;
+
+	if (vpe_takes(in) && disp_supports_format(disp, in) != 0)
+		return vpe_format_name(in);
+	for (i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+		if (disp_supports_format(disp, order[i]) != 0)
+			return vpe_format_name(order[i]);
+	return NULL;
+}
+
+/**
+ *****************************************************************************
+ * @brief:  resolve "auto" formats against what vip and the display support
+ *
+ * @param:  vpe   struct vpe pointer
+ * @param:  src   SRCFormat argument
+ * @param:  dst   DSTFormat argument
+ *
+ * @return: 0 on success
+ *****************************************************************************
+*/
+int negotiate_formats(struct vpe *vpe, char *src, char *dst)
+{
+	struct capture_path path;
+	const char *name;
+	bool src_auto = !strcmp(src, "auto");
+	bool dst_auto = !strcmp(dst, "auto");
+
+	if (!src_auto && !dst_auto)
+		return 0;
+
+	/* vip's format is given, only the display side is open */
+	if (!src_auto) {
+		name = pick_output(vpe->disp, vpe->src.fourcc);
+		if (!name) {
+			ERROR("display takes none of yuyv, uyvy, nv12");
+			return -1;
+		}
+		describeFormat((char *)name, &vpe->dst);
+		return 0;
+	}
+
+	if (capture_negotiate(vipfd, vpe->disp, vpe->src.width,
+			vpe->src.height, vpe_takes, &path))
+		return -1;
+
+	vpe->src.width = path.width;
+	vpe->src.height = path.height;
+	describeFormat((char *)vpe_format_name(path.v4l2_fourcc), &vpe->src);
+	vpe->src.coplanar = 0;
+	if (dst_auto)
+		describeFormat((char *)vpe_format_name(path.fourcc), &vpe->dst);
+
+	/* the display could take vip's frames as they are */
+	if (!path.convert && !vpe->deint && vpe->src.fourcc == vpe->dst.fourcc &&
+			vpe->src.width == vpe->dst.width &&
+			vpe->src.height == vpe->dst.height)
+		MSG("VPE pass does nothing here, v4l2capturedisplay would "
+				"save ~%.0f MB/s", path.mbps);
+
+	return 0;
+}
+
 /**
  *****************************************************************************
  * @brief:  set format for vip
@@ -156,8 +246,9 @@ int allocate_shared_buffers(struct vpe *vpe)
 
     	for (i = 0; i < NUMBUF; i++) {
 		/** Get DMABUF fd for corresponding buffer object */
-		vpe->input_buf_dmafd[i] = omap_bo_dmabuf(shared_bufs[i]->bo[0]);
-		shared_bufs[i]->fd[0] = vpe->input_buf_dmafd[i];
+		if (shared_bufs[i]->fd[0] <= 0)
+			shared_bufs[i]->fd[0] = omap_bo_dmabuf(shared_bufs[i]->bo[0]);
+		vpe->input_buf_dmafd[i] = shared_bufs[i]->fd[0];
 		dprintf("vpe->input_buf_dmafd[%d] = %d\n", i, vpe->input_buf_dmafd[i]);
 	}
 
@@ -247,7 +338,9 @@ int main(int argc, char *argv[])
 		printf (
 		"USAGE : <SRCWidth> <SRCHeight> <SRCFormat> "
 			"<DSTWidth> <DSTHeight> <DSTformat> "
-			"<interlace> <translen> -s <connector_id>:<mode>\n");
+			"<interlace> <translen> -s <connector_id>:<mode>\n"
+		"        formats may be \"auto\": the cheapest one vip and "
+			"the display agree on\n");
 
 		return 1;
 	}
@@ -257,14 +350,16 @@ int main(int argc, char *argv[])
 
 	vpe->src.width	= atoi (argv[1]);
 	vpe->src.height	= atoi (argv[2]);
-	describeFormat (argv[3], &vpe->src);
+	if (strcmp(argv[3], "auto"))
+		describeFormat (argv[3], &vpe->src);
 
 	/* Force input format to be single plane */
 	vpe->src.coplanar = 0;
 
 	vpe->dst.width	= atoi (argv[4]);
 	vpe->dst.height = atoi (argv[5]);
-	describeFormat (argv[6], &vpe->dst);
+	if (strcmp(argv[6], "auto"))
+		describeFormat (argv[6], &vpe->dst);
 
 	vpe->deint = atoi (argv[7]);
 	vpe->translen = atoi (argv[8]);
@@ -273,11 +368,6 @@ int main(int argc, char *argv[])
 		fin,  vpe->src.width, vpe->src.height, vpe->src.fourcc,
 		vpe->dst.width, vpe->dst.height, vpe->dst.fourcc);
 
-	if (	vpe->src.height < 0 || vpe->src.width < 0 || vpe->src.fourcc < 0 || \
-		vpe->dst.height < 0 || vpe->dst.width < 0 || vpe->dst.fourcc < 0) {
-		pexit("Invalid parameters\n");
-	}
-
 	vipfd = open ("/dev/video1",O_RDWR);
 	if (vipfd < 0)
 		pexit("Can't open camera: /dev/video1\n");
@@ -292,6 +382,14 @@ int main(int argc, char *argv[])
 
 	dprintf("display open success!!!\n");
 
+	if (negotiate_formats(vpe, argv[3], argv[6]))
+		pexit("Can't negotiate formats\n");
+
+	if (	vpe->src.height < 0 || vpe->src.width < 0 || vpe->src.fourcc < 0 || \
+		vpe->dst.height < 0 || vpe->dst.width < 0 || vpe->dst.fourcc < 0) {
+		pexit("Invalid parameters\n");
+	}
+
 	vip_set_format(vpe->src.width, vpe->src.height, vpe->src.fourcc);
 
 	vip_reqbuf();
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2020 DeVdistress
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Linear vs TILER buffer layout.
+ *
+ * Whether a TILER (2D) buffer is faster than a linear one depends on who
+ * writes and reads it.  bo_layout_bench() times CPU fill, copy and read
+ * for both layouts at 8, 16 and 32 bpp, and keeps the faster layout per
+ * buffer role in a small text file:
+ *
+ *   scanout: written by the CPU, read by DSS           -> fill + read
+ *   video:   written by capture/VPE/copy, read by DSS  -> copy + read
+ *
+ * DSS fetch bandwidth can't be measured from userspace, CPU reads
+ * through the same mapping stand in for it.  Rotation, which needs the
+ * TILER anyway, is not considered.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BENCH_REPS 8
+
+static const uint32_t bench_bpp[] = { 8, 16, 32 };
+
+static const char *role_names[] = {
+	[BO_ROLE_SCANOUT] = "scanout",
+	[BO_ROLE_VIDEO]   = "video",
+};
+
+/* -1: no policy, 0: linear, 1: tiled; indexed by role and bpp / 16 */
+static int policy[2][3] = { { -1, -1, -1 }, { -1, -1, -1 } };
+static bool policy_loaded;
+
+struct bench_bo {
+	struct omap_bo *bo;
+	uint8_t *map;
+	uint32_t pitch;
+};
+
+static int
+bench_bo_new(struct omap_device *dev, uint32_t bpp, uint32_t width,
+		uint32_t height, bool tiled, struct bench_bo *b)
+{
+	uint32_t flags = OMAP_BO_WC;
+
+	/* same layouts as alloc_bo() in display-kms.c */
+	if (tiled) {
+		flags |= bpp == 8 ? OMAP_BO_TILED_8 :
+				bpp == 16 ? OMAP_BO_TILED_16 : OMAP_BO_TILED_32;
+		b->bo = omap_bo_new_tiled(dev, ALIGN2(width, 7), height, flags);
+		b->pitch = ALIGN2(width * bpp / 8, PAGE_SHIFT);
+	} else {
+		b->bo = omap_bo_new(dev, width * height * bpp / 8, flags);
+		b->pitch = width * bpp / 8;
+	}
+
+	if (!b->bo)
+		return -1;
+
+	b->map = omap_bo_map(b->bo);
+	if (!b->map) {
+		omap_bo_del(b->bo);
+		return -1;
+	}
+
+	return 0;
+}
+
+static long
+usecs_since(struct timeval *t0)
+{
+	struct timeval t1;
+
+	gettimeofday(&t1, NULL);
+	return (t1.tv_sec - t0->tv_sec) * 1000000 + (t1.tv_usec - t0->tv_usec);
+}
+
+static double
+mbps(uint32_t bytes, long usecs)
+{
+	return usecs > 0 ? (double)bytes * BENCH_REPS / usecs : 0;
+}
+
+/* fill, copy and read throughput in MB/s, for one bpp and layout */
+static int
+bench_one(struct omap_device *dev, uint32_t bpp, uint32_t width,
+		uint32_t height, bool tiled, double res[3])
+{
+	struct bench_bo src, dst;
+	uint32_t row = width * bpp / 8, bytes = row * height;
+	volatile uint64_t sink = 0;
+	struct timeval t0;
+	uint32_t r, y, x;
+
+	if (bench_bo_new(dev, bpp, width, height, tiled, &src))
+		return -1;
+	if (bench_bo_new(dev, bpp, width, height, tiled, &dst)) {
+		omap_bo_del(src.bo);
+		return -1;
+	}
+
+	for (y = 0; y < height; y++)
+		memset(src.map + y * src.pitch, y, row);
+
+	gettimeofday(&t0, NULL);
+	omap_bo_cpu_prep(dst.bo, OMAP_GEM_WRITE);
+	for (r = 0; r < BENCH_REPS; r++)
+		for (y = 0; y < height; y++)
+			memset(dst.map + y * dst.pitch, r + y, row);
+	omap_bo_cpu_fini(dst.bo, OMAP_GEM_WRITE);
+	res[0] = mbps(bytes, usecs_since(&t0));
+
+	gettimeofday(&t0, NULL);
+	omap_bo_cpu_prep(src.bo, OMAP_GEM_READ);
+	omap_bo_cpu_prep(dst.bo, OMAP_GEM_WRITE);
+	for (r = 0; r < BENCH_REPS; r++)
+		for (y = 0; y < height; y++)
+			memcpy(dst.map + y * dst.pitch, src.map + y * src.pitch, row);
+	omap_bo_cpu_fini(dst.bo, OMAP_GEM_WRITE);
+	omap_bo_cpu_fini(src.bo, OMAP_GEM_READ);
+	res[1] = mbps(bytes, usecs_since(&t0));
+
+	gettimeofday(&t0, NULL);
+	omap_bo_cpu_prep(src.bo, OMAP_GEM_READ);
+	for (r = 0; r < BENCH_REPS; r++) {
+		for (y = 0; y < height; y++) {
+			const uint64_t *p = (const uint64_t *)(src.map + y * src.pitch);
+			uint64_t sum = 0;
+			for (x = 0; x < row / 8; x++)
+				sum += p[x];
+			sink += sum;
+		}
+	}
+	omap_bo_cpu_fini(src.bo, OMAP_GEM_READ);
+	res[2] = mbps(bytes, usecs_since(&t0));
+
+	omap_bo_del(src.bo);
+	omap_bo_del(dst.bo);
+	(void)sink;
+
+	return 0;
+}
+
+/* time to produce and scan out one frame, lower is better */
+static double
+frame_cost(enum bo_role role, const double res[3])
+{
+	double write = role == BO_ROLE_SCANOUT ? res[0] : res[1];
+
+	if (write <= 0 || res[2] <= 0)
+		return 1e30;
+	return 1 / write + 1 / res[2];
+}
+
+int
+bo_layout_bench(struct omap_device *dev, uint32_t width, uint32_t height,
+		const char *path)
+{
+	double res[2][3];
+	unsigned int i, t, role;
+	char *tmp;
+	FILE *f;
+	int fd;
+
+	if (!width || !height) {
+		width = 1920;
+		height = 1080;
+	}
+
+	/*
+	 * Write a new file next to it and rename it over path: this never
+	 * follows a link someone else put at path.
+	 */
+	tmp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		ERROR("could not write %s: %s", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	fprintf(f, "# omap bo layout policy, written by --bo-bench\n");
+	fprintf(f, "# role bpp layout  (fill copy read MB/s linear / tiled, %ux%u)\n",
+			width, height);
+
+	MSG("bo layout benchmark, %ux%u, %d passes:", width, height, BENCH_REPS);
+	MSG("  bpp  layout   fill MB/s  copy MB/s  read MB/s");
+
+	for (i = 0; i < sizeof(bench_bpp) / sizeof(bench_bpp[0]); i++) {
+		uint32_t bpp = bench_bpp[i];
+
+		for (t = 0; t < 2; t++) {
+			if (bench_one(dev, bpp, width, height, t, res[t])) {
+				ERROR("%s %ubpp allocation failed",
+						t ? "tiled" : "linear", bpp);
+				res[t][0] = res[t][1] = res[t][2] = 0;
+			}
+			MSG("  %3u  %-7s %10.1f %10.1f %10.1f", bpp,
+					t ? "tiled" : "linear",
+					res[t][0], res[t][1], res[t][2]);
+		}
+
+		for (role = 0; role < 2; role++) {
+			int tiled = frame_cost(role, res[1]) < frame_cost(role, res[0]);
+
+			policy[role][bpp / 16] = tiled;
+			fprintf(f, "%s %u %s  (%.1f %.1f %.1f / %.1f %.1f %.1f)\n",
+					role_names[role], bpp, tiled ? "tiled" : "linear",
+					res[0][0], res[0][1], res[0][2],
+					res[1][0], res[1][1], res[1][2]);
+			MSG("  -> %s %ubpp: %s", role_names[role], bpp,
+					tiled ? "tiled" : "linear");
+		}
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		ERROR("could not write %s: %s", path, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	policy_loaded = true;
+	MSG("bo layout policy saved to %s", path);
+
+	return 0;
+}
+
+static void
+policy_load(const char *path)
+{
+	char line[256], role[16], layout[16];
+	unsigned int bpp, r, i;
+	FILE *f;
+
+	policy_loaded = true;
+
+	f = fopen(path, "r");
+	if (!f) {
+		MSG("bo layout policy %s: %s", path, strerror(errno));
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' ||
+				sscanf(line, "%15s %u %15s", role, &bpp, layout) != 3)
+			continue;
+		if (bpp != 8 && bpp != 16 && bpp != 32)
+			continue;
+		for (r = 0; r < 2; r++)
+			if (!strcmp(role, role_names[r]))
+				policy[r][bpp / 16] = !strcmp(layout, "tiled");
+	}
+
+	fclose(f);
+
+	MSG("bo layout policy from %s:", path);
+	for (r = 0; r < 2; r++)
+		for (i = 0; i < 3; i++)
+			if (policy[r][i] >= 0)
+				MSG("  %s %ubpp: %s", role_names[r], bench_bpp[i],
+						policy[r][i] ? "tiled" : "linear");
+}
+
+bool
+bo_layout_tiled(const char *path, enum bo_role role, uint32_t bpp)
+{
+	if (!policy_loaded)
+		policy_load(path);
+	if (bpp != 8 && bpp != 16 && bpp != 32)
+		return false;
+	return policy[role][bpp / 16] == 1;
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2020 DeVdistress
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Capture format negotiation.
+ *
+ * Walks VIDIOC_ENUM_FMT / ENUM_FRAMESIZES / ENUM_FRAMEINTERVALS of a
+ * capture device and asks the display which of those formats it can put
+ * on an overlay as is.  Candidates are ranked by
+ *
+ *   1. no conversion: the display shows the capture format directly,
+ *      otherwise a VPE pass to the first format the display takes
+ *   2. size: the requested size, else the closest one (largest if none
+ *      was requested), which the overlay scales
+ *   3. frame rate: highest
+ *   4. memory traffic: lowest
+ *
+ * Traffic is estimated per frame as the capture write and the scanout
+ * read, plus the VPE read and write when converting.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+
+/* formats both sides know, with the display's name for them */
+static const struct {
+	uint32_t v4l2, fourcc, bpp;
+} known[] = {
+	{ V4L2_PIX_FMT_YUYV,   FOURCC('Y','U','Y','V'), 16 },
+	{ V4L2_PIX_FMT_UYVY,   FOURCC('U','Y','V','Y'), 16 },
+	{ V4L2_PIX_FMT_NV12,   FOURCC('N','V','1','2'), 12 },
+	{ V4L2_PIX_FMT_YUV420, FOURCC('I','4','2','0'), 12 },
+};
+#define NKNOWN (sizeof(known) / sizeof(known[0]))
+#define DEFAULT_FPS 30
+
+static int
+xioctl(int fd, unsigned long request, void *arg)
+{
+	int r;
+
+	do r = ioctl(fd, request, arg);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+static int
+find_known(uint32_t v4l2)
+{
+	unsigned int i;
+
+	for (i = 0; i < NKNOWN; i++)
+		if (known[i].v4l2 == v4l2)
+			return i;
+	return -1;
+}
+
+static bool
+display_takes(struct display *disp, uint32_t fourcc)
+{
+	/* displays that don't say convert on their own */
+	return disp_supports_format(disp, fourcc) != 0;
+}
+
+static uint32_t
+frame_bytes(uint32_t w, uint32_t h, uint32_t bpp)
+{
+	return w * h / 8 * bpp;
+}
+
+static void
+estimate(struct capture_path *p)
+{
+	double fps = p->fps_num ? (double)p->fps_num / p->fps_den : DEFAULT_FPS;
+	double bytes = 2.0 * frame_bytes(p->width, p->height, p->bpp);
+
+	if (p->convert)
+		bytes += 2.0 * frame_bytes(p->width, p->height, p->out_bpp);
+	p->mbps = bytes * fps / 1000000;
+}
+
+/* highest rate the device gives for this format and size, 0 if unknown */
+static void
+best_interval(int fd, struct capture_path *p)
+{
+	struct v4l2_frmivalenum ival;
+
+	p->fps_num = p->fps_den = 0;
+
+	memset(&ival, 0, sizeof(ival));
+	ival.pixel_format = p->v4l2_fourcc;
+	ival.width = p->width;
+	ival.height = p->height;
+
+	for (ival.index = 0; !xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival);
+			ival.index++) {
+		struct v4l2_fract *f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE ?
+				&ival.discrete : &ival.stepwise.min;
+
+		/* interval n/d s, i.e. d/n fps; keep the largest d/n */
+		if (f->numerator && (!p->fps_num ||
+				(uint64_t)f->denominator * p->fps_den >
+				(uint64_t)p->fps_num * f->numerator)) {
+			p->fps_num = f->denominator;
+			p->fps_den = f->numerator;
+		}
+		if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+			break;
+	}
+}
+
+static uint64_t
+size_distance(uint32_t w, uint32_t h, uint32_t want_w, uint32_t want_h)
+{
+	int64_t d = (int64_t)w * h - (int64_t)want_w * want_h;
+
+	/* nothing requested: the bigger the better */
+	if (!want_w || !want_h)
+		return UINT32_MAX - (uint64_t)w * h / 16;
+	if (w == want_w && h == want_h)
+		return 0;
+	return 1 + (d < 0 ? -d : d);
+}
+
+/* true when a is a better path than b */
+static bool
+better(const struct capture_path *a, const struct capture_path *b,
+		uint32_t want_w, uint32_t want_h)
+{
+	uint64_t da, db, ra, rb;
+
+	if (a->convert != b->convert)
+		return !a->convert;
+
+	da = size_distance(a->width, a->height, want_w, want_h);
+	db = size_distance(b->width, b->height, want_w, want_h);
+	if (da != db)
+		return da < db;
+
+	/* compare a->fps_num/a->fps_den with b's, unknown counts as default */
+	ra = (uint64_t)(a->fps_num ? a->fps_num : DEFAULT_FPS) *
+			(b->fps_num ? b->fps_den : 1);
+	rb = (uint64_t)(b->fps_num ? b->fps_num : DEFAULT_FPS) *
+			(a->fps_num ? a->fps_den : 1);
+	if (ra != rb)
+		return ra > rb;
+
+	return a->mbps < b->mbps;
+}
+
+static void
+consider(int fd, struct capture_path *cand, struct capture_path *best,
+		bool *found, uint32_t want_w, uint32_t want_h)
+{
+	best_interval(fd, cand);
+	estimate(cand);
+
+	DBG("  %.4s %ux%u @ %.2f fps%s, ~%.0f MB/s",
+			(char *)&cand->v4l2_fourcc, cand->width, cand->height,
+			cand->fps_num ? (double)cand->fps_num / cand->fps_den : 0.0,
+			cand->convert ? " (convert)" : "", cand->mbps);
+
+	if (!*found || better(cand, best, want_w, want_h)) {
+		*best = *cand;
+		*found = true;
+	}
+}
+
+static uint32_t
+clamp_step(uint32_t v, uint32_t min, uint32_t max, uint32_t step)
+{
+	if (v < min)
+		v = min;
+	if (v > max)
+		v = max;
+	if (step > 1)
+		v = min + (v - min) / step * step;
+	return v;
+}
+
+int
+capture_negotiate(int fd, struct display *disp, uint32_t width,
+		uint32_t height, bool (*accept)(uint32_t fourcc),
+		struct capture_path *path)
+{
+	struct v4l2_fmtdesc desc;
+	struct capture_path cand, best;
+	uint32_t out_fourcc = 0, out_bpp = 0;
+	bool found = false;
+	unsigned int i;
+
+	/* what a VPE pass would convert to */
+	for (i = 0; i < NKNOWN && !out_fourcc; i++) {
+		if (accept && !accept(known[i].fourcc))
+			continue;
+		if (display_takes(disp, known[i].fourcc)) {
+			out_fourcc = known[i].fourcc;
+			out_bpp = known[i].bpp;
+		}
+	}
+	if (!out_fourcc) {
+		ERROR("display takes none of the usable formats");
+		return -1;
+	}
+
+	DBG("capture formats:");
+
+	memset(&desc, 0, sizeof(desc));
+	desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for (desc.index = 0; !xioctl(fd, VIDIOC_ENUM_FMT, &desc); desc.index++) {
+		struct v4l2_frmsizeenum size;
+		int k = find_known(desc.pixelformat);
+
+		if (k < 0 || (accept && !accept(known[k].fourcc))) {
+			DBG("  %.4s (%s): not handled", (char *)&desc.pixelformat,
+					desc.description);
+			continue;
+		}
+
+		memset(&cand, 0, sizeof(cand));
+		cand.v4l2_fourcc = desc.pixelformat;
+		cand.bpp = known[k].bpp;
+		cand.convert = !display_takes(disp, known[k].fourcc);
+		cand.fourcc = cand.convert ? out_fourcc : known[k].fourcc;
+		cand.out_bpp = cand.convert ? out_bpp : cand.bpp;
+
+		memset(&size, 0, sizeof(size));
+		size.pixel_format = desc.pixelformat;
+		for (size.index = 0; !xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size);
+				size.index++) {
+			if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+				cand.width = size.discrete.width;
+				cand.height = size.discrete.height;
+			} else {
+				const struct v4l2_frmsize_stepwise *s = &size.stepwise;
+
+				cand.width = clamp_step(width ? width : s->max_width,
+						s->min_width, s->max_width, s->step_width);
+				cand.height = clamp_step(height ? height : s->max_height,
+						s->min_height, s->max_height, s->step_height);
+			}
+			consider(fd, &cand, &best, &found, width, height);
+			if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+				break;
+		}
+
+		/* no size enumeration: ask for the requested size, S_FMT adjusts */
+		if (size.index == 0 && width && height) {
+			cand.width = width;
+			cand.height = height;
+			consider(fd, &cand, &best, &found, width, height);
+		}
+	}
+
+	if (!found) {
+		ERROR("no usable capture format");
+		return -1;
+	}
+
+	*path = best;
+	capture_path_print(path);
+
+	return 0;
+}
+
+int
+capture_set_rate(int fd, const struct capture_path *path)
+{
+	struct v4l2_streamparm parm;
+
+	if (!path->fps_num)
+		return 0;
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == xioctl(fd, VIDIOC_G_PARM, &parm) ||
+			!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+		return 0;
+
+	parm.parm.capture.timeperframe.numerator = path->fps_den;
+	parm.parm.capture.timeperframe.denominator = path->fps_num;
+	if (-1 == xioctl(fd, VIDIOC_S_PARM, &parm)) {
+		ERROR("could not set %u/%u fps: %s", path->fps_num,
+				path->fps_den, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+capture_path_print(const struct capture_path *path)
+{
+	char rate[32];
+
+	if (path->fps_num)
+		snprintf(rate, sizeof(rate), "%.2f fps",
+				(double)path->fps_num / path->fps_den);
+	else
+		snprintf(rate, sizeof(rate), "? fps (%d assumed)", DEFAULT_FPS);
+
+	if (path->convert)
+		MSG("capture path: %ux%u %.4s @ %s -> VPE -> %.4s -> display, "
+				"~%.0f MB/s", path->width, path->height,
+				(char *)&path->v4l2_fourcc, rate,
+				(char *)&path->fourcc, path->mbps);
+	else
+		MSG("capture path: %ux%u %.4s @ %s -> display, no conversion, "
+				"~%.0f MB/s", path->width, path->height,
+				(char *)&path->fourcc, rate, path->mbps);
+}
@@ -35,11 +35,14 @@
 #endif
 
 
+#include <sys/stat.h>
+
 #include "demux.h"
 #include "util.h"
 
 char mpeg4head[45] = {0,0,0,0};
 int get_esds_offset(const char *filename, struct demux *demux);
+static int kfi_load(struct demux *demux);
 
 static AVFormatContext *
 open_file(const char *filename)
@@ -76,12 +79,68 @@ find_stream(AVFormatContext *afc)
 	return st;
 }
 
+static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+
+/*
+ * avcC extradata: NAL length size, then the SPS and PPS with 16 bit
+ * lengths.  Keep them as Annex B, to go in front of IDR frames, which
+ * is all h264_mp4toannexb did for us.
+ */
+static int
+parse_avcc(struct demux *demux, const uint8_t *p, int size)
+{
+	const uint8_t *end = p + size;
+	uint8_t *hdr;
+	int i, n, len, hdr_size = 0;
+
+	if (size < 7)
+		return -1;
+	demux->nal_length_size = (p[4] & 3) + 1;
+
+	/* twice: measure, then copy */
+	hdr = NULL;
+	for (;;) {
+		const uint8_t *q = p + 5;
+		int pos = 0;
+
+		for (i = 0; i < 2; i++) {
+			if (q >= end)
+				return -1;
+			n = *q++ & (i ? 0xff : 0x1f);
+			while (n--) {
+				if (q + 2 > end)
+					return -1;
+				len = q[0] << 8 | q[1];
+				q += 2;
+				if (q + len > end)
+					return -1;
+				if (hdr) {
+					memcpy(hdr + pos, start_code, 4);
+					memcpy(hdr + pos + 4, q, len);
+				}
+				pos += 4 + len;
+				q += len;
+			}
+		}
+
+		if (hdr)
+			break;
+		hdr_size = pos;
+		hdr = malloc(hdr_size);
+		if (!hdr)
+			return -1;
+	}
+
+	demux->annexb_hdr = hdr;
+	demux->annexb_hdr_size = hdr_size;
+	return 0;
+}
+
 static struct demux * open_stream(const char * filename, int *width, int *height)
 {
 	AVFormatContext *afc = open_file(filename);
 	AVStream *st = find_stream(afc);
 	AVCodecContext *cc = st->codec;
-	AVBitStreamFilterContext *bsf = NULL;
 	struct demux *demux;
 
 	if ((cc->codec_id != AV_CODEC_ID_H264) &&  (cc->codec_id != AV_CODEC_ID_MPEG2VIDEO) && ( cc->codec_id !=  AV_CODEC_ID_MPEG4)){
@@ -89,15 +148,6 @@ static struct demux * open_stream(const char * filename, int *width, int *height
 		return NULL;
 	}
 
-	if (cc->extradata && cc->extradata_size > 0 && cc->extradata[0] == 1) {
-		MSG("initializing bitstream filter");
-		bsf = av_bitstream_filter_init("h264_mp4toannexb");
-		if (!bsf) {
-			ERROR("could not open '%s': failed to initialize bitstream filter", filename);
-			return NULL;
-		}
-	}
-
 	*width = cc->width;
 	*height = cc->height;
 
@@ -106,8 +156,18 @@ static struct demux * open_stream(const char * filename, int *width, int *height
 	demux->afc = afc;
 	demux->cc  = cc;
 	demux->st  = st;
-	demux->bsf = bsf;
 	demux->first_in_buff = 0;
+	demux->filename = strdup(filename);
+	demux->kf_building = 1;
+
+	if (cc->extradata && cc->extradata_size > 0 && cc->extradata[0] == 1) {
+		MSG("converting avcC to Annex B");
+		if (parse_avcc(demux, cc->extradata, cc->extradata_size)) {
+			ERROR("could not open '%s': bad avcC extradata", filename);
+			free(demux);
+			return NULL;
+		}
+	}
 
 	return demux;
 }
@@ -123,10 +183,59 @@ struct demux * demux_init(const char * filename, int *width, int *height)
 		if(get_esds_offset(filename, demux))
 			return NULL;
 	}
+	/* an index from an earlier run, else build one on the first pass */
+	if (demux)
+		kfi_load(demux);
 
 	return demux;
 }
 
+struct demux * demux_init_synthetic(int width, int height, int frames)
+{
+	struct demux *demux = calloc(1, sizeof(*demux));
+
+	if (!demux)
+		return NULL;
+	demux->st = calloc(1, sizeof(*demux->st));
+	demux->cc = calloc(1, sizeof(*demux->cc));
+	if (!demux->st || !demux->cc) {
+		demux_deinit(demux);
+		return NULL;
+	}
+
+	demux->cc->codec_id = AV_CODEC_ID_H264;
+	demux->cc->width = width;
+	demux->cc->height = height;
+	demux->st->codec = demux->cc;
+	demux->st->avg_frame_rate.num = 30;
+	demux->st->avg_frame_rate.den = 1;
+	demux->synthetic = demux->synthetic_frames = frames;
+
+	return demux;
+}
+
+/* one slice NAL of about 1/16 of a 4:2:0 frame, keyframe-sized every 30 */
+static int
+synthetic_read(struct demux *demux, uint8_t *dst, int size)
+{
+	int n = demux->synthetic_frames - demux->synthetic;
+	int len = demux->cc->width * demux->cc->height * 3 / 2 / (n % 30 ? 32 : 8);
+
+	if (!demux->synthetic)
+		return 0;
+	demux->synthetic--;
+
+	if (len > size)
+		len = size;
+	if (len < 5)
+		return 0;
+	memcpy(dst, start_code, 4);
+	dst[4] = n % 30 ? 0x41 : 0x65;
+	memset(dst + 5, n & 0xff, len - 5);
+
+	return len;
+}
+
 int get_esds_offset(const char *filename, struct demux *demux) {
        FILE *inputStream;
        int i=0;
@@ -175,43 +284,485 @@ int get_esds_offset(const char *filename, struct demux *demux) {
 
 
 
+/*
+ * Length-prefixed NALs to Annex B, written straight into the decoder's
+ * input buffer: SPS/PPS go in front of an IDR slice unless the access
+ * unit carries its own.  Returns the bytes written, truncated to size.
+ */
+static int
+write_annexb(struct demux *demux, uint8_t *dst, int size,
+		const uint8_t *p, int len)
+{
+	const uint8_t *end = p + len;
+	int pos = 0, i, n, type;
+	bool have_ps = false;
+
+	while (end - p > demux->nal_length_size) {
+		for (i = 0, n = 0; i < demux->nal_length_size; i++)
+			n = n << 8 | *p++;
+		if (n <= 0 || n > end - p)
+			break;
+
+		type = p[0] & 0x1f;
+		if (type == 7 || type == 8)
+			have_ps = true;
+		if (type == 5 && !have_ps && demux->annexb_hdr_size &&
+				pos + demux->annexb_hdr_size <= size) {
+			frame_copy_row(dst + pos, demux->annexb_hdr,
+					demux->annexb_hdr_size);
+			pos += demux->annexb_hdr_size;
+			have_ps = true;
+		}
+
+		if (pos + 4 > size)
+			break;
+		memcpy(dst + pos, start_code, 4);
+		pos += 4;
+		if (n > size - pos)
+			n = size - pos;
+		frame_copy_row(dst + pos, p, n);
+		pos += n;
+		p += n;
+	}
+
+	return pos;
+}
+
+/*
+ * Keyframe index.  Seeking goes to the last keyframe at or before the
+ * target by binary search, and fast-forward jumps from keyframe to
+ * keyframe, so neither reads the packets in between.  Indexes built by
+ * reading the stream are saved to <file>.kfi and reused while the file
+ * keeps its size and mtime; container indexes (mp4, indexed mkv/avi)
+ * are free and not saved.
+ */
+
+#define KFI_MAGIC "KFI1"
+/* a container index ending this far before the end misses keyframes */
+#define KFI_MAX_GAP_MS 10000
+
+/* host byte order, it's a cache next to the file */
+struct kfi_header {
+	char magic[4];
+	uint32_t nkf;
+	int32_t tb_num, tb_den;
+	uint32_t byte_seek, pad;
+	int64_t size, mtime;
+};
+
+static int64_t
+packet_ts(const AVPacket *pk)
+{
+	return pk->dts != AV_NOPTS_VALUE ? pk->dts : pk->pts;
+}
+
+static int
+kf_add(struct demux *demux, int64_t ts, int64_t pos)
+{
+	if (ts == AV_NOPTS_VALUE)
+		return 0;
+	if (demux->nkf && ts <= demux->kf[demux->nkf - 1].ts)
+		return 0;
+
+	if (demux->nkf == demux->kf_cap) {
+		int cap = demux->kf_cap ? 2 * demux->kf_cap : 256;
+		struct demux_kf *kf = realloc(demux->kf, cap * sizeof(*kf));
+
+		if (!kf)
+			return -1;
+		demux->kf = kf;
+		demux->kf_cap = cap;
+	}
+	demux->kf[demux->nkf].ts = ts;
+	demux->kf[demux->nkf].pos = pos;
+	demux->nkf++;
+
+	return 0;
+}
+
+/* last keyframe at or before ts, the first one if there is none */
+static int
+kf_find(struct demux *demux, int64_t ts)
+{
+	int lo = 0, hi = demux->nkf - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+
+		if (demux->kf[mid].ts <= ts)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+static int
+kf_goto(struct demux *demux, int i)
+{
+	const struct demux_kf *kf = &demux->kf[i];
+	int err = -1;
+
+	if (demux->kf_byte_seek && kf->pos >= 0)
+		err = av_seek_frame(demux->afc, demux->st->index, kf->pos,
+				AVSEEK_FLAG_BYTE);
+	if (err < 0)
+		err = av_seek_frame(demux->afc, demux->st->index, kf->ts,
+				AVSEEK_FLAG_BACKWARD);
+	if (err < 0)
+		return err;
+
+	demux->kf_cur = i;
+	demux->need_key = 1;
+	if (!demux->kf_complete)
+		demux->kf_building = 0;
+
+	return 0;
+}
+
+static char *
+kfi_name(struct demux *demux, const char *suffix)
+{
+	size_t len = strlen(demux->filename) + strlen(suffix) + 1;
+	char *name = malloc(len);
+
+	if (name)
+		snprintf(name, len, "%s%s", demux->filename, suffix);
+	return name;
+}
+
+static int
+kfi_stat(struct demux *demux, struct kfi_header *h)
+{
+	struct stat sb;
+
+	if (stat(demux->filename, &sb))
+		return -1;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, KFI_MAGIC, sizeof(h->magic));
+	h->tb_num = demux->st->time_base.num;
+	h->tb_den = demux->st->time_base.den;
+	h->size = sb.st_size;
+	h->mtime = sb.st_mtime;
+
+	return 0;
+}
+
+static int
+kfi_load(struct demux *demux)
+{
+	struct kfi_header want, h;
+	struct demux_kf *kf = NULL;
+	char *name = kfi_name(demux, ".kfi");
+	FILE *f = name ? fopen(name, "rb") : NULL;
+	long len;
+
+	if (!f || kfi_stat(demux, &want))
+		goto fail;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+			memcmp(h.magic, want.magic, sizeof(h.magic)) ||
+			h.tb_num != want.tb_num || h.tb_den != want.tb_den ||
+			h.size != want.size || h.mtime != want.mtime || !h.nkf)
+		goto stale;
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 ||
+			(unsigned long)len != sizeof(h) + h.nkf * sizeof(*kf) ||
+			fseek(f, sizeof(h), SEEK_SET))
+		goto stale;
+
+	kf = malloc(h.nkf * sizeof(*kf));
+	if (!kf || fread(kf, sizeof(*kf), h.nkf, f) != h.nkf)
+		goto stale;
+
+	free(demux->kf);
+	demux->kf = kf;
+	demux->nkf = demux->kf_cap = h.nkf;
+	demux->kf_byte_seek = h.byte_seek;
+	demux->kf_complete = 1;
+	demux->kf_building = 0;
+	MSG("%s: %d keyframes", name, demux->nkf);
+
+	fclose(f);
+	free(name);
+	return 0;
+
+stale:
+	DBG("%s: stale or damaged, ignored", name);
+	free(kf);
+fail:
+	if (f)
+		fclose(f);
+	free(name);
+	return -1;
+}
+
+static void
+kfi_save(struct demux *demux)
+{
+	struct kfi_header h;
+	char *name = kfi_name(demux, ".kfi");
+	char *tmp = kfi_name(demux, ".kfi.tmp");
+	FILE *f = NULL;
+
+	if (!name || !tmp || kfi_stat(demux, &h))
+		goto out;
+	h.nkf = demux->nkf;
+	h.byte_seek = demux->kf_byte_seek;
+
+	/* a directory we can't write to just means no cache */
+	f = fopen(tmp, "wb");
+	if (!f) {
+		DBG("%s: %s", tmp, strerror(errno));
+		goto out;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+			fwrite(demux->kf, sizeof(*demux->kf), demux->nkf, f) !=
+			(size_t)demux->nkf) {
+		fclose(f);
+		unlink(tmp);
+		goto out;
+	}
+	if (fclose(f) || rename(tmp, name))
+		unlink(tmp);
+	else
+		MSG("%s: saved %d keyframes", name, demux->nkf);
+
+out:
+	free(tmp);
+	free(name);
+}
+
+/* the first pass got to the end: the index is complete */
+static void
+kf_finish(struct demux *demux)
+{
+	demux->kf_building = 0;
+	if (!demux->nkf)
+		return;
+	demux->kf_complete = 1;
+	/* positions from the scan are only good for formats that seek by byte */
+	demux->kf_byte_seek =
+			!(demux->afc->iformat->flags & AVFMT_NO_BYTE_SEEK);
+	kfi_save(demux);
+}
+
+/* keyframes from the container's own index, if they reach the end */
+static int
+kf_from_container(struct demux *demux)
+{
+	AVStream *st = demux->st;
+	int64_t end, gap;
+	int i;
+
+	if (st->nb_index_entries <= 0 || st->duration == AV_NOPTS_VALUE ||
+			st->duration <= 0)
+		return -1;
+
+	demux->nkf = 0;
+	for (i = 0; i < st->nb_index_entries; i++) {
+		const AVIndexEntry *e = &st->index_entries[i];
+
+		if ((e->flags & AVINDEX_KEYFRAME) &&
+				kf_add(demux, e->timestamp, e->pos))
+			return -1;
+	}
+	if (!demux->nkf)
+		return -1;
+
+	end = st->duration;
+	if (st->start_time != AV_NOPTS_VALUE)
+		end += st->start_time;
+	gap = av_rescale_q(KFI_MAX_GAP_MS, (AVRational){ 1, 1000 },
+			st->time_base);
+	if (demux->kf[demux->nkf - 1].ts < end - gap) {
+		demux->nkf = 0;
+		return -1;
+	}
+
+	demux->kf_complete = 1;
+	demux->kf_building = 0;
+	demux->kf_byte_seek = 0;
+	MSG("%s: %d keyframes in the container index", demux->filename,
+			demux->nkf);
+
+	return 0;
+}
+
+/*
+ * Read the whole file once to find the keyframes.  av_read_frame() hands
+ * out every packet with its data, so this is a full pass over the input,
+ * only done when neither a saved index nor the container's will do.
+ */
+static int
+kf_scan(struct demux *demux)
+{
+	AVPacket pk = {};
+	uint64_t t = now_us();
+	int err;
+
+	MSG("%s: indexing keyframes, reading the whole file..",
+			demux->filename);
+	err = av_seek_frame(demux->afc, demux->st->index, 0, AVSEEK_FLAG_BYTE);
+	if (err < 0)
+		err = av_seek_frame(demux->afc, demux->st->index, 0,
+				AVSEEK_FLAG_FRAME);
+	if (err < 0)
+		return err;
+
+	demux->nkf = 0;
+	while (!av_read_frame(demux->afc, &pk)) {
+		if (pk.stream_index == demux->st->index &&
+				(pk.flags & AV_PKT_FLAG_KEY) &&
+				kf_add(demux, packet_ts(&pk), pk.pos)) {
+			av_free_packet(&pk);
+			return -1;
+		}
+		av_free_packet(&pk);
+	}
+	MSG("%s: %d keyframes in %.1f s", demux->filename, demux->nkf,
+			(now_us() - t) / 1000000.0);
+
+	kf_finish(demux);
+	if (!demux->kf_complete)
+		return -1;
+
+	return demux_rewind(demux);
+}
+
+int demux_index(struct demux *demux)
+{
+	if (!demux->afc)
+		return -1;
+	if (demux->kf_complete || !kfi_load(demux))
+		return 0;
+	if (!kf_from_container(demux))
+		return 0;
+	return kf_scan(demux);
+}
+
+int demux_seek(struct demux *demux, int64_t ms)
+{
+	AVStream *st = demux->st;
+	int64_t ts;
+	int i, err;
+
+	if (demux_index(demux) || !demux->nkf)
+		return -1;
+
+	ts = av_rescale_q(ms, (AVRational){ 1, 1000 }, st->time_base);
+	if (st->start_time != AV_NOPTS_VALUE)
+		ts += st->start_time;
+	i = kf_find(demux, ts);
+
+	err = kf_goto(demux, i);
+	if (err < 0)
+		return err;
+	demux->ff_advance = 0;
+
+	ts = demux->kf[i].ts;
+	if (st->start_time != AV_NOPTS_VALUE)
+		ts -= st->start_time;
+	MSG("%s: seek to %.3f s: keyframe %d at %.3f s", demux->filename,
+			ms / 1000.0, i,
+			av_rescale_q(ts, st->time_base, (AVRational){ 1, 1000 }) /
+			1000.0);
+
+	return 0;
+}
+
+int demux_set_ff(struct demux *demux, int step)
+{
+	if (step < 0 || !demux->afc)
+		return -1;
+
+	/* without an index fall back to dropping packets after demux */
+	if (step && demux_index(demux))
+		MSG("%s: no keyframe index, fast-forward reads every packet",
+				demux->filename);
+
+	demux->ff = step;
+	demux->ff_advance = 0;
+	demux->ff_skipped = 0;
+
+	return 0;
+}
+
+/* fast-forward: on to the keyframe step ahead, 1 at the end */
+static int
+ff_next(struct demux *demux)
+{
+	int i = demux->kf_cur + demux->ff;
+
+	if (!demux->kf_complete) {
+		demux->need_key = 1;
+		return 0;
+	}
+	if (!demux->ff_advance) {
+		demux->ff_advance = 1;
+		return 0;
+	}
+	if (i >= demux->nkf || kf_goto(demux, i) < 0)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Read the next packet of the video stream into input (the CPU mapping
+ * of a decoder input bo).  lavf hands out packets in its own buffers, so
+ * one copy is left, but it goes straight into input: avcC streams are
+ * converted on the way instead of through a bitstream filter and a
+ * temporary buffer.
+ */
 int demux_read(struct demux *demux, char *input, int size)
 {
 	AVPacket pk = {};
+	uint8_t *dst = (uint8_t *)input;
+
+	if (!demux->afc)
+		return synthetic_read(demux, dst, size);
+	if (demux->ff && ff_next(demux))
+		return 0;
 
 	while (!av_read_frame(demux->afc, &pk)) {
 		if (pk.stream_index == demux->st->index) {
-			uint8_t *buf;
-			int bufsize;
-
-			if (demux->bsf) {
-				int ret;
-				ret = av_bitstream_filter_filter(demux->bsf, demux->cc,
-						NULL, &buf, &bufsize, pk.data, pk.size, 0);
-				if (ret < 0) {
-					ERROR("bsf error: %d", ret);
-					return 0;
+			int bufsize = 0;
+
+			if (pk.flags & AV_PKT_FLAG_KEY) {
+				if (demux->kf_building &&
+						kf_add(demux, packet_ts(&pk), pk.pos))
+					demux->kf_building = 0;
+				/* no index: drop the keyframes fast-forward skips */
+				if (demux->ff && !demux->kf_complete &&
+						demux->ff_skipped++ % demux->ff) {
+					av_free_packet(&pk);
+					continue;
 				}
-			} else {
-				buf     = pk.data;
-				bufsize = pk.size;
+				demux->need_key = 0;
+			} else if (demux->need_key) {
+				av_free_packet(&pk);
+				continue;
 			}
 
-			if (bufsize > size)
-				bufsize = size;
-
-                        if(demux->first_in_buff == 1) {
-                               memcpy(input, demux->esds.data, demux->esds.length);
-                               memcpy(input + demux->esds.length, buf, bufsize);
-                               demux->first_in_buff =0;
-                               bufsize = bufsize + demux->esds.length;
-			}
-			else {
-                               memcpy(input, buf, bufsize);
+			if (demux->first_in_buff == 1) {
+				bufsize = demux->esds.length < size ?
+						demux->esds.length : size;
+				memcpy(dst, demux->esds.data, bufsize);
+				demux->first_in_buff = 0;
 			}
 
-			if (demux->bsf)
-				av_free(buf);
+			if (demux->nal_length_size) {
+				bufsize += write_annexb(demux, dst + bufsize,
+						size - bufsize, pk.data, pk.size);
+			} else {
+				int n = pk.size < size - bufsize ?
+						pk.size : size - bufsize;
+
+				frame_copy_row(dst + bufsize, pk.data, n);
+				bufsize += n;
+			}
+			frame_copy_fence();
 
 			av_free_packet(&pk);
 
@@ -220,19 +771,35 @@ int demux_read(struct demux *demux, char *input, int size)
 		av_free_packet(&pk);
 	}
 
+	if (demux->kf_building)
+		kf_finish(demux);
+
 	return 0;
 }
 
 int demux_rewind(struct demux *demux)
 {
+	if (!demux->afc) {
+		demux->synthetic = demux->synthetic_frames;
+		return 0;
+	}
+	demux->kf_cur = 0;
+	demux->ff_advance = 0;
+	demux->ff_skipped = 0;
 	return av_seek_frame(demux->afc, demux->st->index, 0, AVSEEK_FLAG_FRAME);
 }
 
 void demux_deinit(struct demux *demux)
 {
-	avformat_close_input(&demux->afc);
-	if (demux->bsf)
-		av_bitstream_filter_close(demux->bsf);
+	if (demux->afc) {
+		avformat_close_input(&demux->afc);
+	} else {
+		free(demux->st);
+		free(demux->cc);
+	}
+	free(demux->annexb_hdr);
 	free(demux->esds.data);
+	free(demux->kf);
+	free(demux->filename);
 	free(demux);
 }
@@ -37,6 +37,14 @@
 #include <libavcodec/avcodec.h>
 
 
+/* a keyframe: decode timestamp in st->time_base and byte offset, -1 if
+ * not known
+ */
+struct demux_kf {
+	int64_t ts;
+	int64_t pos;
+};
+
 struct ESdescriptor {
     int length;
     unsigned char *data;
@@ -46,14 +54,46 @@ struct demux {
     AVFormatContext *afc;
     AVStream *st;
     AVCodecContext *cc;
-    AVBitStreamFilterContext *bsf;
     struct ESdescriptor esds;
 /* Used for mpeg4 esds data copy */
 	int first_in_buff;
+/* H.264 in mp4/mkv (avcC): NAL length prefix size and the SPS/PPS, as
+ * Annex B, that go in front of IDR access units */
+	int nal_length_size;
+	uint8_t *annexb_hdr;
+	int annexb_hdr_size;
+/* synthetic source: frames left and in total, no file behind it */
+	int synthetic, synthetic_frames;
+/* keyframe index, sorted by ts: complete once it covers the whole
+ * stream, building while the first pass from the start records it
+ */
+	char *filename;
+	struct demux_kf *kf;
+	int nkf, kf_cap;
+	int kf_complete, kf_building, kf_byte_seek;
+/* current keyframe, and skip packets up to the next keyframe */
+	int kf_cur, need_key;
+/* I-frame-only fast-forward: keyframes to advance per packet, 0 if off;
+ * keyframes read, when there is no index to jump with
+ */
+	int ff, ff_advance, ff_skipped;
 };
 struct demux * demux_init(const char * filename, int *width, int *height);
+/* H.264-shaped filler packets, no lavf: for benchmarking the pipeline
+ * around the decoder (viddec3test --no-process)
+ */
+struct demux * demux_init_synthetic(int width, int height, int frames);
 int demux_read(struct demux *demux, char *input, int size);
 int demux_rewind(struct demux *demux);
+/* Load <file>.kfi, take the container's index, or scan the file (and
+ * save <file>.kfi) so that seeking and fast-forward don't need to read
+ * the stream up to the target.
+ */
+int demux_index(struct demux *demux);
+/* continue from the last keyframe at or before ms from the start */
+int demux_seek(struct demux *demux, int64_t ms);
+/* only return every step-th keyframe, 0 returns to normal playback */
+int demux_set_ff(struct demux *demux, int step);
 void demux_deinit(struct demux *demux);
 
 #endif /* __DEMUX_H__ */
@@ -33,6 +33,26 @@
  * Then you need to find the encoder attached to that connector so you
  * can bind it with a free crtc.
  */
+/* property ids of a plane, for atomic commits */
+struct plane_props {
+	uint32_t fb_id, crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	uint32_t zorder;
+};
+
+/* vblank sequence and time of the last flip, and how flips went; a
+ * frame is late when it stays up longer than the source's own interval
+ * between posts asks for, rounded to refreshes
+ */
+struct flip_stats {
+	uint32_t sequence, last_sequence;
+	uint64_t time, last_posted;
+	uint32_t refresh_us;		/* 0 if the mode doesn't say */
+	uint32_t frames, late, doubled, repeats, dropped;
+	uint64_t latency, latency_max;
+};
+
 struct connector {
 	uint32_t id;
 	char mode_str[64];
@@ -40,6 +60,25 @@ struct connector {
 	drmModeEncoder *encoder;
 	int crtc;
 	int pipe;
+	struct display *disp;
+
+	/* legacy page flips: every crtc flips on its own, at its own
+	 * rate, with up to flip_queue buffers waiting for it
+	 */
+	uint32_t x;			/* scanout offset in current */
+	struct buffer *current, *flipping;
+	struct buffer **queue;
+	uint32_t queue_head, queue_len;
+	struct flip_stats stats;
+
+	/* atomic modesetting only */
+	struct {
+		uint32_t crtc_id_prop;			/* connector */
+		uint32_t mode_id_prop, active_prop;	/* crtc */
+		uint32_t mode_blob;
+		uint32_t primary;
+		struct plane_props primary_props, ovr_props;
+	} atomic;
 };
 
 #define to_display_kms(x) container_of(x, struct display_kms, base)
@@ -48,34 +87,135 @@ struct display_kms {
 
 	uint32_t connectors_count;
 	struct connector connector[10];
-	drmModePlane *ovr[10];
+	struct plane_slot *ovr[10];
 
-	int scheduled_flips, completed_flips;
 	uint32_t bo_flags;
-	drmModeResPtr resources;
-	drmModePlaneRes *plane_resources;
+	/* linear/tiled per buffer role, unless -t was given; only from a
+	 * file asked for, other clients may write the default one
+	 */
+	const char *bo_policy;
 	struct buffer *current;
 	bool no_master;
 	int mastership;
+
+	/* where video goes (--window, --zorder, --alpha); w == 0 means
+	 * full screen, negative zorder/alpha leave the plane's default
+	 */
+	struct rect {
+		uint32_t x, y, w, h;
+	} window;
+	int zorder, alpha;
+
+	/* atomic modesetting: plane updates and flips posted while a commit
+	 * is in flight are merged in req, and committed from the flip event
+	 */
+	bool atomic;
+	drmModeAtomicReqPtr req;
+	uint32_t req_pipes;
+	int flips_in_flight;
+
+	/* buffer in req (atomic), and buffer the kernel is flipping to;
+	 * an atomic commit flips all crtcs together, timed on ref_crtc
+	 */
+	struct buffer *pending, *flipping;
+	uint32_t ref_crtc;
+	/* software composition for streams without a plane, see
+	 * compose_begin(): back buffers, the application's primary buffer
+	 * they are copies of, and where the video went on each connector
+	 */
+	struct buffer *compose[2], *compose_base, *compose_from[2];
+	struct rect compose_dst[10];
+
+	/* video buffer last put on the overlay planes; with atomic, also
+	 * the one in req and the one in the commit in flight, like
+	 * pending and flipping
+	 */
+	struct buffer *vid_current, *vid_pending, *vid_flipping;
+	struct flip_stats vid_stats;
+	struct flip_stats stats;
+
+	/* with --flip-queue, posting does not wait for the flip: the
+	 * kernel takes one flip per crtc at a time, further posts wait in
+	 * the connector's queue and are submitted from the flip handler
+	 */
+	uint32_t flip_queue;		/* buffers waiting, per crtc */
 };
 
 #define to_buffer_kms(x) container_of(x, struct buffer_kms, base)
 struct buffer_kms {
 	struct buffer base;
 	uint32_t fb_id;
+
+	/* allocation key, see buffer_cache_get() */
+	uint32_t bo_flags;
+	bool multiplanar;
+	struct list cached;
+	/* freed while on screen: cached once released, see buffer_released() */
+	bool freed;
+	/* put back to the pool while on screen, see hold_vid_buffer() */
+	bool held;
+	/* compose buffer: the application never sees it */
+	bool internal;
+
+	/* every live buffer is on the buffers list, see handle_shared() */
+	struct list link;
+	uint32_t handles[4];
+
+	/* crtcs scanning out, flipping to or queued with this buffer */
+	int scanouts;
+	/* crtc whose flip is reported in present, see flip_report() */
+	int present_crtc;
+
+	/* dmabufs imported by import_vid_buffer(), looked up by their GEM
+	 * handles; offsets are those of the framebuffer for every buffer
+	 */
+	bool imported;
+	uint32_t offsets[4];
+};
+
+/* Buffers released by free_buffers() are kept here (most recently
+ * released first), together with their fb_id and dmabuf fds, and handed
+ * out again by alloc_buffer() when the same kind of buffer is asked for.
+ * This spares omap_bo_new()/drmModeAddFB2() and CMA fragmentation on
+ * every reconfiguration.  Shared by all displays, like global_fd.
+ * A buffer only goes in once it is off the screen, so evicting one never
+ * removes a framebuffer that is scanned out.
+ */
+static struct {
+	struct list free;
+	uint32_t count, max;
+	uint32_t hits, misses, evictions;
+} buffer_cache = {
+	.free = { &buffer_cache.free, &buffer_cache.free },
+	.max = 32,
+};
+
+/* Framebuffers made from foreign dmabufs, most recently used first.
+ * Callers import a buffer again for every post, so this turns the
+ * import into a list walk once a producer's buffers have been seen.
+ * A dmabuf is recognized by its GEM handle, which the DRM fd gives
+ * back for it whichever dmabuf fd it comes from (dmabuf inodes are not
+ * unique on older kernels).
+ */
+static struct {
+	struct list lru;
+	uint32_t count, max;
+	uint32_t hits, misses, evictions;
+} import_cache = {
+	.lru = { &import_cache.lru, &import_cache.lru },
+	.max = 64,
 };
 
+static struct list buffers = { &buffers, &buffers };
+
 static int global_fd = 0;
-static uint32_t used_planes = 0;
 static int ndisplays = 0;
 
 static struct omap_bo *
-alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
-		uint32_t *bo_handle, uint32_t *pitch)
+alloc_bo(struct display *disp, uint32_t bo_flags, uint32_t bpp,
+		uint32_t width, uint32_t height, uint32_t *bo_handle, uint32_t *pitch)
 {
-	struct display_kms *disp_kms = to_display_kms(disp);
 	struct omap_bo *bo;
-	uint32_t bo_flags = disp_kms->bo_flags;
 
 	if ((bo_flags & OMAP_BO_TILED) == OMAP_BO_TILED) {
 		bo_flags &= ~OMAP_BO_TILED;
@@ -105,13 +245,296 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	return bo;
 }
 
+/* GEM handles are per DRM fd and per object: importing a dmabuf twice,
+ * or importing one of our own bos, gives back a handle already in use
+ */
+static bool
+handle_shared(struct buffer_kms *self, uint32_t handle)
+{
+	struct buffer_kms *buf_kms;
+	int i;
+
+	list_for_each_entry(buf_kms, &buffers, link) {
+		if (buf_kms == self)
+			continue;
+		for (i = 0; i < 4; i++)
+			if (buf_kms->handles[i] == handle)
+				return true;
+	}
+	return false;
+}
+
+static void
+destroy_buffer(int fd, struct buffer_kms *buf_kms)
+{
+	struct buffer *buf = &buf_kms->base;
+	int i, j;
+
+	if (buf_kms->fb_id)
+		drmModeRmFB(fd, buf_kms->fb_id);
+	list_del(&buf_kms->link);
+	for (i = 0; buf_kms->imported && i < 4; i++) {
+		struct drm_gem_close req = { .handle = buf_kms->handles[i] };
+
+		for (j = 0; j < i; j++)
+			if (buf_kms->handles[j] == req.handle)
+				req.handle = 0;
+		if (req.handle && !handle_shared(buf_kms, req.handle))
+			drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &req);
+	}
+	for (i = 0; i < buf->nbo; i++) {
+		if (buf->fd[i] > 0)
+			close(buf->fd[i]);
+		if (buf->bo[i])
+			omap_bo_del(buf->bo[i]);
+	}
+	free(buf_kms);
+}
+
+static struct buffer_kms *
+buffer_cache_get(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h,
+		uint32_t bo_flags)
+{
+	struct buffer_kms *buf_kms;
+
+	list_for_each_entry(buf_kms, &buffer_cache.free, cached) {
+		struct buffer *buf = &buf_kms->base;
+
+		if (buf->fourcc == fourcc && buf->width == w && buf->height == h &&
+				buf_kms->bo_flags == bo_flags &&
+				buf_kms->multiplanar == disp->multiplanar) {
+			list_del(&buf_kms->cached);
+			buffer_cache.count--;
+			buffer_cache.hits++;
+			buf->noScale = false;
+			DBG("buffer cache hit: %p (%ux%u 0x%08x)", buf, w, h, fourcc);
+			return buf_kms;
+		}
+	}
+
+	buffer_cache.misses++;
+	return NULL;
+}
+
+static void
+buffer_cache_put(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	list_add(&buf_kms->cached, &buffer_cache.free);
+	buffer_cache.count++;
+
+	while (buffer_cache.count > buffer_cache.max) {
+		/* evict the least recently released */
+		buf_kms = list_last_entry(&buffer_cache.free,
+				struct buffer_kms, cached);
+		list_del(&buf_kms->cached);
+		buffer_cache.count--;
+		buffer_cache.evictions++;
+		destroy_buffer(disp->fd, buf_kms);
+	}
+}
+
+static void
+buffer_cache_purge(int fd)
+{
+	struct buffer_kms *buf_kms, *tmp;
+
+	list_for_each_entry_safe(buf_kms, tmp, &buffer_cache.free, cached) {
+		list_del(&buf_kms->cached);
+		destroy_buffer(fd, buf_kms);
+	}
+	buffer_cache.count = 0;
+
+	/* freed, but still on screen when the last display closed */
+	list_for_each_entry_safe(buf_kms, tmp, &buffers, link)
+		if (buf_kms->freed)
+			destroy_buffer(fd, buf_kms);
+
+	MSG("buffer cache: %u hits, %u misses, %u evictions",
+			buffer_cache.hits, buffer_cache.misses,
+			buffer_cache.evictions);
+}
+
+static uint32_t
+num_planes(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case FOURCC('N','V','1','2'):
+		return 2;
+	case FOURCC('I','4','2','0'):
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+static bool buffer_on_screen(struct display_kms *disp_kms, struct buffer *buf);
+
+static struct buffer *
+import_vid_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h,
+		const int *fds, const uint32_t *pitches, const uint32_t *offsets)
+{
+	struct buffer_kms *buf_kms, *cached;
+	struct buffer *buf;
+	uint32_t i, n = num_planes(fourcc);
+	int ret;
+
+	buf_kms = calloc(1, sizeof(*buf_kms));
+	if (!buf_kms) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+	buf = &buf_kms->base;
+	list_init(&buf_kms->cached);
+	list_add(&buf_kms->link, &buffers);
+	buf_kms->imported = true;
+
+	for (i = 0; i < n; i++) {
+		ret = drmPrimeFDToHandle(disp->fd, fds[i], &buf_kms->handles[i]);
+		if (ret) {
+			ERROR("could not import dmabuf %d: %s", fds[i], strerror(errno));
+			goto fail;
+		}
+	}
+
+	list_for_each_entry(cached, &import_cache.lru, cached) {
+		buf = &cached->base;
+
+		if (buf->fourcc != fourcc || buf->width != w || buf->height != h)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (cached->handles[i] != buf_kms->handles[i] ||
+					buf->pitches[i] != pitches[i] ||
+					cached->offsets[i] != offsets[i])
+				break;
+		}
+		if (i < n)
+			continue;
+
+		/* the handles are the cached buffer's, nothing to close */
+		list_del(&buf_kms->link);
+		free(buf_kms);
+
+		/* move to the head */
+		list_del(&cached->cached);
+		list_add(&cached->cached, &import_cache.lru);
+		import_cache.hits++;
+		return buf;
+	}
+
+	import_cache.misses++;
+
+	buf = &buf_kms->base;
+	buf->fourcc = fourcc;
+	buf->width = w;
+	buf->height = h;
+	buf->multiplanar = n > 1 && fds[1] != fds[0];
+
+	for (i = 0; i < n; i++) {
+		buf->fd[i] = dup(fds[i]);
+		buf->nbo = i + 1;
+		buf->pitches[i] = pitches[i];
+		buf_kms->offsets[i] = offsets[i];
+	}
+
+	ret = drmModeAddFB2(disp->fd, w, h, fourcc, buf_kms->handles,
+			buf->pitches, buf_kms->offsets, &buf_kms->fb_id, 0);
+	if (ret) {
+		ERROR("drmModeAddFB2 failed: %s (%d)", strerror(errno), ret);
+		goto fail;
+	}
+
+	list_add(&buf_kms->cached, &import_cache.lru);
+	import_cache.count++;
+
+	/* the buffers at the tail have not been posted for a long while;
+	 * skip any still on screen all the same (RmFB would disable the
+	 * plane scanning it out)
+	 */
+	while (import_cache.count > import_cache.max) {
+		struct buffer_kms *old = NULL, *tmp;
+
+		list_for_each_entry(tmp, &import_cache.lru, cached)
+			if (!buffer_on_screen(to_display_kms(disp), &tmp->base))
+				old = tmp;
+		if (!old)
+			break;
+		list_del(&old->cached);
+		import_cache.count--;
+		import_cache.evictions++;
+		destroy_buffer(disp->fd, old);
+	}
+
+	return buf;
+
+fail:
+	destroy_buffer(disp->fd, buf_kms);
+	return NULL;
+}
+
+static void
+import_cache_purge(int fd)
+{
+	struct buffer_kms *buf_kms, *tmp;
+
+	list_for_each_entry_safe(buf_kms, tmp, &import_cache.lru, cached) {
+		list_del(&buf_kms->cached);
+		destroy_buffer(fd, buf_kms);
+	}
+	import_cache.count = 0;
+
+	if (import_cache.hits || import_cache.misses)
+		MSG("import cache: %u hits, %u misses, %u evictions",
+				import_cache.hits, import_cache.misses,
+				import_cache.evictions);
+}
+
+/* bo flags for a buffer: -t if given, else what --bo-bench found fastest */
+static uint32_t
+layout_flags(struct display *disp, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t bpp;
+
+	if ((disp_kms->bo_flags & OMAP_BO_TILED) || !disp_kms->bo_policy)
+		return disp_kms->bo_flags;
+
+	switch (fourcc) {
+	case 0:
+	case FOURCC('A','R','2','4'):
+		bpp = 32;
+		break;
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+		bpp = 16;
+		break;
+	default:
+		bpp = 8;
+		break;
+	}
+
+	if (bo_layout_tiled(disp_kms->bo_policy,
+			fourcc ? BO_ROLE_VIDEO : BO_ROLE_SCANOUT, bpp))
+		return disp_kms->bo_flags | OMAP_BO_TILED;
+
+	return disp_kms->bo_flags;
+}
+
 static struct buffer *
 alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 {
 	struct buffer_kms *buf_kms;
 	struct buffer *buf;
 	uint32_t bo_handles[4] = {0}, offsets[4] = {0};
-	int ret;
+	uint32_t bo_flags;
+	int i, ret;
+
+	bo_flags = layout_flags(disp, fourcc);
+
+	buf_kms = buffer_cache_get(disp, fourcc, w, h, bo_flags);
+	if (buf_kms)
+		return &buf_kms->base;
 
 	buf_kms = calloc(1, sizeof(*buf_kms));
 	if (!buf_kms) {
@@ -119,6 +542,10 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		return NULL;
 	}
 	buf = &buf_kms->base;
+	list_init(&buf_kms->cached);
+	list_add(&buf_kms->link, &buffers);
+	buf_kms->bo_flags = bo_flags;
+	buf_kms->multiplanar = disp->multiplanar;
 
 	buf->fourcc = fourcc;
 	buf->width = w;
@@ -133,42 +560,39 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	switch(fourcc) {
 	case FOURCC('A','R','2','4'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 32, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, bo_flags, 32, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('U','Y','V','Y'):
 	case FOURCC('Y','U','Y','V'):
 		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, bo_flags, 16, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
 		break;
 	case FOURCC('N','V','1','2'):
 		if (disp->multiplanar) {
 			buf->nbo = 2;
-			buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height,
+			buf->bo[0] = alloc_bo(disp, bo_flags, 8, buf->width, buf->height,
 					&bo_handles[0], &buf->pitches[0]);
-			buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
-			buf->bo[1] = alloc_bo(disp, 16, buf->width/2, buf->height/2,
+			buf->bo[1] = alloc_bo(disp, bo_flags, 16, buf->width/2, buf->height/2,
 					&bo_handles[1], &buf->pitches[1]);
-			buf->fd[1] = omap_bo_dmabuf(buf->bo[1]);
 		} else {
 			buf->nbo = 1;
-			buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height * 3 / 2,
+			buf->bo[0] = alloc_bo(disp, bo_flags, 8, buf->width, buf->height * 3 / 2,
 					&bo_handles[0], &buf->pitches[0]);
-			buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
 			bo_handles[1] = bo_handles[0];
 			buf->pitches[1] = buf->pitches[0];
-			offsets[1] = buf->width * buf->height;
+			offsets[1] = buf->pitches[0] * buf->height;
 			buf->multiplanar = false;
 		}
 		break;
 	case FOURCC('I','4','2','0'):
 		buf->nbo = 3;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height,
+		buf->bo[0] = alloc_bo(disp, bo_flags, 8, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
-		buf->bo[1] = alloc_bo(disp, 8, buf->width/2, buf->height/2,
+		buf->bo[1] = alloc_bo(disp, bo_flags, 8, buf->width/2, buf->height/2,
 				&bo_handles[1], &buf->pitches[1]);
-		buf->bo[2] = alloc_bo(disp, 8, buf->width/2, buf->height/2,
+		buf->bo[2] = alloc_bo(disp, bo_flags, 8, buf->width/2, buf->height/2,
 				&bo_handles[2], &buf->pitches[2]);
 		break;
 	default:
@@ -176,255 +600,1735 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		goto fail;
 	}
 
-	ret = drmModeAddFB2(disp->fd, buf->width, buf->height, fourcc,
-			bo_handles, buf->pitches, offsets, &buf_kms->fb_id, 0);
-	if (ret) {
-		ERROR("drmModeAddFB2 failed: %s (%d)", strerror(errno), ret);
-		goto fail;
+	for (i = 0; i < buf->nbo; i++) {
+		if (!buf->bo[i]) {
+			ERROR("bo allocation failed");
+			goto fail;
+		}
+		/* exported once here, and kept as long as the buffer lives */
+		buf->fd[i] = omap_bo_dmabuf(buf->bo[i]);
+	}
+
+	memcpy(buf_kms->handles, bo_handles, sizeof(bo_handles));
+	memcpy(buf_kms->offsets, offsets, sizeof(offsets));
+
+	ret = drmModeAddFB2(disp->fd, buf->width, buf->height, fourcc,
+			bo_handles, buf->pitches, offsets, &buf_kms->fb_id, 0);
+	if (ret) {
+		ERROR("drmModeAddFB2 failed: %s (%d)", strerror(errno), ret);
+		goto fail;
+	}
+
+	return buf;
+
+fail:
+	destroy_buffer(disp->fd, buf_kms);
+	return NULL;
+}
+
+/* scanned out, or about to be: on a crtc or plane, in a flip or commit */
+static bool
+buffer_on_screen(struct display_kms *disp_kms, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	uint32_t i;
+
+	if (buf_kms->scanouts || buf == disp_kms->current ||
+			buf == disp_kms->pending || buf == disp_kms->flipping ||
+			buf == disp_kms->vid_current ||
+			buf == disp_kms->vid_pending ||
+			buf == disp_kms->vid_flipping)
+		return true;
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		if (buf == disp_kms->connector[i].current ||
+				buf == disp_kms->connector[i].flipping)
+			return true;
+	return false;
+}
+
+/* buf is off the screen: back to the producer, or to the cache if the
+ * producer freed it meanwhile
+ */
+static void
+buffer_released(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (buf_kms->internal)
+		return;
+	if (!buf_kms->freed) {
+		disp_buffer_released(disp, buf);
+		if (buf_kms->held) {
+			buf_kms->held = false;
+			disp_put_vid_buffer(disp, buf);
+		}
+		return;
+	}
+	if (!buffer_on_screen(to_display_kms(disp), buf)) {
+		buf_kms->freed = false;
+		buffer_cache_put(disp, buf);
+	}
+}
+
+/* to the cache now, or once it is off the screen */
+static void
+buffer_free(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (buf == disp_kms->compose_base)
+		disp_kms->compose_base = NULL;
+	buf_kms->internal = false;
+	if (buffer_on_screen(disp_kms, buf))
+		buf_kms->freed = true;
+	else
+		buffer_cache_put(disp, buf);
+}
+
+void
+free_buffers(struct display *disp, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (disp->buf[i])
+			buffer_free(disp, disp->buf[i]);
+	}
+	free(disp->buf);
+	disp->buf = NULL;
+}
+
+static struct buffer **
+alloc_buffers(struct display *disp, uint32_t n,
+		uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	struct buffer **bufs;
+	uint32_t i = 0;
+
+	bufs = calloc(n, sizeof(*bufs));
+	if (!bufs) {
+		ERROR("allocation failed");
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		bufs[i] = alloc_buffer(disp, fourcc, w, h);
+		if (!bufs[i]) {
+			ERROR("allocation failed");
+			goto fail;
+		}
+	}
+	disp->buf=bufs;
+	return bufs;
+
+fail:
+	// XXX cleanup
+	return NULL;
+}
+
+static struct buffer **
+get_buffers(struct display *disp, uint32_t n)
+{
+	return alloc_buffers(disp, n, 0, disp->width, disp->height);
+}
+
+static struct buffer **
+get_vid_buffers(struct display *disp, uint32_t n,
+		uint32_t fourcc, uint32_t w, uint32_t h)
+{
+	return alloc_buffers(disp, n, fourcc, w, h);
+}
+
+/*
+ * KMS resources, planes and property ids, probed once per DRM fd (and
+ * shared by all the displays on it) so that setting up and posting to
+ * a display only takes table lookups.
+ */
+struct kms_prop {
+	uint32_t obj_id, prop_id;
+	char name[DRM_PROP_NAME_LEN];
+	uint64_t value;		/* at probe time: only good for immutable ones */
+	uint64_t max;		/* upper bound of range properties */
+};
+
+/*
+ * The planes are shared by every display opened on global_fd (eg. one
+ * per decoder in viddec3test), and each video stream gets an overlay
+ * plane of its own on each crtc, as long as there are any left.
+ * Streams that find none are composed in software into a copy of the
+ * primary buffer, which is then flipped to, see sw_compose().
+ */
+struct plane_slot {
+	uint32_t id;
+	uint32_t type;
+	uint32_t possible_crtcs;
+	uint32_t zorder_prop;
+	uint32_t alpha_prop, alpha_max;
+	drmModePlane *plane;
+	struct display *owner;
+	int zorder;		/* given at allocation, see plane_alloc() */
+};
+
+static struct {
+	bool probed;
+	bool atomic;		/* probed with DRM_CLIENT_CAP_ATOMIC */
+	drmModeResPtr res;
+	drmModePlaneRes *plane_res;
+	drmModeConnector **connectors;
+	drmModeEncoder **encoders;
+	struct plane_slot *planes;
+	uint32_t nplanes;
+	struct kms_prop *props;
+	uint32_t nprops, maxprops;
+} caps;
+
+static void
+probe_props(int fd, uint32_t obj_id, uint32_t obj_type)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		struct kms_prop *p;
+
+		if (!prop)
+			continue;
+
+		if (caps.nprops == caps.maxprops) {
+			uint32_t n = caps.maxprops ? caps.maxprops * 2 : 64;
+			p = realloc(caps.props, n * sizeof(*p));
+			if (!p) {
+				drmModeFreeProperty(prop);
+				break;
+			}
+			caps.props = p;
+			caps.maxprops = n;
+		}
+
+		p = &caps.props[caps.nprops++];
+		p->obj_id = obj_id;
+		p->prop_id = prop->prop_id;
+		snprintf(p->name, sizeof(p->name), "%s", prop->name);
+		p->value = props->prop_values[i];
+		p->max = 0;
+		if ((prop->flags & DRM_MODE_PROP_RANGE) && prop->count_values == 2)
+			p->max = prop->values[1];
+
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+}
+
+static struct kms_prop *
+find_prop(int fd, uint32_t obj_id, uint32_t obj_type, const char *name)
+{
+	uint32_t i;
+	bool known = false;
+
+	for (i = 0; i < caps.nprops; i++) {
+		if (caps.props[i].obj_id != obj_id)
+			continue;
+		known = true;
+		if (!strcmp(caps.props[i].name, name))
+			return &caps.props[i];
+	}
+
+	/* not an object kms_probe() knew about (yet) */
+	if (!known) {
+		probe_props(fd, obj_id, obj_type);
+		for (i = 0; i < caps.nprops; i++)
+			if (caps.props[i].obj_id == obj_id &&
+					!strcmp(caps.props[i].name, name))
+				return &caps.props[i];
+	}
+
+	return NULL;
+}
+
+static uint32_t
+get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char *name)
+{
+	struct kms_prop *p = find_prop(fd, obj_id, obj_type, name);
+	return p ? p->prop_id : 0;
+}
+
+/* value as of probe time, for immutable properties (type, ...) */
+static uint64_t
+get_prop_value(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+		uint64_t def)
+{
+	struct kms_prop *p = find_prop(fd, obj_id, obj_type, name);
+	return p ? p->value : def;
+}
+
+static void
+probe_plane(int fd, uint32_t id)
+{
+	struct plane_slot *slot = &caps.planes[caps.nplanes];
+	struct kms_prop *p;
+
+	slot->plane = drmModeGetPlane(fd, id);
+	if (!slot->plane)
+		return;
+
+	probe_props(fd, id, DRM_MODE_OBJECT_PLANE);
+
+	slot->id = id;
+	slot->possible_crtcs = slot->plane->possible_crtcs;
+	/* without the atomic cap only overlays are listed */
+	slot->type = get_prop_value(fd, id, DRM_MODE_OBJECT_PLANE, "type",
+			DRM_PLANE_TYPE_OVERLAY);
+
+	/* TI kernels call them zorder and global_alpha */
+	slot->zorder_prop = get_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "zorder");
+	if (!slot->zorder_prop)
+		slot->zorder_prop = get_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "zpos");
+	p = find_prop(fd, id, DRM_MODE_OBJECT_PLANE, "global_alpha");
+	if (!p)
+		p = find_prop(fd, id, DRM_MODE_OBJECT_PLANE, "alpha");
+	slot->alpha_prop = p ? p->prop_id : 0;
+	slot->alpha_max = (p && p->max) ? p->max : 255;
+
+	caps.nplanes++;
+}
+
+static void
+kms_caps_free(void)
+{
+	int i;
+
+	for (i = 0; caps.connectors && i < caps.res->count_connectors; i++)
+		drmModeFreeConnector(caps.connectors[i]);
+	for (i = 0; caps.encoders && i < caps.res->count_encoders; i++)
+		drmModeFreeEncoder(caps.encoders[i]);
+	for (i = 0; i < (int)caps.nplanes; i++)
+		drmModeFreePlane(caps.planes[i].plane);
+	free(caps.connectors);
+	free(caps.encoders);
+	free(caps.planes);
+	free(caps.props);
+	drmModeFreePlaneResources(caps.plane_res);
+	drmModeFreeResources(caps.res);
+	memset(&caps, 0, sizeof(caps));
+}
+
+static int
+kms_probe(struct display *disp, bool atomic)
+{
+	int fd = disp->fd;
+	uint32_t noverlays = 0;
+	int i;
+
+	if (caps.probed) {
+		/* the cap changes the plane list, which is shared */
+		if (atomic && !caps.atomic) {
+			ERROR("--atomic must be given to the first display");
+			return -1;
+		}
+		return 0;
+	}
+
+	caps.res = drmModeGetResources(fd);
+	if (!caps.res) {
+		ERROR("drmModeGetResources failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	caps.plane_res = drmModeGetPlaneResources(fd);
+	if (!caps.plane_res) {
+		ERROR("drmModeGetPlaneResources failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	caps.connectors = calloc(caps.res->count_connectors,
+			sizeof(*caps.connectors));
+	caps.encoders = calloc(caps.res->count_encoders, sizeof(*caps.encoders));
+	caps.planes = calloc(caps.plane_res->count_planes, sizeof(*caps.planes));
+	if ((caps.res->count_connectors && !caps.connectors) ||
+			(caps.res->count_encoders && !caps.encoders) ||
+			(caps.plane_res->count_planes && !caps.planes)) {
+		ERROR("allocation failed");
+		goto fail;
+	}
+
+	for (i = 0; i < caps.res->count_connectors; i++) {
+		uint32_t id = caps.res->connectors[i];
+
+		caps.connectors[i] = drmModeGetConnector(fd, id);
+		if (!caps.connectors[i]) {
+			ERROR("could not get connector %i: %s", id, strerror(errno));
+			continue;
+		}
+		probe_props(fd, id, DRM_MODE_OBJECT_CONNECTOR);
+	}
+
+	for (i = 0; i < caps.res->count_encoders; i++) {
+		caps.encoders[i] = drmModeGetEncoder(fd, caps.res->encoders[i]);
+		if (!caps.encoders[i])
+			ERROR("could not get encoder %i: %s",
+					caps.res->encoders[i], strerror(errno));
+	}
+
+	for (i = 0; i < caps.res->count_crtcs; i++)
+		probe_props(fd, caps.res->crtcs[i], DRM_MODE_OBJECT_CRTC);
+
+	for (i = 0; i < (int)caps.plane_res->count_planes; i++)
+		probe_plane(fd, caps.plane_res->planes[i]);
+
+	for (i = 0; i < (int)caps.nplanes; i++)
+		if (caps.planes[i].type == DRM_PLANE_TYPE_OVERLAY)
+			noverlays++;
+
+	MSG("%d connectors, %d crtcs, %d planes (%d overlays), %d properties",
+			caps.res->count_connectors, caps.res->count_crtcs,
+			caps.nplanes, noverlays, caps.nprops);
+
+	caps.atomic = atomic;
+	caps.probed = true;
+	return 0;
+
+fail:
+	kms_caps_free();
+	return -1;
+}
+
+static drmModeEncoder *
+find_encoder(uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < caps.res->count_encoders; i++)
+		if (caps.encoders[i] && caps.encoders[i]->encoder_id == id)
+			return caps.encoders[i];
+	return NULL;
+}
+
+static bool
+plane_supports(struct plane_slot *slot, uint32_t fourcc)
+{
+	uint32_t i;
+
+	if (!fourcc)
+		fourcc = FOURCC('A','R','2','4');
+	for (i = 0; i < slot->plane->count_formats; i++)
+		if (slot->plane->formats[i] == fourcc)
+			return true;
+	return false;
+}
+
+/* overlay planes in use on a crtc */
+static int
+planes_owned(int pipe)
+{
+	uint32_t i;
+	int n = 0;
+
+	for (i = 0; i < caps.nplanes; i++)
+		if (caps.planes[i].owner &&
+				caps.planes[i].type == DRM_PLANE_TYPE_OVERLAY &&
+				(caps.planes[i].possible_crtcs & (1 << pipe)))
+			n++;
+	return n;
+}
+
+/*
+ * The z-order is --zorder, or else streams stack up above the primary
+ * (0) in the order they got their planes, so that every plane on a
+ * crtc has its own.
+ */
+static struct plane_slot *
+plane_alloc(struct display *disp, int pipe, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i;
+
+	for (i = 0; i < caps.nplanes; i++) {
+		struct plane_slot *slot = &caps.planes[i];
+
+		if (slot->owner || slot->type != DRM_PLANE_TYPE_OVERLAY ||
+				!(slot->possible_crtcs & (1 << pipe)) ||
+				!plane_supports(slot, fourcc))
+			continue;
+		slot->owner = disp;
+		slot->zorder = disp_kms->zorder >= 0 ? disp_kms->zorder :
+				planes_owned(pipe);
+		return slot;
+	}
+
+	return NULL;
+}
+
+/* every connector needs an overlay for video: one this display already
+ * has, or a free one on its crtc
+ */
+static bool
+supports_format(struct display *disp, uint32_t fourcc)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i, j;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		int pipe = disp_kms->connector[i].pipe;
+
+		for (j = 0; j < caps.nplanes; j++) {
+			struct plane_slot *slot = &caps.planes[j];
+
+			if ((slot->owner && slot->owner != disp) ||
+					slot->type != DRM_PLANE_TYPE_OVERLAY ||
+					!(slot->possible_crtcs & (1 << pipe)))
+				continue;
+			if (plane_supports(slot, fourcc))
+				break;
+		}
+		if (j == caps.nplanes)
+			return false;
+	}
+
+	return disp_kms->connectors_count > 0;
+}
+
+static void
+planes_release(struct display *disp)
+{
+	uint32_t i;
+
+	for (i = 0; i < caps.nplanes; i++)
+		if (caps.planes[i].owner == disp)
+			caps.planes[i].owner = NULL;
+}
+
+/* apply the z-order and --alpha to a freshly allocated plane */
+static int
+plane_setup(struct display *disp, struct plane_slot *slot)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	int ret = 0;
+
+	if (slot->zorder_prop) {
+		ret = drmModeObjectSetProperty(disp->fd, slot->id,
+				DRM_MODE_OBJECT_PLANE, slot->zorder_prop, slot->zorder);
+		if (ret < 0)
+			MSG("Could not set Z order for plane %d", slot->id);
+	}
+	if (disp_kms->alpha >= 0 && slot->alpha_prop) {
+		ret = drmModeObjectSetProperty(disp->fd, slot->id,
+				DRM_MODE_OBJECT_PLANE, slot->alpha_prop,
+				(uint64_t)disp_kms->alpha * slot->alpha_max / 255);
+		if (ret < 0)
+			MSG("Could not set alpha for plane %d", slot->id);
+	}
+
+	return ret;
+}
+
+/* where a video frame goes on a crtc, and which part of it */
+static void
+vid_geometry(struct display_kms *disp_kms, drmModeModeInfo *mode,
+		struct buffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+		struct rect *dst, struct rect *src)
+{
+	struct rect win = disp_kms->window;
+
+	if (!win.w || !win.h) {
+		win.x = win.y = 0;
+		win.w = mode->hdisplay;
+		win.h = mode->vdisplay;
+	}
+
+	if (buf->noScale) {
+		/* Use x and y as co-ordinates of overlay, source x and y is 0 */
+		*dst = (struct rect){ win.x + x, win.y + y, buf->width, buf->height };
+		*src = (struct rect){ 0, 0, w, h };
+	} else {
+		/* make video fill the window */
+		*dst = win;
+		*src = (struct rect){ x, y, w, h };
+	}
+}
+
+static void
+flip_stamp(struct flip_stats *fs, unsigned int frame,
+		unsigned int sec, unsigned int usec)
+{
+	fs->sequence = frame;
+	fs->time = (uint64_t)sec * 1000000 + usec;
+}
+
+/* buf made it to the screen with the flip last stamped in fs */
+static void
+flip_report(struct display *disp, struct buffer *buf, struct flip_stats *fs)
+{
+	struct buffer_kms *buf_kms;
+	int32_t expected;
+	struct disp_presentation *p = &buf->present;
+
+	p->presented_us = fs->time;
+	p->sequence = fs->sequence;
+	p->vblanks = fs->last_sequence ?
+			(int32_t)(p->sequence - fs->last_sequence) : 1;
+	fs->last_sequence = p->sequence;
+
+	/* refreshes the previous frame was meant to stay up: 2 for a
+	 * 30 fps source on 60 Hz, more when the source itself was late
+	 */
+	expected = 1;
+	if (fs->refresh_us && fs->last_posted && p->posted_us > fs->last_posted)
+		expected = (p->posted_us - fs->last_posted + fs->refresh_us / 2) /
+				fs->refresh_us;
+	if (expected < 1)
+		expected = 1;
+	fs->last_posted = p->posted_us;
+
+	fs->frames++;
+	if (p->vblanks == 0)
+		fs->doubled++;
+	else if (p->vblanks > expected) {
+		fs->late++;
+		fs->repeats += p->vblanks - expected;
+	}
+	if (p->posted_us && p->presented_us > p->posted_us) {
+		uint64_t latency = p->presented_us - p->posted_us;
+		fs->latency += latency;
+		if (latency > fs->latency_max)
+			fs->latency_max = latency;
+	}
+
+	DBG("Presented: seq=%u, vblanks=%d, latency=%llu us", p->sequence,
+			p->vblanks, (unsigned long long)(p->presented_us - p->posted_us));
+
+	buf_kms = to_buffer_kms(buf);
+	if (!buf_kms->internal)
+		disp_buffer_presented(disp, buf);
+}
+
+static void
+flip_stats_print(int crtc, struct flip_stats *fs)
+{
+	if (!fs->frames)
+		return;
+	MSG("crtc %d: presented %u frames: %u late (%u refreshes longer than the source asked), "
+			"%u in the same vblank, %u dropped, latency avg %llu max %llu us",
+			crtc, fs->frames, fs->late, fs->repeats, fs->doubled, fs->dropped,
+			(unsigned long long)(fs->latency / fs->frames),
+			(unsigned long long)fs->latency_max);
+}
+
+/* one more crtc holds on to buf */
+static void
+buffer_ref(struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	buf_kms->scanouts++;
+}
+
+/* a crtc let go of buf: once none holds it, the producer can have it */
+static void
+buffer_unref(struct display *disp, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (--buf_kms->scanouts == 0)
+		buffer_released(disp, buf);
+}
+
+/* the first crtc in use, its buffer is what sw_compose() draws into */
+static struct connector *
+ref_connector(struct display_kms *disp_kms)
+{
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		if (disp_kms->connector[i].mode)
+			return &disp_kms->connector[i];
+	return NULL;
+}
+
+/* buf is now on screen on c: report it, and let go of the one it replaced */
+static void
+flip_done(struct display *disp, struct connector *c, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct buffer *prev = c->current;
+
+	if (buf_kms->present_crtc == c->crtc)
+		flip_report(disp, buf, &c->stats);
+
+	c->current = buf;
+	if (c == ref_connector(disp_kms))
+		disp_kms->current = buf;
+	if (prev)
+		buffer_unref(disp, prev);
+}
+
+static int connector_flip(struct display *disp, struct connector *c,
+		struct buffer *buf);
+
+static void
+page_flip_handler(int fd, unsigned int frame,
+		unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+{
+	struct connector *c = data;
+	struct display *disp = c->disp;
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *buf = c->flipping;
+
+	flip_stamp(&c->stats, frame, sec, usec);
+
+	DBG("Page flip: crtc=%d, frame=%d, sec=%d, usec=%d, queued=%d",
+			c->crtc, frame, sec, usec, c->queue_len);
+
+	if (!buf)
+		return;
+	c->flipping = NULL;
+	flip_done(disp, c, buf);
+
+	if (c->queue_len) {
+		buf = c->queue[c->queue_head];
+		c->queue_head = (c->queue_head + 1) % disp_kms->flip_queue;
+		c->queue_len--;
+		connector_flip(disp, c, buf);
+	}
+}
+
+static void atomic_flip_handler(int fd, unsigned int frame,
+		unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data);
+
+/* dispatch pending DRM events, waiting at most timeout_ms */
+static int
+wait_events(struct display *disp, int timeout_ms)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	drmEventContext evctx = {
+			.version = DRM_EVENT_CONTEXT_VERSION,
+			.page_flip_handler2 = disp_kms->atomic ?
+					atomic_flip_handler : page_flip_handler,
+	};
+	struct timeval timeout = {
+			.tv_sec = timeout_ms / 1000,
+			.tv_usec = (timeout_ms % 1000) * 1000,
+	};
+	fd_set fds;
+	int ret;
+
+	FD_ZERO(&fds);
+	FD_SET(disp->fd, &fds);
+
+	ret = select(disp->fd + 1, &fds, NULL, NULL, &timeout);
+	if (ret > 0)
+		drmHandleEvent(disp->fd, &evctx);
+
+	return ret;
+}
+
+/* wait for events until done(c) or an error/timeout */
+static int
+wait_connector(struct display *disp, struct connector *c,
+		bool (*done)(struct display_kms *disp_kms, struct connector *c))
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	int ret;
+
+	while (!done(disp_kms, c)) {
+		ret = wait_events(disp, 3000);
+		if (ret == 0 || (ret < 0 && errno != EINTR && errno != EAGAIN)) {
+			ERROR("Timeout waiting for flip complete: %s (%d)",
+					strerror(errno), ret);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool
+flip_idle(struct display_kms *disp_kms, struct connector *c)
+{
+	return !c->flipping;
+}
+
+static bool
+queue_has_room(struct display_kms *disp_kms, struct connector *c)
+{
+	return c->queue_len < disp_kms->flip_queue;
+}
+
+/* NULL c: every crtc in use */
+static bool
+all_flips_idle(struct display_kms *disp_kms, struct connector *c)
+{
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		if (disp_kms->connector[i].flipping)
+			return false;
+	return true;
+}
+
+static int
+get_event_fd(struct display *disp)
+{
+	return disp->fd;
+}
+
+static int
+handle_events(struct display *disp)
+{
+	return wait_events(disp, 0) < 0 ? -1 : 0;
+}
+
+/* schedule a flip to buf, which c already holds a reference on */
+static int
+connector_flip(struct display *disp, struct connector *c, struct buffer *buf)
+{
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	int ret;
+
+	ret = drmModePageFlip(disp->fd, c->crtc, buf_kms->fb_id,
+			DRM_MODE_PAGE_FLIP_EVENT, c);
+	if (ret) {
+		ERROR("Could not post buffer on crtc %d: %s (%d)",
+				c->crtc, strerror(errno), ret);
+		buffer_unref(disp, buf);	/* never shown there */
+		return ret;
+	}
+
+	c->flipping = buf;
+	return 0;
+}
+
+/* show buf on c, scanning out from offset x in it */
+static int
+connector_post(struct display *disp, struct connector *c,
+		struct buffer *buf, uint32_t x)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct buffer *prev;
+	int ret;
+
+	buffer_ref(buf);
+
+	if (c->current && c->x == x) {
+		/* nowhere to queue it without --flip-queue */
+		if (c->flipping && !disp_kms->flip_queue)
+			wait_connector(disp, c, flip_idle);
+
+		if (!c->flipping)
+			return connector_flip(disp, c, buf);
+
+		if (!disp_kms->flip_queue) {
+			buffer_unref(disp, buf);
+			return -1;
+		}
+
+		if (c->queue_len == disp_kms->flip_queue) {
+			/* this crtc is slower than the producer: skip the oldest
+			 * waiting frame rather than hold up the other crtcs
+			 */
+			prev = c->queue[c->queue_head];
+			c->queue_head = (c->queue_head + 1) % disp_kms->flip_queue;
+			c->queue_len--;
+			c->stats.dropped++;
+			buffer_unref(disp, prev);
+		}
+		c->queue[(c->queue_head + c->queue_len) % disp_kms->flip_queue] = buf;
+		c->queue_len++;
+		return 0;
+	}
+
+	/* first buffer on this crtc, setup the mode (since this can't be done
+	 * earlier without a buffer to scanout); also needed to move the
+	 * scanout offset, which a page flip keeps
+	 */
+	if (wait_connector(disp, c, flip_idle) == 0) {
+		while (c->queue_len) {
+			prev = c->queue[c->queue_head];
+			c->queue_head = (c->queue_head + 1) % disp_kms->flip_queue;
+			c->queue_len--;
+			buffer_unref(disp, prev);
+		}
+	}
+
+	MSG("Setting mode %s on connector %d, crtc %d",
+			c->mode_str, c->id, c->crtc);
+
+	ret = drmModeSetCrtc(disp->fd, c->crtc, buf_kms->fb_id,
+			x, 0, &c->id, 1, c->mode);
+	if (ret) {
+		ERROR("Could not post buffer on crtc %d: %s (%d)",
+				c->crtc, strerror(errno), ret);
+		buffer_unref(disp, buf);
+		return ret;
+	}
+
+	c->x = x;
+	prev = c->current;
+	c->current = buf;
+	if (c == ref_connector(disp_kms))
+		disp_kms->current = buf;
+	if (prev)
+		buffer_unref(disp, prev);
+
+	return 0;
+}
+
+/* side-by-side: one buffer across all the crtcs */
+static int
+post_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct connector *ref = ref_connector(disp_kms);
+	int ret, last_err = 0, x = 0;
+	uint32_t i;
+
+	if (!ref)
+		return -1;
+
+	buf_kms->present_crtc = ref->crtc;
+
+	/* without a queue, one buffer at a time: wait until it is up
+	 * everywhere; with one, the first crtc sets the pace, and others
+	 * skip frames (when slower) or show some twice (when faster)
+	 */
+	if (disp_kms->flip_queue)
+		wait_connector(disp, ref, queue_has_room);
+
+	/* keep a reference until all crtcs had a go, so the buffer is
+	 * not released half way if it is dropped on the first ones
+	 */
+	buffer_ref(buf);
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *c = &disp_kms->connector[i];
+
+		if (!c->mode)
+			continue;
+
+		ret = connector_post(disp, c, buf, x);
+		if (ret)
+			last_err = ret;	/* keep trying the rest of the connectors.. */
+
+		x += c->mode->hdisplay;
+	}
+
+	buffer_unref(disp, buf);
+
+	if (!disp_kms->flip_queue && wait_connector(disp, NULL, all_flips_idle))
+		last_err = -1;
+
+	return last_err;
+}
+
+/* the n-th connector in use */
+static struct connector *
+output_connector(struct display_kms *disp_kms, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		if (!disp_kms->connector[i].mode)
+			continue;
+		if (n-- == 0)
+			return &disp_kms->connector[i];
+	}
+	return NULL;
+}
+
+static int
+get_output(struct display *disp, uint32_t n, uint32_t *w, uint32_t *h)
+{
+	struct connector *c = output_connector(to_display_kms(disp), n);
+
+	if (!c)
+		return -1;
+	*w = c->mode->hdisplay;
+	*h = c->mode->vdisplay;
+	return 0;
+}
+
+/* a buffer for one crtc only, flipped at that crtc's own rate */
+static int
+post_output_buffer(struct display *disp, uint32_t n, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct connector *c = output_connector(disp_kms, n);
+	int ret;
+
+	if (!c) {
+		ERROR("no output %u", n);
+		return -EINVAL;
+	}
+
+	buf_kms->present_crtc = c->crtc;
+
+	if (disp_kms->flip_queue) {
+		if (wait_connector(disp, c, queue_has_room))
+			return -1;
+		return connector_post(disp, c, buf, 0);
+	}
+
+	ret = connector_post(disp, c, buf, 0);
+	if (!ret)
+		ret = wait_connector(disp, c, flip_idle);
+	return ret;
+}
+
+int
+get_overlay_plane(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+
+		if (!connector->mode || disp_kms->ovr[i])
+			continue;
+
+		disp_kms->ovr[i] = plane_alloc(disp, connector->pipe, buf->fourcc);
+		if (!disp_kms->ovr[i]) {
+			MSG("Could not find plane for crtc %d", connector->crtc);
+			return -1;
+		}
+
+		ret = plane_setup(disp, disp_kms->ovr[i]);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int post_buffer_atomic(struct display *disp, struct buffer *buf);
+
+static inline uint8_t
+clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* BT.601 terms, so that a pixel is table lookups and adds */
+static struct {
+	bool init;
+	int y[256], rv[256], gu[256], gv[256], bu[256];
+} yuv_tab;
+
+static void
+yuv_tab_init(void)
+{
+	int i;
+
+	if (yuv_tab.init)
+		return;
+	for (i = 0; i < 256; i++) {
+		yuv_tab.y[i] = 298 * (i - 16) + 128;
+		yuv_tab.rv[i] = 409 * (i - 128);
+		yuv_tab.gu[i] = -100 * (i - 128);
+		yuv_tab.gv[i] = -208 * (i - 128);
+		yuv_tab.bu[i] = 516 * (i - 128);
+	}
+	yuv_tab.init = true;
+}
+
+/*
+ * Software composition, for streams that got no plane.  The frame is
+ * drawn into a back buffer, never into the buffer on screen:
+ * compose_begin() picks a compose buffer that is off the screen and
+ * brings it up to date with the application's primary buffer, the
+ * streams are drawn into it, and compose_end() flips to it through
+ * post_buffer(), or into the same atomic commit as the planes.  The
+ * copy of the primary buffer is only redone when it or the video
+ * geometry changed, so a frame costs the conversion of the video
+ * rectangle.
+ */
+/* bring back up to date with base, unless it is already */
+static void
+compose_copy(struct display *disp, struct buffer *back, struct buffer *base)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	int i = back == disp_kms->compose[1];
+	uint8_t *src, *dst;
+	uint32_t y;
+
+	if (disp_kms->compose_from[i] == base)
+		return;
+
+	src = omap_bo_map(base->bo[0]);
+	dst = omap_bo_map(back->bo[0]);
+	omap_bo_cpu_prep(base->bo[0], OMAP_GEM_READ);
+	omap_bo_cpu_prep(back->bo[0], OMAP_GEM_WRITE);
+	for (y = 0; y < back->height; y++)
+		frame_copy_row(dst + y * back->pitches[0],
+				src + y * base->pitches[0], back->width * 4);
+	frame_copy_fence();
+	omap_bo_cpu_fini(back->bo[0], OMAP_GEM_WRITE);
+	omap_bo_cpu_fini(base->bo[0], OMAP_GEM_READ);
+	disp_kms->compose_from[i] = base;
+}
+
+static struct buffer *
+compose_begin(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *base = disp_kms->current;
+	struct buffer *back = NULL;
+	struct buffer_kms *buf_kms;
+	int i, tries;
+
+	/* what the application has on the primary plane, under the video */
+	if (base && base != disp_kms->compose[0] && base != disp_kms->compose[1])
+		disp_kms->compose_base = base;
+	if (disp_kms->compose_base)
+		base = disp_kms->compose_base;
+	if (!base || (base->fourcc && base->fourcc != FOURCC('A','R','2','4'))) {
+		ERROR("no plane left, and no primary buffer to compose into");
+		return NULL;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (disp_kms->compose[i])
+			continue;
+		disp_kms->compose[i] = alloc_buffer(disp, base->fourcc,
+				base->width, base->height);
+		if (!disp_kms->compose[i]) {
+			ERROR("no memory to compose video in");
+			return NULL;
+		}
+		buf_kms = to_buffer_kms(disp_kms->compose[i]);
+		buf_kms->internal = true;
+		disp_kms->compose_from[i] = NULL;
+	}
+
+	/* with atomic, both can be up until the next flip lands */
+	for (tries = 0; !back; tries++) {
+		for (i = 0; i < 2 && !back; i++)
+			if (!buffer_on_screen(disp_kms, disp_kms->compose[i]))
+				back = disp_kms->compose[i];
+		if (!back && (tries == 10 || wait_events(disp, 100) < 0)) {
+			DBG("no compose buffer off the screen, frame dropped");
+			return NULL;
+		}
+	}
+
+	compose_copy(disp, back, base);
+	return back;
+}
+
+static int
+compose_end(struct display *disp, struct buffer *back)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	return disp_kms->atomic ? post_buffer_atomic(disp, back) :
+			post_buffer(disp, back);
+}
+
+/* scale (nearest) and convert buf into the dst rectangle of connector n,
+ * whose area of fb starts at x0 for side-by-side crtcs
+ */
+static int
+sw_compose(struct display *disp, struct buffer *fb, int n, uint32_t x0,
+		struct buffer *buf, struct rect *dst, struct rect *src)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	drmModeModeInfo *mode = disp_kms->connector[n].mode;
+	uint32_t dx, dy, sx_step, sy_step, ystep, cstep, dw, dh, cw, ch;
+	uint8_t *planes[3] = { NULL };
+	uint32_t pitches[3];
+	uint8_t *out;
+	int i;
+
+	if (!buf->bo[0]) {
+		ERROR("no plane left for an imported buffer");
+		return -1;
+	}
+
+	/* the video moved: what it covered needs the primary buffer back */
+	if (memcmp(&disp_kms->compose_dst[n], dst, sizeof(*dst))) {
+		struct buffer *base = disp_kms->compose_from[fb ==
+				disp_kms->compose[1]];
+
+		disp_kms->compose_dst[n] = *dst;
+		disp_kms->compose_from[0] = disp_kms->compose_from[1] = NULL;
+		if (base)
+			compose_copy(disp, fb, base);
+	}
+
+	/* clip to this connector's part of the primary buffer */
+	if (x0 >= fb->width)
+		return 0;
+	cw = MIN(mode->hdisplay, fb->width - x0);
+	ch = MIN(mode->vdisplay, fb->height);
+	if (dst->x >= cw || dst->y >= ch || !dst->w || !dst->h ||
+			!src->w || !src->h)
+		return 0;
+	dw = MIN(dst->w, cw - dst->x);
+	dh = MIN(dst->h, ch - dst->y);
+	sx_step = (src->w << 16) / dst->w;
+	sy_step = (src->h << 16) / dst->h;
+
+	for (i = 0; i < buf->nbo; i++) {
+		planes[i] = omap_bo_map(buf->bo[i]);
+		pitches[i] = buf->pitches[i];
+		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_READ);
+	}
+	if (buf->fourcc == FOURCC('N','V','1','2') && buf->nbo == 1) {
+		/* where the framebuffer has it, TILER pitch included */
+		planes[1] = planes[0] + (buf_kms->offsets[1] ?
+				buf_kms->offsets[1] : pitches[0] * buf->height);
+		pitches[1] = pitches[0];
+	}
+	out = omap_bo_map(fb->bo[0]);
+	omap_bo_cpu_prep(fb->bo[0], OMAP_GEM_WRITE);
+	yuv_tab_init();
+
+	/* Y is at yrow[x * ystep], U/V at urow/vrow[(x / 2) * cstep] */
+	switch (buf->fourcc) {
+	case FOURCC('Y','U','Y','V'):
+	case FOURCC('U','Y','V','Y'):
+		ystep = 2;
+		cstep = 4;
+		break;
+	case FOURCC('N','V','1','2'):
+		ystep = 1;
+		cstep = 2;
+		break;
+	case FOURCC('I','4','2','0'):
+		ystep = 1;
+		cstep = 1;
+		break;
+	default:
+		ERROR("can't compose format 0x%08x", buf->fourcc);
+		goto out;
+	}
+
+	for (dy = 0; dy < dh; dy++) {
+		uint32_t sy = src->y + ((dy * sy_step) >> 16);
+		uint32_t *d = (uint32_t *)(out + (dst->y + dy) * fb->pitches[0]) +
+				x0 + dst->x;
+		uint8_t *yrow, *urow, *vrow;
+		uint32_t sxf = src->x << 16;
+
+		switch (buf->fourcc) {
+		case FOURCC('Y','U','Y','V'):
+			yrow = planes[0] + sy * pitches[0];
+			urow = yrow + 1;
+			vrow = yrow + 3;
+			break;
+		case FOURCC('U','Y','V','Y'):
+			urow = planes[0] + sy * pitches[0];
+			yrow = urow + 1;
+			vrow = urow + 2;
+			break;
+		case FOURCC('N','V','1','2'):
+			yrow = planes[0] + sy * pitches[0];
+			urow = planes[1] + (sy / 2) * pitches[1];
+			vrow = urow + 1;
+			break;
+		default:
+			yrow = planes[0] + sy * pitches[0];
+			urow = planes[1] + (sy / 2) * pitches[1];
+			vrow = planes[2] + (sy / 2) * pitches[2];
+			break;
+		}
+
+		for (dx = 0; dx < dw; dx++, sxf += sx_step) {
+			uint32_t sx = sxf >> 16;
+			int c = yuv_tab.y[yrow[sx * ystep]];
+			int u = urow[(sx / 2) * cstep];
+			int v = vrow[(sx / 2) * cstep];
+
+			d[dx] = 0xff000000 |
+					clamp8((c + yuv_tab.rv[v]) >> 8) << 16 |
+					clamp8((c + yuv_tab.gu[u] + yuv_tab.gv[v]) >> 8) << 8 |
+					clamp8((c + yuv_tab.bu[u]) >> 8);
+		}
+	}
+
+out:
+	omap_bo_cpu_fini(fb->bo[0], OMAP_GEM_WRITE);
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_READ);
+
+	return 0;
+}
+
+static int
+post_vid_buffer(struct display *disp, struct buffer *buf,
+		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	struct buffer *prev, *back = NULL;
+	struct rect dst, src;
+	bool on_plane = false;
+	uint32_t i, x0 = 0;
+	int ret = 0;
+
+	/* ensure we have the overlay setup: */
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		struct connector *connector = &disp_kms->connector[i];
+		drmModeModeInfo *mode = connector->mode;
+
+		if (! mode) {
+			continue;
+		}
+		x0 += mode->hdisplay;
+
+		if (! disp_kms->ovr[i]) {
+			disp_kms->ovr[i] = plane_alloc(disp, connector->pipe, buf->fourcc);
+			if (disp_kms->ovr[i])
+				plane_setup(disp, disp_kms->ovr[i]);
+			else
+				MSG("No plane left for crtc %d, composing in software",
+						connector->crtc);
+		}
+
+		vid_geometry(disp_kms, mode, buf, x, y, w, h, &dst, &src);
+
+		if (! disp_kms->ovr[i]) {
+			if (!back)
+				back = compose_begin(disp);
+			if (!back || sw_compose(disp, back, i,
+					x0 - mode->hdisplay, buf, &dst, &src))
+				ret = -1;
+			continue;
+		}
+
+		on_plane = true;
+		ret = drmModeSetPlane(disp->fd, disp_kms->ovr[i]->id,
+			connector->crtc, buf_kms->fb_id, 0,
+			dst.x, dst.y, dst.w, dst.h,
+			/* source/cropping coordinates are given in Q16 */
+			src.x << 16, src.y << 16, src.w << 16, src.h << 16);
+		if (ret) {
+			ERROR("failed to enable plane %d: %s",
+					disp_kms->ovr[i]->id, strerror(errno));
+		}
+	}
+
+	if (back && compose_end(disp, back))
+		ret = -1;
+
+	/* SetPlane has replaced the previous buffer on the overlays; one
+	 * that was only composed was copied, and is free already
+	 */
+	if (on_plane) {
+		prev = disp_kms->vid_current;
+		disp_kms->vid_current = buf;
+		if (prev && prev != buf)
+			buffer_released(disp, prev);
+	} else if (buf != disp_kms->vid_current) {
+		buffer_released(disp, buf);
+	}
+
+	if (disp_kms->no_master && disp_kms->mastership) {
+		/* Drop mastership after the first buffer on each plane is
+		 * displayed. This will lock these planes for us and allow
+		 * others to consume remaining
+		 */
+		disp_kms->mastership = 0;
+		drmDropMaster(disp->fd);
 	}
 
-	return buf;
+	return ret;
+}
 
-fail:
-	// XXX cleanup
-	return NULL;
+/*
+ * Atomic modesetting.
+ *
+ * Overlay plane updates, z-order and primary flips all go into one
+ * request, committed nonblocking with a page flip event.  Anything
+ * posted while a commit is still in flight is merged into the next
+ * request, which the flip handler commits, so there is at most one
+ * commit per vblank and the posting thread never waits for the flip.
+ */
+
+static int
+get_plane_props(int fd, uint32_t plane_id, struct plane_props *p)
+{
+	p->fb_id   = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	p->crtc_id = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	p->src_x   = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X");
+	p->src_y   = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+	p->src_w   = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W");
+	p->src_h   = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H");
+	p->crtc_x  = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+	p->crtc_y  = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+	p->crtc_w  = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+	p->crtc_h  = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+	/* TI kernels call it zorder, upstream zpos */
+	p->zorder  = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "zorder");
+	if (!p->zorder)
+		p->zorder = get_prop_id(fd, plane_id, DRM_MODE_OBJECT_PLANE, "zpos");
+
+	if (!p->fb_id || !p->crtc_id || !p->src_x || !p->src_y || !p->src_w ||
+			!p->src_h || !p->crtc_x || !p->crtc_y || !p->crtc_w ||
+			!p->crtc_h) {
+		ERROR("plane %d: missing atomic properties", plane_id);
+		return -1;
+	}
+	return 0;
 }
 
-void
-free_buffers(struct display *disp, uint32_t n)
+static void
+atomic_add_plane(struct display *disp, struct connector *connector,
+		uint32_t plane_id, struct plane_props *p, uint32_t fb_id,
+		uint32_t crtc_x, uint32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+		uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h,
+		int zorder)
 {
-	uint32_t i;
-	for (i = 0; i < n; i++) {
-                if (disp->buf[i]) {
-			close(disp->buf[i]->fd[0]);
-			omap_bo_del(disp->buf[i]->bo[0]);
-			if(disp->multiplanar){
-				close(disp->buf[i]->fd[1]);
-				omap_bo_del(disp->buf[i]->bo[1]);
-			}
-                }
-        }
-free(disp->buf);
+	struct display_kms *disp_kms = to_display_kms(disp);
+	drmModeAtomicReqPtr req = disp_kms->req;
+
+	drmModeAtomicAddProperty(req, plane_id, p->fb_id, fb_id);
+	drmModeAtomicAddProperty(req, plane_id, p->crtc_id, connector->crtc);
+	drmModeAtomicAddProperty(req, plane_id, p->crtc_x, crtc_x);
+	drmModeAtomicAddProperty(req, plane_id, p->crtc_y, crtc_y);
+	drmModeAtomicAddProperty(req, plane_id, p->crtc_w, crtc_w);
+	drmModeAtomicAddProperty(req, plane_id, p->crtc_h, crtc_h);
+	/* source coordinates are given in Q16 */
+	drmModeAtomicAddProperty(req, plane_id, p->src_x, src_x << 16);
+	drmModeAtomicAddProperty(req, plane_id, p->src_y, src_y << 16);
+	drmModeAtomicAddProperty(req, plane_id, p->src_w, src_w << 16);
+	drmModeAtomicAddProperty(req, plane_id, p->src_h, src_h << 16);
+	if (zorder >= 0 && p->zorder)
+		drmModeAtomicAddProperty(req, plane_id, p->zorder, zorder);
+
+	disp_kms->req_pipes |= (1 << connector->pipe);
 }
 
-static struct buffer **
-alloc_buffers(struct display *disp, uint32_t n,
-		uint32_t fourcc, uint32_t w, uint32_t h)
+static int atomic_commit(struct display *disp);
+
+static void
+atomic_flip_handler(int fd, unsigned int frame,
+		unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
 {
-	struct buffer **bufs;
-	uint32_t i = 0;
+	struct display *disp = data;
+	struct display_kms *disp_kms = to_display_kms(disp);
 
-	bufs = calloc(n, sizeof(*bufs));
-	if (!bufs) {
-		ERROR("allocation failed");
-		goto fail;
+	/* crtc_id is 0 with kernels that don't report it */
+	if (!crtc_id || crtc_id == disp_kms->ref_crtc)
+		flip_stamp(&disp_kms->stats, frame, sec, usec);
+
+	/* one event per crtc in the commit */
+	if (--disp_kms->flips_in_flight > 0)
+		return;
+
+	DBG("Atomic flip: frame=%d, sec=%d, usec=%d", frame, sec, usec);
+
+	if (disp_kms->flipping) {
+		struct buffer *buf = disp_kms->flipping;
+		struct buffer *prev = disp_kms->current;
+
+		disp_kms->flipping = NULL;
+		disp_kms->current = buf;
+		flip_report(disp, buf, &disp_kms->stats);
+		if (prev && prev != buf)
+			buffer_released(disp, prev);
 	}
 
-	for (i = 0; i < n; i++) {
-		bufs[i] = alloc_buffer(disp, fourcc, w, h);
-		if (!bufs[i]) {
-			ERROR("allocation failed");
-			goto fail;
-		}
+	if (disp_kms->vid_flipping) {
+		struct buffer *buf = disp_kms->vid_flipping;
+		struct buffer *prev = disp_kms->vid_current;
+
+		disp_kms->vid_flipping = NULL;
+		disp_kms->vid_current = buf;
+		disp_kms->vid_stats.sequence = disp_kms->stats.sequence;
+		disp_kms->vid_stats.time = disp_kms->stats.time;
+		flip_report(disp, buf, &disp_kms->vid_stats);
+		if (prev && prev != buf)
+			buffer_released(disp, prev);
 	}
-	disp->buf=bufs;
-	return bufs;
 
-fail:
-	// XXX cleanup
-	return NULL;
+	/* whatever was posted meanwhile goes out with the next vblank */
+	atomic_commit(disp);
 }
 
-static struct buffer **
-get_buffers(struct display *disp, uint32_t n)
+/* forget a buffer of a failed commit, releasing it unless still shown */
+static void
+atomic_drop(struct display *disp, struct buffer **slot)
 {
-	return alloc_buffers(disp, n, 0, disp->width, disp->height);
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer *buf = *slot;
+
+	*slot = NULL;
+	if (buf && buf != disp_kms->current && buf != disp_kms->flipping &&
+			buf != disp_kms->vid_current &&
+			buf != disp_kms->vid_flipping)
+		buffer_released(disp, buf);
 }
 
-static struct buffer **
-get_vid_buffers(struct display *disp, uint32_t n,
-		uint32_t fourcc, uint32_t w, uint32_t h)
+static int
+atomic_commit(struct display *disp)
 {
-	return alloc_buffers(disp, n, fourcc, w, h);
+	struct display_kms *disp_kms = to_display_kms(disp);
+	int ret;
+
+	if (!disp_kms->req || disp_kms->flips_in_flight)
+		return 0;
+
+	ret = drmModeAtomicCommit(disp->fd, disp_kms->req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, disp);
+	if (ret) {
+		if (errno == EBUSY) {
+			/* another commit on the crtc; retry on the next post */
+			return 0;
+		}
+		ERROR("atomic commit failed: %s (%d)", strerror(errno), ret);
+		/* dropped with req, so they never reach the screen */
+		atomic_drop(disp, &disp_kms->pending);
+		atomic_drop(disp, &disp_kms->vid_pending);
+	} else {
+		disp_kms->flips_in_flight = __builtin_popcount(disp_kms->req_pipes);
+		disp_kms->flipping = disp_kms->pending;
+		disp_kms->pending = NULL;
+		disp_kms->vid_flipping = disp_kms->vid_pending;
+		disp_kms->vid_pending = NULL;
+	}
+
+	drmModeAtomicFree(disp_kms->req);
+	disp_kms->req = NULL;
+	disp_kms->req_pipes = 0;
+
+	return ret;
 }
 
-static void
-page_flip_handler(int fd, unsigned int frame,
-		unsigned int sec, unsigned int usec, void *data)
+static int
+atomic_flush(struct display *disp)
 {
-	struct display *disp = data;
 	struct display_kms *disp_kms = to_display_kms(disp);
 
-	disp_kms->completed_flips++;
+	/* pick up completed flips without blocking */
+	while (disp_kms->flips_in_flight && wait_events(disp, 0) > 0)
+		;
+
+	return atomic_commit(disp);
+}
+
+static drmModeAtomicReqPtr
+atomic_req(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
 
-	MSG("Page flip: frame=%d, sec=%d, usec=%d, remaining=%d", frame, sec, usec,
-			disp_kms->scheduled_flips - disp_kms->completed_flips);
+	if (!disp_kms->req)
+		disp_kms->req = drmModeAtomicAlloc();
+	return disp_kms->req;
 }
 
 static int
-post_buffer(struct display *disp, struct buffer *buf)
+atomic_init(struct display *disp)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
-	struct buffer_kms *buf_kms = to_buffer_kms(buf);
-	int ret, last_err = 0, x = 0;
-	uint32_t i;
+	uint32_t i, j;
 
 	for (i = 0; i < disp_kms->connectors_count; i++) {
 		struct connector *connector = &disp_kms->connector[i];
 
-		if (! connector->mode) {
+		if (!connector->mode)
 			continue;
-		}
 
-		if (! disp_kms->current) {
-			/* first buffer we flip to, setup the mode (since this can't
-			 * be done earlier without a buffer to scanout)
-			 */
-			MSG("Setting mode %s on connector %d, crtc %d",
-					connector->mode_str, connector->id, connector->crtc);
+		if (!disp_kms->ref_crtc) {
+			disp_kms->ref_crtc = connector->crtc;
+			disp_kms->stats.refresh_us = connector->stats.refresh_us;
+			disp_kms->vid_stats.refresh_us = connector->stats.refresh_us;
+		}
 
-			ret = drmModeSetCrtc(disp->fd, connector->crtc, buf_kms->fb_id,
-					x, 0, &connector->id, 1, connector->mode);
+		connector->atomic.crtc_id_prop = get_prop_id(disp->fd,
+				connector->id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+		connector->atomic.mode_id_prop = get_prop_id(disp->fd,
+				connector->crtc, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+		connector->atomic.active_prop = get_prop_id(disp->fd,
+				connector->crtc, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+		if (!connector->atomic.crtc_id_prop ||
+				!connector->atomic.mode_id_prop ||
+				!connector->atomic.active_prop) {
+			ERROR("connector %d: missing atomic properties", connector->id);
+			return -1;
+		}
 
-			x += connector->mode->hdisplay;
-		} else {
-			ret = drmModePageFlip(disp->fd, connector->crtc, buf_kms->fb_id,
-					DRM_MODE_PAGE_FLIP_EVENT, disp);
-			disp_kms->scheduled_flips++;
+		if (drmModeCreatePropertyBlob(disp->fd, connector->mode,
+				sizeof(*connector->mode), &connector->atomic.mode_blob)) {
+			ERROR("could not create mode blob: %s", strerror(errno));
+			return -1;
 		}
 
-		if (ret) {
-			ERROR("Could not post buffer on crtc %d: %s (%d)",
-					connector->crtc, strerror(errno), ret);
-			last_err = ret;
-			/* well, keep trying the reset of the connectors.. */
-		}
-	}
-
-	/* if we flipped, wait for all flips to complete! */
-	while (disp_kms->scheduled_flips > disp_kms->completed_flips) {
-		drmEventContext evctx = {
-				.version = DRM_EVENT_CONTEXT_VERSION,
-				.page_flip_handler = page_flip_handler,
-		};
-		struct timeval timeout = {
-				.tv_sec = 3,
-				.tv_usec = 0,
-		};
-		fd_set fds;
-
-		FD_ZERO(&fds);
-		FD_SET(disp->fd, &fds);
-
-		ret = select(disp->fd + 1, &fds, NULL, NULL, &timeout);
-		if (ret <= 0) {
-			if (errno == EAGAIN) {
-				continue;    /* keep going */
-			} else {
-				ERROR("Timeout waiting for flip complete: %s (%d)",
-						strerror(errno), ret);
-				last_err = ret;
+		/* the primary plane scans out the buffers of post_buffer() */
+		for (j = 0; j < caps.nplanes; j++) {
+			struct plane_slot *slot = &caps.planes[j];
+
+			if (slot->type == DRM_PLANE_TYPE_PRIMARY &&
+					(slot->possible_crtcs & (1 << connector->pipe))) {
+				connector->atomic.primary = slot->id;
 				break;
 			}
 		}
-
-		drmHandleEvent(disp->fd, &evctx);
+		if (!connector->atomic.primary ||
+				get_plane_props(disp->fd, connector->atomic.primary,
+				&connector->atomic.primary_props)) {
+			ERROR("no primary plane for crtc %d", connector->crtc);
+			return -1;
+		}
 	}
 
-	disp_kms->current = buf;
-
-	return last_err;
+	return 0;
 }
 
-int
-get_overlay_plane(struct display *disp, struct buffer *buf)
+static int
+post_buffer_atomic(struct display *disp, struct buffer *buf)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+	int ret, x = 0;
 	uint32_t i;
-	int ret;
+
+	if (!atomic_req(disp))
+		return -ENOMEM;
 
 	for (i = 0; i < disp_kms->connectors_count; i++) {
-		disp_kms->ovr[i] = drmModeGetPlane(disp->fd,
-					disp_kms->plane_resources->planes[1]);
+		struct connector *connector = &disp_kms->connector[i];
+		drmModeModeInfo *mode = connector->mode;
+
+		if (!mode)
+			continue;
+
+		if (!disp_kms->current) {
+			MSG("Setting mode %s on connector %d, crtc %d (atomic)",
+					connector->mode_str, connector->id, connector->crtc);
+			drmModeAtomicAddProperty(disp_kms->req, connector->id,
+					connector->atomic.crtc_id_prop, connector->crtc);
+			drmModeAtomicAddProperty(disp_kms->req, connector->crtc,
+					connector->atomic.mode_id_prop,
+					connector->atomic.mode_blob);
+			drmModeAtomicAddProperty(disp_kms->req, connector->crtc,
+					connector->atomic.active_prop, 1);
+		}
+
+		/* side-by-side: each crtc shows its own slice of the buffer */
+		atomic_add_plane(disp, connector, connector->atomic.primary,
+				&connector->atomic.primary_props, buf_kms->fb_id,
+				0, 0, mode->hdisplay, mode->vdisplay,
+				x, 0, mode->hdisplay, mode->vdisplay, -1);
+		x += mode->hdisplay;
+	}
 
-		ret = drmModeObjectSetProperty(disp->fd,
-			disp_kms->ovr[i]->plane_id, DRM_MODE_OBJECT_PLANE, 7, 3);
-		if (ret < 0) {
-			MSG("Could not set Z order for plane");
+	if (!disp_kms->current) {
+		/* the modeset is done once, and synchronously */
+		ret = drmModeAtomicCommit(disp->fd, disp_kms->req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		drmModeAtomicFree(disp_kms->req);
+		disp_kms->req = NULL;
+		disp_kms->req_pipes = 0;
+		if (ret) {
+			ERROR("atomic modeset failed: %s (%d)", strerror(errno), ret);
 			return ret;
 		}
+		disp_kms->current = buf;
+	} else {
+		struct buffer *prev = disp_kms->pending;
+
+		/* superseded before it was committed */
+		disp_kms->pending = buf;
+		if (prev && prev != buf)
+			buffer_released(disp, prev);
+		ret = atomic_flush(disp);
 	}
-	return 0;
+
+	return ret;
 }
 
 static int
-post_vid_buffer(struct display *disp, struct buffer *buf,
+post_vid_buffer_atomic(struct display *disp, struct buffer *buf,
 		uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
 	struct display_kms *disp_kms = to_display_kms(disp);
 	struct buffer_kms *buf_kms = to_buffer_kms(buf);
-	drmModePlane *ovr;
+	struct buffer *prev, *back = NULL;
+	struct rect dst, src;
+	bool on_plane = false;
+	uint32_t i, x0 = 0;
 	int ret = 0;
-	uint32_t i, j;
 
-	/* ensure we have the overlay setup: */
+	if (!atomic_req(disp))
+		return -ENOMEM;
+
 	for (i = 0; i < disp_kms->connectors_count; i++) {
 		struct connector *connector = &disp_kms->connector[i];
+		struct plane_slot *slot;
 		drmModeModeInfo *mode = connector->mode;
 
-		if (! mode) {
+		if (!mode)
 			continue;
-		}
-
-		if (! disp_kms->ovr[i]) {
-
-			for (j = 0; j < disp_kms->plane_resources->count_planes; j++) {
-				if (used_planes & (1 << j)) {
-					continue;
-				}
-				ovr = drmModeGetPlane(disp->fd,
-						disp_kms->plane_resources->planes[j]);
-				if (ovr->possible_crtcs & (1 << connector->pipe)) {
-					disp_kms->ovr[i] = ovr;
-					used_planes |= (1 << j);
-					break;
-				}
+		x0 += mode->hdisplay;
+
+		if (!disp_kms->ovr[i]) {
+			slot = plane_alloc(disp, connector->pipe, buf->fourcc);
+			if (slot && get_plane_props(disp->fd, slot->id,
+					&connector->atomic.ovr_props)) {
+				slot->owner = NULL;
+				slot = NULL;
 			}
+			if (!slot)
+				MSG("No plane left for crtc %d, composing in software",
+						connector->crtc);
+			disp_kms->ovr[i] = slot;
 		}
 
-		if (! disp_kms->ovr[i]) {
-			MSG("Could not find plane for crtc %d", connector->crtc);
-			ret = -1;
-			/* carry on and see if we can find at least one usable plane */
+		vid_geometry(disp_kms, mode, buf, x, y, w, h, &dst, &src);
+
+		slot = disp_kms->ovr[i];
+		if (!slot) {
+			if (!back)
+				back = compose_begin(disp);
+			if (!back || sw_compose(disp, back, i,
+					x0 - mode->hdisplay, buf, &dst, &src))
+				ret = -1;
 			continue;
 		}
 
-		if(buf->noScale) {
-			ret = drmModeSetPlane(disp->fd, disp_kms->ovr[i]->plane_id,
-				connector->crtc, buf_kms->fb_id, 0,
-				/* Use x and y as co-ordinates of overlay */
-				x, y, buf->width, buf->height,
-				/* Consider source x and y is 0 always */
-				0, 0, w << 16, h << 16);
-		} else {
-			ret = drmModeSetPlane(disp->fd, disp_kms->ovr[i]->plane_id,
-				connector->crtc, buf_kms->fb_id, 0,
-				/* make video fullscreen: */
-				0, 0, mode->hdisplay, mode->vdisplay,
-				/* source/cropping coordinates are given in Q16 */
-				x << 16, y << 16, w << 16, h << 16);
-		}
-		if (ret) {
-			ERROR("failed to enable plane %d: %s",
-					disp_kms->ovr[i]->plane_id, strerror(errno));
-		}
+		atomic_add_plane(disp, connector, slot->id,
+				&connector->atomic.ovr_props, buf_kms->fb_id,
+				dst.x, dst.y, dst.w, dst.h,
+				src.x, src.y, src.w, src.h, slot->zorder);
+		if (disp_kms->alpha >= 0 && slot->alpha_prop)
+			drmModeAtomicAddProperty(disp_kms->req, slot->id,
+					slot->alpha_prop,
+					(uint64_t)disp_kms->alpha * slot->alpha_max / 255);
+		on_plane = true;
+	}
+
+	/* on screen from the flip of the commit that takes req, released
+	 * by the flip after that; superseded before the commit, now
+	 */
+	if (on_plane) {
+		prev = disp_kms->vid_pending;
+		disp_kms->vid_pending = buf;
+		if (prev && prev != buf)
+			buffer_released(disp, prev);
+	}
+
+	/* the composed primary buffer goes into the same commit */
+	if (back) {
+		if (compose_end(disp, back))
+			ret = -1;
+	} else if (atomic_flush(disp)) {
+		ret = -1;
 	}
 
+	if (!on_plane && buf != disp_kms->vid_current &&
+			buf != disp_kms->vid_flipping)
+		buffer_released(disp, buf);
+
 	if (disp_kms->no_master && disp_kms->mastership) {
-		/* Drop mastership after the first buffer on each plane is
-		 * displayed. This will lock these planes for us and allow
-		 * others to consume remaining
-		 */
 		disp_kms->mastership = 0;
 		drmDropMaster(disp->fd);
 	}
@@ -432,116 +2336,150 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	return ret;
 }
 
+/* with atomic, a video buffer stays on screen after the post returns */
+static bool
+hold_vid_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+	struct buffer_kms *buf_kms = to_buffer_kms(buf);
+
+	if (!buffer_on_screen(disp_kms, buf))
+		return false;
+
+	buf_kms->held = true;
+	return true;
+}
+
+/* wait for the flip that releases a held video buffer */
+static int
+wait_vid_buffer(struct display *disp)
+{
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	if (!disp_kms->flips_in_flight) {
+		/* nothing in flight: what is waiting in req goes now */
+		if (atomic_commit(disp) || !disp_kms->flips_in_flight)
+			return 0;
+	}
+	return wait_events(disp, 1000) > 0;
+}
+
 static void
 close_kms(struct display *disp)
 {
+	struct display_kms *disp_kms = to_display_kms(disp);
+
+	uint32_t i;
+
+	/* let the last flips land before the buffers can go away */
+	for (i = 0; i < disp_kms->connectors_count; i++)
+		disp_kms->connector[i].queue_len = 0;
+	while ((disp_kms->flips_in_flight || disp_kms->flipping ||
+			!all_flips_idle(disp_kms, NULL)) &&
+			wait_events(disp, 100) > 0)
+		;
+	if (disp_kms->req)
+		drmModeAtomicFree(disp_kms->req);
+	for (i = 0; i < 2; i++)
+		if (disp_kms->compose[i])
+			buffer_free(disp, disp_kms->compose[i]);
+
+	flip_stats_print(disp_kms->ref_crtc, &disp_kms->stats);
+	for (i = 0; i < disp_kms->connectors_count; i++) {
+		flip_stats_print(disp_kms->connector[i].crtc,
+				&disp_kms->connector[i].stats);
+		free(disp_kms->connector[i].queue);
+	}
+
 	omap_device_del(disp->dev);
 	disp->dev = NULL;
-	if (used_planes) {
-		used_planes >>= 1;
-	}
+	planes_release(disp);
 	if (--ndisplays == 0) {
+		kms_caps_free();
+		import_cache_purge(global_fd);
+		buffer_cache_purge(global_fd);
 		close(global_fd);
+		global_fd = 0;
 	}
 }
 
 static void
 connector_find_mode(struct display *disp, struct connector *c)
 {
-	struct display_kms *disp_kms = to_display_kms(disp);
-	drmModeConnector *connector;
+	drmModeConnector *connector = NULL;
+	uint32_t encoder_id, crtc_id = 0;
 	int i, j;
 
 	/* First, find the connector & mode */
 	c->mode = NULL;
-	for (i = 0; i < disp_kms->resources->count_connectors; i++) {
-		connector = drmModeGetConnector(disp->fd,
-				disp_kms->resources->connectors[i]);
-
-		if (!connector) {
-			ERROR("could not get connector %i: %s",
-					disp_kms->resources->connectors[i], strerror(errno));
-			drmModeFreeConnector(connector);
-			continue;
-		}
-
-		if (!connector->count_modes) {
-			drmModeFreeConnector(connector);
-			continue;
-		}
-
-		if (connector->connector_id != c->id) {
-			drmModeFreeConnector(connector);
-			continue;
+	c->encoder = NULL;
+	for (i = 0; i < caps.res->count_connectors; i++) {
+		if (caps.connectors[i] &&
+				caps.connectors[i]->connector_id == c->id &&
+				caps.connectors[i]->count_modes) {
+			connector = caps.connectors[i];
+			break;
 		}
+	}
 
+	if (connector) {
+		/* falls back to the last mode, if none is called mode_str */
 		for (j = 0; j < connector->count_modes; j++) {
 			c->mode = &connector->modes[j];
 			if (!strcmp(c->mode->name, c->mode_str))
 				break;
 		}
-
-		/* Found it, break out */
-		if (c->mode)
-			break;
-
-		drmModeFreeConnector(connector);
 	}
 
 	if (!c->mode) {
 		ERROR("failed to find mode \"%s\"", c->mode_str);
 		return;
 	}
+	c->stats.refresh_us = c->mode->vrefresh ?
+			1000000 / c->mode->vrefresh : 0;
 
-	/* Now get the encoder */
+	/* Now get the encoder, take the first one if none is assigned */
+	encoder_id = connector->encoder_id;
 	for (i = 0; i < connector->count_encoders; i++) {
-		c->encoder = drmModeGetEncoder(disp->fd,
-				connector->encoders[i]);
+		drmModeEncoder *encoder = find_encoder(connector->encoders[i]);
 
-		if (!c->encoder) {
-			ERROR("could not get encoder %i: %s",
-					disp_kms->resources->encoders[i], strerror(errno));
+		if (!encoder)
+			continue;
+
+		if (!encoder_id)
+			encoder_id = encoder->encoder_id;
+		if (encoder->encoder_id != encoder_id)
 			continue;
+
+		/* find the first valid CRTC if not assigned */
+		crtc_id = encoder->crtc_id;
+		for (j = 0; !crtc_id && j < caps.res->count_crtcs; j++) {
+			/* check whether this CRTC works with the encoder */
+			if (encoder->possible_crtcs & (1 << j))
+				crtc_id = caps.res->crtcs[j];
 		}
 
-		/* Take the fisrt one, if none is assigned */
-		if (!connector->encoder_id)
-		{
-			connector->encoder_id = c->encoder->encoder_id;
-		}
-
-		if (c->encoder->encoder_id  == connector->encoder_id) {
-			/* find the first valid CRTC if not assigned */
-			if (!c->encoder->crtc_id)
-			{
-				int k;
-				for (k = 0; k < disp_kms->resources->count_crtcs; ++k) {
-					/* check whether this CRTC works with the encoder */
-					if (!(c->encoder->possible_crtcs & (1 << k)))
-						continue;
-
-					c->encoder->crtc_id = disp_kms->resources->crtcs[k];
-					break;
-				}
-
-				if (!c->encoder->crtc_id)
-				{
-					ERROR("Encoder(%d): no CRTC found!\n", c->encoder->encoder_id);
-					drmModeFreeEncoder(c->encoder);
-					continue;
-				}
-			}
-			break;
+		if (!crtc_id) {
+			ERROR("Encoder(%d): no CRTC found!", encoder->encoder_id);
+			continue;
 		}
-		drmModeFreeEncoder(c->encoder);
+
+		c->encoder = encoder;
+		break;
+	}
+
+	if (!c->encoder) {
+		ERROR("no encoder for connector %d", c->id);
+		c->mode = NULL;
+		return;
 	}
 
 	if (c->crtc == -1)
-		c->crtc = c->encoder->crtc_id;
+		c->crtc = crtc_id;
 
 	/* and figure out which crtc index it is: */
-	for (i = 0; i < disp_kms->resources->count_crtcs; i++) {
-		if (c->crtc == (int)disp_kms->resources->crtcs[i]) {
+	for (i = 0; i < caps.res->count_crtcs; i++) {
+		if (c->crtc == (int)caps.res->crtcs[i]) {
 			c->pipe = i;
 			break;
 		}
@@ -553,9 +2491,18 @@ disp_kms_usage(void)
 {
 	MSG("KMS Display Options:");
 	MSG("\t-1 \t\tforce single-plane buffers");
-	MSG("\t-t <tiled-mode>\t8, 16, 32, or auto");
+	MSG("\t-t <tiled-mode>\t8, 16, 32, auto, or linear");
 	MSG("\t-s <connector_id>:<mode>\tset a mode");
 	MSG("\t-s <connector_id>@<crtc_id>:<mode>\tset a mode");
+	MSG("\t--bo-bench\tmeasure linear vs tiled buffers, save the faster layouts to the --bo-policy file (required) and use them");
+	MSG("\t--bo-policy <file>\tlayout policy from --bo-bench, used when -t is not given (none by default)");
+	MSG("\t--buffer-cache <n>\tkeep up to n freed buffers for reuse (default 32, 0 disables)");
+	MSG("\t--import-cache <n>\tkeep framebuffers for up to n imported dmabufs (default 64)");
+	MSG("\t--atomic\tuse atomic modesetting, nonblocking commits");
+	MSG("\t--flip-queue <n>\tdon't wait for flips, queue up to n buffers per crtc");
+	MSG("\t--window <x>,<y>,<w>x<h>\tshow video in this rectangle instead of full screen");
+	MSG("\t--zorder <n>\tz-order of the video plane (default: stacked in the order streams start)");
+	MSG("\t--alpha <0-255>\tglobal alpha of the video plane");
 }
 
 struct display *
@@ -564,6 +2511,7 @@ disp_kms_open(int argc, char **argv)
 	struct display_kms *disp_kms = NULL;
 	struct display *disp;
 	struct buffer **bufs;
+	bool bo_bench = false;
 	int i;
 
 	disp_kms = calloc(1, sizeof(*disp_kms));
@@ -572,6 +2520,8 @@ disp_kms_open(int argc, char **argv)
 		goto fail;
 	}
 	disp = &disp_kms->base;
+	disp_kms->zorder = -1;
+	disp_kms->alpha = -1;
 
 	if (!global_fd) {
 		global_fd = drmOpen("omapdrm", NULL);
@@ -596,17 +2546,35 @@ disp_kms_open(int argc, char **argv)
 	disp->post_vid_buffer = post_vid_buffer;
 	disp->close = close_kms;
 	disp->disp_free_buf = free_buffers ;
-	disp_kms->resources = drmModeGetResources(disp->fd);
-	if (!disp_kms->resources) {
-		ERROR("drmModeGetResources failed: %s", strerror(errno));
-		goto fail;
+	disp->import_vid_buffer = import_vid_buffer;
+	disp->get_output = get_output;
+	disp->post_output_buffer = post_output_buffer;
+	disp->get_event_fd = get_event_fd;
+	disp->handle_events = handle_events;
+	disp->supports_format = supports_format;
+	/* --atomic has to be known before the plane list is read, since
+	 * it changes which planes the kernel reports
+	 */
+	for (i = 1; i < argc; i++) {
+		if (argv[i] && !strcmp("--atomic", argv[i])) {
+			if (drmSetClientCap(disp->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+				ERROR("atomic modesetting not supported: %s",
+						strerror(errno));
+				goto fail;
+			}
+			disp_kms->atomic = true;
+			disp->post_buffer = post_buffer_atomic;
+			disp->post_vid_buffer = post_vid_buffer_atomic;
+			disp->hold_vid_buffer = hold_vid_buffer;
+			disp->wait_vid_buffer = wait_vid_buffer;
+			/* commits cover all crtcs, see atomic_flip_handler() */
+			disp->post_output_buffer = NULL;
+			argv[i] = NULL;
+		}
 	}
 
-	disp_kms->plane_resources = drmModeGetPlaneResources(disp->fd);
-	if (!disp_kms->plane_resources) {
-		ERROR("drmModeGetPlaneResources failed: %s", strerror(errno));
+	if (kms_probe(disp, disp_kms->atomic))
 		goto fail;
-	}
 
 	disp->multiplanar = true;
 
@@ -624,6 +2592,10 @@ disp_kms_open(int argc, char **argv)
 			argv[i++] = NULL;
 			if (!strcmp(argv[i], "auto")) {
 				n = 0;
+			} else if (!strcmp(argv[i], "linear")) {
+				/* and don't let the layout policy pick */
+				disp_kms->bo_policy = NULL;
+				n = -1;
 			} else if (sscanf(argv[i], "%d", &n) != 1) {
 				ERROR("invalid arg: %s", argv[i]);
 				goto fail;
@@ -639,6 +2611,8 @@ disp_kms_open(int argc, char **argv)
 				disp_kms->bo_flags |= OMAP_BO_TILED_32;
 			} else if (n == 0) {
 				disp_kms->bo_flags |= OMAP_BO_TILED;
+			} else if (n < 0) {
+				/* linear */
 			} else {
 				ERROR("invalid arg: %s", argv[i]);
 				goto fail;
@@ -660,6 +2634,51 @@ disp_kms_open(int argc, char **argv)
 				goto fail;
 			}
 			disp_kms->bo_flags |= OMAP_BO_SCANOUT;
+		} else if (!strcmp("--bo-bench", argv[i])) {
+			bo_bench = true;
+		} else if (!strcmp("--bo-policy", argv[i])) {
+			argv[i++] = NULL;
+			disp_kms->bo_policy = argv[i];
+		} else if (!strcmp("--buffer-cache", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &buffer_cache.max) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--import-cache", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &import_cache.max) != 1 ||
+					!import_cache.max) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--flip-queue", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &disp_kms->flip_queue) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--window", argv[i])) {
+			struct rect *win = &disp_kms->window;
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u,%u,%ux%u",
+					&win->x, &win->y, &win->w, &win->h) != 4) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--zorder", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%d", &disp_kms->zorder) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--alpha", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%d", &disp_kms->alpha) != 1 ||
+					disp_kms->alpha < 0 || disp_kms->alpha > 255) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
 		} else if (!strcmp("-nm", argv[i])) {
 			disp_kms->no_master = true;
 			disp_kms->mastership = 1;
@@ -674,6 +2693,14 @@ disp_kms_open(int argc, char **argv)
 	disp->height = 0;
 	for (i = 0; i < (int)disp_kms->connectors_count; i++) {
 		struct connector *c = &disp_kms->connector[i];
+		c->disp = disp;
+		if (disp_kms->flip_queue) {
+			c->queue = calloc(disp_kms->flip_queue, sizeof(*c->queue));
+			if (!c->queue) {
+				ERROR("allocation failed");
+				goto fail;
+			}
+		}
 		connector_find_mode(disp, c);
 		if (c->mode == NULL)
 			continue;
@@ -684,8 +2711,21 @@ disp_kms_open(int argc, char **argv)
 		}
 	}
 
-	MSG("using %d connectors, %dx%d display, multiplanar: %d",
-			disp_kms->connectors_count, disp->width, disp->height, disp->multiplanar);
+	MSG("using %d connectors, %dx%d display, multiplanar: %d, atomic: %d",
+			disp_kms->connectors_count, disp->width, disp->height,
+			disp->multiplanar, disp_kms->atomic);
+
+	if (bo_bench) {
+		if (!disp_kms->bo_policy) {
+			ERROR("--bo-bench needs --bo-policy <file> to write to");
+			goto fail;
+		}
+		bo_layout_bench(disp->dev, disp->width, disp->height,
+				disp_kms->bo_policy);
+	}
+
+	if (disp_kms->atomic && atomic_init(disp))
+		goto fail;
 
 	bufs = disp_get_buffers(disp, 1);
 	disp_post_buffer(disp, bufs[0]);
@@ -107,6 +107,8 @@ struct display_kmscube {
 		eglDestroyImageKHR_t *eglDestroyImageKHR;
 		glEGLImageTargetTexture2DOES_t *glEGLImageTargetTexture2DOES;
 		float distance, fov;
+		GLuint vbo, ibo;
+		ESMatrix projection;
 	} gl;
 
 	// GBM.
@@ -129,10 +131,54 @@ struct display_kmscube {
 	uint32_t user_connector_id;
 
 	int num_faces;
+	/*
+	 * Latest posted buffer per face.  Producers swap their buffer in with
+	 * an atomic exchange and never wait for the render thread; whatever
+	 * they replace was never drawn and is handed back right away.  The
+	 * render thread takes the mailbox contents at the start of a frame
+	 * into current_buffers[], which only it touches.
+	 */
+	struct buffer *mailbox[MAX_FACES];
 	struct buffer *current_buffers[MAX_FACES];
 	pthread_t renderThread;
-	pthread_mutex_t lock[MAX_FACES];
 	pthread_mutex_t init_lock;
+
+	/*
+	 * EGLImage/texture cache.  Images are created by alloc_buffers() on
+	 * the producer side and queued on fresh; the render thread gives
+	 * them a texture before its next frame.  Buffers freed by the
+	 * producer are queued on dead and destroyed by the render thread,
+	 * which owns lru and everything GL.
+	 */
+	struct {
+		pthread_mutex_t lock;		/* fresh and dead */
+		struct list fresh, dead;
+		struct list lru;
+		unsigned int count, max;
+		unsigned int hits, misses, evictions;
+	} tex;
+
+	/*
+	 * --damage: only redraw when a face got a new buffer, a pool
+	 * changed, or the animation is due.  Producers set dirty and only
+	 * the first one per frame takes the lock to wake the render thread.
+	 */
+	struct {
+		bool enabled;
+		unsigned int anim_ms;		/* 0: only new buffers redraw */
+		bool dirty;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		uint64_t last_us;
+		unsigned long rendered, skipped;
+	} damage;
+
+	/* --bench-frames: render thread cost, reported every n frames */
+	struct render_bench {
+		unsigned int n, frames;
+		uint64_t start_us, cpu_start_us;
+		uint64_t draw_us, draw_max, swap_us;
+	} bench;
 };
 
 /* All our buffers are only vid buffers, and they all have an EGLImage. */
@@ -142,7 +188,10 @@ struct buffer_kmscube {
 	uint32_t fb_id;
 	EGLImageKHR egl_img;
 	GLuint texture_name;
+	struct gbm_bo *gbm_bo;		/* ARGB buffers are imported through gbm */
 	int face_no;
+	struct list lru;		/* tex.lru, while it has a texture */
+	struct list queue;		/* tex.fresh or tex.dead */
 };
 
 struct drm_fb {
@@ -152,8 +201,11 @@ struct drm_fb {
 };
 
 static void *render_thread(void *data);
+static int create_image(struct display_kmscube *disp_kmsc, struct buffer *buf);
 static int create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf);
 static int get_texture(struct display_kmscube *disp_kmsc, int face);
+static void tex_cache_update(struct display_kmscube *disp_kmsc);
+static void init_geometry(struct display_kmscube *disp_kmsc);
 
 static int init_drm(struct display_kmscube *disp_kmsc)
 {
@@ -476,204 +528,230 @@ static int init_gl(struct display_kmscube *disp_kmsc)
 
 	glViewport(0, 0, disp_kmsc->drm.mode->hdisplay, disp_kmsc->drm.mode->vdisplay);
 
+	init_geometry(disp_kmsc);
+
 	/* Textures would be created at runtime by render thread */
 
 	return 0;
 }
 
-static void draw(struct display_kmscube *disp_kmsc)
-{
-	int face, tex_name;
-	ESMatrix modelview;
-	static const GLfloat vVertices[] = {
-			// front
-			-1.0f, -1.0f, +1.0f, // point blue
-			+1.0f, -1.0f, +1.0f, // point magenta
-			-1.0f, +1.0f, +1.0f, // point cyan
-			+1.0f, +1.0f, +1.0f, // point white
-			// back
-			+1.0f, -1.0f, -1.0f, // point red
-			-1.0f, -1.0f, -1.0f, // point black
-			+1.0f, +1.0f, -1.0f, // point yellow
-			-1.0f, +1.0f, -1.0f, // point green
-			// right
-			+1.0f, -1.0f, +1.0f, // point magenta
-			+1.0f, -1.0f, -1.0f, // point red
-			+1.0f, +1.0f, +1.0f, // point white
-			+1.0f, +1.0f, -1.0f, // point yellow
-			// left
-			-1.0f, -1.0f, -1.0f, // point black
-			-1.0f, -1.0f, +1.0f, // point blue
-			-1.0f, +1.0f, -1.0f, // point green
-			-1.0f, +1.0f, +1.0f, // point cyan
-			// top
-			-1.0f, +1.0f, +1.0f, // point cyan
-			+1.0f, +1.0f, +1.0f, // point white
-			-1.0f, +1.0f, -1.0f, // point green
-			+1.0f, +1.0f, -1.0f, // point yellow
-			// bottom
-			-1.0f, -1.0f, -1.0f, // point black
-			+1.0f, -1.0f, -1.0f, // point red
-			-1.0f, -1.0f, +1.0f, // point blue
-			+1.0f, -1.0f, +1.0f  // point magenta
-	};
+/* The cube, one quad per face, uploaded once by init_geometry() */
+static const GLfloat vVertices[] = {
+		// front
+		-1.0f, -1.0f, +1.0f, // point blue
+		+1.0f, -1.0f, +1.0f, // point magenta
+		-1.0f, +1.0f, +1.0f, // point cyan
+		+1.0f, +1.0f, +1.0f, // point white
+		// back
+		+1.0f, -1.0f, -1.0f, // point red
+		-1.0f, -1.0f, -1.0f, // point black
+		+1.0f, +1.0f, -1.0f, // point yellow
+		-1.0f, +1.0f, -1.0f, // point green
+		// right
+		+1.0f, -1.0f, +1.0f, // point magenta
+		+1.0f, -1.0f, -1.0f, // point red
+		+1.0f, +1.0f, +1.0f, // point white
+		+1.0f, +1.0f, -1.0f, // point yellow
+		// left
+		-1.0f, -1.0f, -1.0f, // point black
+		-1.0f, -1.0f, +1.0f, // point blue
+		-1.0f, +1.0f, -1.0f, // point green
+		-1.0f, +1.0f, +1.0f, // point cyan
+		// top
+		-1.0f, +1.0f, +1.0f, // point cyan
+		+1.0f, +1.0f, +1.0f, // point white
+		-1.0f, +1.0f, -1.0f, // point green
+		+1.0f, +1.0f, -1.0f, // point yellow
+		// bottom
+		-1.0f, -1.0f, -1.0f, // point black
+		+1.0f, -1.0f, -1.0f, // point red
+		-1.0f, -1.0f, +1.0f, // point blue
+		+1.0f, -1.0f, +1.0f  // point magenta
+};
 
-	static const GLfloat vColors[] = {
-			// front
-			0.0f,  0.0f,  1.0f, // blue
-			1.0f,  0.0f,  1.0f, // magenta
-			0.0f,  1.0f,  1.0f, // cyan
-			1.0f,  1.0f,  1.0f, // white
-			// back
-			1.0f,  0.0f,  0.0f, // red
-			0.0f,  0.0f,  0.0f, // black
-			1.0f,  1.0f,  0.0f, // yellow
-			0.0f,  1.0f,  0.0f, // green
-			// right
-			1.0f,  0.0f,  1.0f, // magenta
-			1.0f,  0.0f,  0.0f, // red
-			1.0f,  1.0f,  1.0f, // white
-			1.0f,  1.0f,  0.0f, // yellow
-			// left
-			0.0f,  0.0f,  0.0f, // black
-			0.0f,  0.0f,  1.0f, // blue
-			0.0f,  1.0f,  0.0f, // green
-			0.0f,  1.0f,  1.0f, // cyan
-			// top
-			0.0f,  1.0f,  1.0f, // cyan
-			1.0f,  1.0f,  1.0f, // white
-			0.0f,  1.0f,  0.0f, // green
-			1.0f,  1.0f,  0.0f, // yellow
-			// bottom
-			0.0f,  0.0f,  0.0f, // black
-			1.0f,  0.0f,  0.0f, // red
-			0.0f,  0.0f,  1.0f, // blue
-			1.0f,  0.0f,  1.0f  // magenta
-	};
+static const GLfloat vColors[] = {
+		// front
+		0.0f,  0.0f,  1.0f, // blue
+		1.0f,  0.0f,  1.0f, // magenta
+		0.0f,  1.0f,  1.0f, // cyan
+		1.0f,  1.0f,  1.0f, // white
+		// back
+		1.0f,  0.0f,  0.0f, // red
+		0.0f,  0.0f,  0.0f, // black
+		1.0f,  1.0f,  0.0f, // yellow
+		0.0f,  1.0f,  0.0f, // green
+		// right
+		1.0f,  0.0f,  1.0f, // magenta
+		1.0f,  0.0f,  0.0f, // red
+		1.0f,  1.0f,  1.0f, // white
+		1.0f,  1.0f,  0.0f, // yellow
+		// left
+		0.0f,  0.0f,  0.0f, // black
+		0.0f,  0.0f,  1.0f, // blue
+		0.0f,  1.0f,  0.0f, // green
+		0.0f,  1.0f,  1.0f, // cyan
+		// top
+		0.0f,  1.0f,  1.0f, // cyan
+		1.0f,  1.0f,  1.0f, // white
+		0.0f,  1.0f,  0.0f, // green
+		1.0f,  1.0f,  0.0f, // yellow
+		// bottom
+		0.0f,  0.0f,  0.0f, // black
+		1.0f,  0.0f,  0.0f, // red
+		0.0f,  0.0f,  1.0f, // blue
+		1.0f,  0.0f,  1.0f  // magenta
+};
 
-	static const GLfloat vNormals[] = {
-			// front
-			+0.0f, +0.0f, +1.0f, // forward
-			+0.0f, +0.0f, +1.0f, // forward
-			+0.0f, +0.0f, +1.0f, // forward
-			+0.0f, +0.0f, +1.0f, // forward
-			// back
-			+0.0f, +0.0f, -1.0f, // backbard
-			+0.0f, +0.0f, -1.0f, // backbard
-			+0.0f, +0.0f, -1.0f, // backbard
-			+0.0f, +0.0f, -1.0f, // backbard
-			// right
-			+1.0f, +0.0f, +0.0f, // right
-			+1.0f, +0.0f, +0.0f, // right
-			+1.0f, +0.0f, +0.0f, // right
-			+1.0f, +0.0f, +0.0f, // right
-			// left
-			-1.0f, +0.0f, +0.0f, // left
-			-1.0f, +0.0f, +0.0f, // left
-			-1.0f, +0.0f, +0.0f, // left
-			-1.0f, +0.0f, +0.0f, // left
-			// top
-			+0.0f, +1.0f, +0.0f, // up
-			+0.0f, +1.0f, +0.0f, // up
-			+0.0f, +1.0f, +0.0f, // up
-			+0.0f, +1.0f, +0.0f, // up
-			// bottom
-			+0.0f, -1.0f, +0.0f, // down
-			+0.0f, -1.0f, +0.0f, // down
-			+0.0f, -1.0f, +0.0f, // down
-			+0.0f, -1.0f, +0.0f  // down
-	};
+static const GLfloat vNormals[] = {
+		// front
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		+0.0f, +0.0f, +1.0f, // forward
+		// back
+		+0.0f, +0.0f, -1.0f, // backbard
+		+0.0f, +0.0f, -1.0f, // backbard
+		+0.0f, +0.0f, -1.0f, // backbard
+		+0.0f, +0.0f, -1.0f, // backbard
+		// right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		+1.0f, +0.0f, +0.0f, // right
+		// left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		-1.0f, +0.0f, +0.0f, // left
+		// top
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		+0.0f, +1.0f, +0.0f, // up
+		// bottom
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f, // down
+		+0.0f, -1.0f, +0.0f  // down
+};
 
-	static const GLfloat vTexUVs[] = {
-			// front
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-			// back
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-			// right
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-			// left
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-			// top
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-			// bottom
-			0.0f,  1.0f,
-			1.0f,  1.0f,
-			0.0f,  0.0f,
-			1.0f,  0.0f,
-	};
+static const GLfloat vTexUVs[] = {
+		// front
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+		// back
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+		// right
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+		// left
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+		// top
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+		// bottom
+		0.0f,  1.0f,
+		1.0f,  1.0f,
+		0.0f,  0.0f,
+		1.0f,  0.0f,
+};
 
-	/* clear the color buffer */
-	glClearColor(0.5, 0.5, 0.5, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT);
+/* two triangles per face, so adjacent faces can share one draw call */
+static const GLushort vIndices[] = {
+		 0,  1,  2,   2,  1,  3,
+		 4,  5,  6,   6,  5,  7,
+		 8,  9, 10,  10,  9, 11,
+		12, 13, 14,  14, 13, 15,
+		16, 17, 18,  18, 17, 19,
+		20, 21, 22,  22, 21, 23,
+};
 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, vVertices);
+static void init_geometry(struct display_kmscube *disp_kmsc)
+{
+	GLintptr normals = sizeof(vVertices);
+	GLintptr colors = normals + sizeof(vNormals);
+	GLintptr texuvs = colors + sizeof(vColors);
+	GLfloat aspect = (GLfloat)(disp_kmsc->drm.mode->hdisplay) / (GLfloat)(disp_kmsc->drm.mode->vdisplay);
+
+	glGenBuffers(1, &disp_kmsc->gl.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, disp_kmsc->gl.vbo);
+	glBufferData(GL_ARRAY_BUFFER, texuvs + sizeof(vTexUVs), NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vVertices), vVertices);
+	glBufferSubData(GL_ARRAY_BUFFER, normals, sizeof(vNormals), vNormals);
+	glBufferSubData(GL_ARRAY_BUFFER, colors, sizeof(vColors), vColors);
+	glBufferSubData(GL_ARRAY_BUFFER, texuvs, sizeof(vTexUVs), vTexUVs);
+
+	glGenBuffers(1, &disp_kmsc->gl.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, disp_kmsc->gl.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(vIndices), vIndices, GL_STATIC_DRAW);
+
+	/* the render thread's context draws nothing else, set it all once */
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
 	glEnableVertexAttribArray(0);
 
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, vNormals);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (const void *)normals);
 	glEnableVertexAttribArray(1);
 
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, vColors);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (const void *)colors);
 	glEnableVertexAttribArray(2);
 
-	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, vTexUVs);
+	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, (const void *)texuvs);
 	glEnableVertexAttribArray(3);
 
-	esMatrixLoadIdentity(&modelview);
-	esTranslate(&modelview, 0.0f, 0.0f, -disp_kmsc->gl.distance);
-	esRotate(&modelview, 45.0f + (0.25f * disp_kmsc->i), 1.0f, 0.0f, 0.0f);
-	esRotate(&modelview, 45.0f - (0.5f * disp_kmsc->i), 0.0f, 1.0f, 0.0f);
-	esRotate(&modelview, 10.0f + (0.15f * disp_kmsc->i), 0.0f, 0.0f, 1.0f);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(disp_kmsc->gl.uniform_texture, 0);
+	glEnable(GL_CULL_FACE);
+	glClearColor(0.5, 0.5, 0.5, 1.0);
 
-	GLfloat aspect = (GLfloat)(disp_kmsc->drm.mode->hdisplay) / (GLfloat)(disp_kmsc->drm.mode->vdisplay);
+	esMatrixLoadIdentity(&disp_kmsc->gl.projection);
+	esPerspective(&disp_kmsc->gl.projection, disp_kmsc->gl.fov, aspect, 1.0f, 10.0f);
+}
 
-	ESMatrix projection;
-	esMatrixLoadIdentity(&projection);
-	esPerspective(&projection, disp_kmsc->gl.fov, aspect, 1.0f, 10.0f);
+static void draw(struct display_kmscube *disp_kmsc)
+{
+	int face, first, tex_name[MAX_FACES];
+	ESMatrix modelview, modelviewprojection;
+	float normal[9];
 
-	ESMatrix modelviewprojection;
-	esMatrixLoadIdentity(&modelviewprojection);
-	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
+	/* clear the color buffer */
+	glClear(GL_COLOR_BUFFER_BIT);
 
-	float normal[9];
-	normal[0] = modelview.m[0][0];
-	normal[1] = modelview.m[0][1];
-	normal[2] = modelview.m[0][2];
-	normal[3] = modelview.m[1][0];
-	normal[4] = modelview.m[1][1];
-	normal[5] = modelview.m[1][2];
-	normal[6] = modelview.m[2][0];
-	normal[7] = modelview.m[2][1];
-	normal[8] = modelview.m[2][2];
+	esModelViewProjection(&modelview, &modelviewprojection, normal,
+			&disp_kmsc->gl.projection, 0.0f, 0.0f, -disp_kmsc->gl.distance,
+			45.0f + (0.25f * disp_kmsc->i),
+			45.0f - (0.5f * disp_kmsc->i),
+			10.0f + (0.15f * disp_kmsc->i));
 
 	glUniformMatrix4fv(disp_kmsc->gl.modelviewmatrix, 1, GL_FALSE, &modelview.m[0][0]);
 	glUniformMatrix4fv(disp_kmsc->gl.modelviewprojectionmatrix, 1, GL_FALSE, &modelviewprojection.m[0][0]);
 	glUniformMatrix3fv(disp_kmsc->gl.normalmatrix, 1, GL_FALSE, normal);
 
-	glEnable(GL_CULL_FACE);
+	for(face=0; face<MAX_FACES; face++)
+		tex_name[face] = get_texture(disp_kmsc, face);
 
-	for(face=0; face<MAX_FACES; face++) {
-		glActiveTexture(GL_TEXTURE0);
-		tex_name = get_texture(disp_kmsc, face);
-		glBindTexture(GL_TEXTURE_EXTERNAL_OES, tex_name);
+	/* one draw for each run of faces showing the same texture */
+	for (first = 0; first < MAX_FACES; first = face) {
+		for (face = first + 1; face < MAX_FACES; face++)
+			if (tex_name[face] != tex_name[first])
+				break;
+
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, tex_name[first]);
 		if (glGetError() != GL_NO_ERROR)
-			printf("glBindTexture failed render for face %d!\n", face);
-		glUniform1i(disp_kmsc->gl.uniform_texture, 0);
-		glDrawArrays(GL_TRIANGLE_STRIP, face * 4, 4);
+			printf("glBindTexture failed render for face %d!\n", first);
+		glDrawElements(GL_TRIANGLES, (face - first) * 6, GL_UNSIGNED_SHORT,
+				(const void *)(first * 6 * sizeof(GLushort)));
 	}
 }
 
@@ -727,6 +805,60 @@ static void page_flip_handler(int fd, unsigned int frame,
 	*waiting_for_flip = 0;
 }
 
+/* wake the render thread in --damage mode, cheap if it is already awake */
+static void
+damage_kick(struct display_kmscube *disp_kmsc)
+{
+	if (!disp_kmsc->damage.enabled ||
+			__atomic_exchange_n(&disp_kmsc->damage.dirty, true,
+				__ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&disp_kmsc->damage.lock);
+	pthread_cond_signal(&disp_kmsc->damage.cond);
+	pthread_mutex_unlock(&disp_kmsc->damage.lock);
+}
+
+/*
+ * Sleep until something changed or the next animation step is due, and
+ * count the refresh periods slept through as skipped frames.
+ */
+static void
+damage_wait(struct display_kmscube *disp_kmsc)
+{
+	uint64_t now, period_us, deadline = 0;
+	struct timespec ts;
+
+	if (disp_kmsc->damage.anim_ms)
+		deadline = disp_kmsc->damage.last_us +
+				disp_kmsc->damage.anim_ms * 1000ull;
+
+	pthread_mutex_lock(&disp_kmsc->damage.lock);
+	while (!__atomic_load_n(&disp_kmsc->damage.dirty, __ATOMIC_ACQUIRE)) {
+		if (!deadline) {
+			pthread_cond_wait(&disp_kmsc->damage.cond,
+					&disp_kmsc->damage.lock);
+			continue;
+		}
+		ts.tv_sec = deadline / 1000000;
+		ts.tv_nsec = (deadline % 1000000) * 1000;
+		if (pthread_cond_timedwait(&disp_kmsc->damage.cond,
+				&disp_kmsc->damage.lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	__atomic_store_n(&disp_kmsc->damage.dirty, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&disp_kmsc->damage.lock);
+
+	now = now_us();
+	period_us = 1000000 / (disp_kmsc->drm.mode->vrefresh ?
+			disp_kmsc->drm.mode->vrefresh : 60);
+	if (disp_kmsc->damage.last_us &&
+			now - disp_kmsc->damage.last_us > period_us)
+		disp_kmsc->damage.skipped +=
+				(now - disp_kmsc->damage.last_us) / period_us - 1;
+	disp_kmsc->damage.last_us = now;
+}
+
 static struct omap_bo *
 alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 		uint32_t *bo_handle, uint32_t *pitch)
@@ -807,11 +939,13 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 32, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
+		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
 		break;
 	case FOURCC('R','G','2','4'):
 		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 24, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
+		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
 		break;
 
 	case FOURCC('U','Y','V','Y'):
@@ -819,6 +953,7 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
+		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
 		break;
 	case FOURCC('N','V','1','2'):
                 if (disp->multiplanar) {
@@ -844,6 +979,7 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 8, buf->width, (buf->height + buf->height/2),
 				&bo_handles[0], &buf->pitches[0]);
+		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
 		break;
 	default:
 		ERROR("invalid format: 0x%08x", fourcc);
@@ -851,10 +987,17 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	}
 
 	buf_kmsc->face_no = disp_kmsc->num_faces;
+	list_init(&buf_kmsc->lru);
+	list_init(&buf_kmsc->queue);
+
 	/*
-	 * EGL image for this buffer would be created by the render thread
-	 * Nothing to be done here
+	 * The EGLImage needs no context, so import the dmabuf right here
+	 * rather than on the render thread the first time it is drawn.
 	 */
+	if (create_image(disp_kmsc, buf))
+		ERROR("EGLImage for face %d will be created on first use",
+				buf_kmsc->face_no);
+
 	return buf;
 
 fail:
@@ -892,6 +1035,16 @@ alloc_buffers(struct display *disp, uint32_t n,
 	disp_kmsc->num_faces++;
 	disp->buf = bufs;
 	pthread_mutex_unlock(&disp_kmsc->init_lock);
+
+	/* textures are bound by the render thread before its next frame */
+	pthread_mutex_lock(&disp_kmsc->tex.lock);
+	for (i = 0; i < n; i++) {
+		struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(bufs[i]);
+		list_append(&buf_kmsc->queue, &disp_kmsc->tex.fresh);
+	}
+	pthread_mutex_unlock(&disp_kmsc->tex.lock);
+	damage_kick(disp_kmsc);
+
 	return bufs;
 
 fail:
@@ -903,17 +1056,36 @@ fail:
 static void
 free_buffers(struct display *disp, uint32_t n)
 {
-        uint32_t i;
+	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
+	struct buffer_kmscube *buf_kmsc;
+	struct buffer *buf;
+	uint32_t i;
+	int face;
+
         for (i = 0; i < n; i++) {
-                if (disp->buf[i]) {
-                        close(disp->buf[i]->fd[0]);
-                        omap_bo_del(disp->buf[i]->bo[0]);
-                        if(disp->multiplanar){
-                                close(disp->buf[i]->fd[1]);
-                                omap_bo_del(disp->buf[i]->bo[1]);
-                        }
+		buf = disp->buf[i];
+                if (buf) {
+			/* don't let the render thread latch it anymore */
+			for (face = 0; face < MAX_FACES; face++) {
+				struct buffer *expected = buf;
+				__atomic_compare_exchange_n(&disp_kmsc->mailbox[face],
+						&expected, NULL, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+			}
+
+			/*
+			 * A face may still show it, and an evicted texture
+			 * would be made again from buf->fd: the render thread
+			 * closes the fds and bos once it has let go of it.
+			 */
+			buf_kmsc = to_buffer_kmscube(buf);
+			pthread_mutex_lock(&disp_kmsc->tex.lock);
+			list_del(&buf_kmsc->queue);
+			list_append(&buf_kmsc->queue, &disp_kmsc->tex.dead);
+			pthread_mutex_unlock(&disp_kmsc->tex.lock);
                 }
         }
+	damage_kick(disp_kmsc);
 	free(disp->buf);
 }
 
@@ -945,6 +1117,7 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 {
 	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
 	struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(buf);
+	struct buffer *old;
 	int face;
 
 	face = buf_kmsc->face_no;
@@ -952,14 +1125,89 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	 * No gl_ calls here, just update the buffer to be used for the
 	 * the specific face to which this buffer belongs
 	 */
+	old = __atomic_exchange_n(&disp_kmsc->mailbox[face], buf,
+			__ATOMIC_ACQ_REL);
+
+	/* posted but never drawn, the producer can have it back */
+	if (old && old != buf)
+		disp_buffer_released(disp, old);
 
-	pthread_mutex_lock(&disp_kmsc->lock[face]);
-	disp_kmsc->current_buffers[face] = buf;
-	pthread_mutex_unlock(&disp_kmsc->lock[face]);
+	damage_kick(disp_kmsc);
 
 	return 0;
 }
 
+/*
+ * Take the newest buffer of every face for the frame about to be drawn.
+ * The buffer it replaces was sampled by the previous frame, which has
+ * been flipped by the time we get here, so it goes back to its producer.
+ */
+static void
+latch_buffers(struct display_kmscube *disp_kmsc)
+{
+	struct buffer *buf, *prev;
+	int face;
+
+	for (face = 0; face < MAX_FACES; face++) {
+		buf = __atomic_exchange_n(&disp_kmsc->mailbox[face], NULL,
+				__ATOMIC_ACQ_REL);
+		if (!buf)
+			continue;
+
+		prev = disp_kmsc->current_buffers[face];
+		disp_kmsc->current_buffers[face] = buf;
+		if (prev && prev != buf)
+			disp_buffer_released(&disp_kmsc->base, prev);
+	}
+}
+
+static uint64_t
+thread_cpu_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * CPU side of a frame: latching, matrices and GL calls in draw(), and
+ * eglSwapBuffers().  The cpu figure is the render thread's share of one
+ * core over the period, flip waits excluded.
+ */
+static void
+bench_frame(struct display_kmscube *disp_kmsc, uint64_t t0, uint64_t t1,
+		uint64_t t2)
+{
+	struct render_bench *b = &disp_kmsc->bench;
+	uint64_t now, cpu;
+
+	if (!b->frames) {
+		b->start_us = t0;
+		b->cpu_start_us = thread_cpu_us();
+	}
+
+	b->draw_us += t1 - t0;
+	b->swap_us += t2 - t1;
+	if (t1 - t0 > b->draw_max)
+		b->draw_max = t1 - t0;
+
+	if (++b->frames < b->n)
+		return;
+
+	now = now_us();
+	cpu = thread_cpu_us() - b->cpu_start_us;
+	MSG("render: %u frames, %.1f fps, draw %.1f us (max %llu), swap %.1f us, cpu %.1f%%",
+			b->frames, b->frames * 1e6 / (now - b->start_us),
+			(double)b->draw_us / b->frames,
+			(unsigned long long)b->draw_max,
+			(double)b->swap_us / b->frames,
+			100.0 * cpu / (now - b->start_us));
+
+	b->frames = 0;
+	b->draw_us = b->draw_max = b->swap_us = 0;
+}
+
 static void *
 render_thread(void *data)
 {
@@ -972,9 +1220,10 @@ render_thread(void *data)
 	};
 	struct gbm_bo *bo;
 	struct drm_fb *fb;
-	int ret, face;
+	int ret;
 	struct gbm_bo *next_bo;
 	int waiting_for_flip = 1;
+	uint64_t t0 = 0, t1 = 0;
 
 	if (init_gbm(disp_kmsc)) {
 		ERROR("couldn't init gbm");
@@ -1004,9 +1253,14 @@ render_thread(void *data)
 
 	while(1) {
 
-		for(face = 0; face < MAX_FACES; face++) {
-			pthread_mutex_lock(&disp_kmsc->lock[face]);
-		}
+		if (disp_kmsc->damage.enabled)
+			damage_wait(disp_kmsc);
+
+		if (disp_kmsc->bench.n)
+			t0 = now_us();
+
+		tex_cache_update(disp_kmsc);
+		latch_buffers(disp_kmsc);
 
 		FD_ZERO(&fds);
 		FD_SET(disp_kmsc->base.fd, &fds);
@@ -1014,15 +1268,18 @@ render_thread(void *data)
 		// Draw cube.
 		draw(disp_kmsc);
 		(disp_kmsc->i)++;
+		disp_kmsc->damage.rendered++;
+
+		if (disp_kmsc->bench.n)
+			t1 = now_us();
 
 		eglSwapBuffers(disp_kmsc->gl.display, disp_kmsc->gl.surface);
+
+		if (disp_kmsc->bench.n)
+			bench_frame(disp_kmsc, t0, t1, now_us());
 		next_bo = gbm_surface_lock_front_buffer(disp_kmsc->gbm.surface);
 		fb = drm_fb_get_from_bo(disp_kmsc, next_bo);
 
-		for(face = 0; face < MAX_FACES; face++) {
-			pthread_mutex_unlock(&disp_kmsc->lock[face]);
-		}
-
 		/*
 		 * Here you could also update drm plane layers if you want
 		 * hw composition
@@ -1060,6 +1317,102 @@ render_thread(void *data)
 	return data;
 }
 
+static bool
+buffer_in_use(struct display_kmscube *disp_kmsc, struct buffer *buf)
+{
+	int face;
+
+	for (face = 0; face < MAX_FACES; face++)
+		if (disp_kmsc->current_buffers[face] == buf)
+			return true;
+	return false;
+}
+
+/* render thread only */
+static void
+release_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
+{
+	struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(buf);
+
+	if (buf_kmsc->texture_name) {
+		glDeleteTextures(1, &buf_kmsc->texture_name);
+		buf_kmsc->texture_name = 0;
+		list_del(&buf_kmsc->lru);
+		disp_kmsc->tex.count--;
+	}
+	if (buf_kmsc->egl_img != EGL_NO_IMAGE_KHR) {
+		disp_kmsc->gl.eglDestroyImageKHR(disp_kmsc->gl.display,
+				buf_kmsc->egl_img);
+		buf_kmsc->egl_img = EGL_NO_IMAGE_KHR;
+	}
+	if (buf_kmsc->gbm_bo) {
+		gbm_bo_destroy(buf_kmsc->gbm_bo);
+		buf_kmsc->gbm_bo = NULL;
+	}
+}
+
+/*
+ * Bring the cache in line with the buffer pools before drawing: bind
+ * textures for newly allocated buffers, destroy the freed ones and trim
+ * the least recently drawn textures down to tex.max.
+ */
+static void
+tex_cache_update(struct display_kmscube *disp_kmsc)
+{
+	struct buffer_kmscube *buf_kmsc, *tmp;
+	struct list fresh, dead, *pos;
+	int face, i;
+
+	pthread_mutex_lock(&disp_kmsc->tex.lock);
+	if (list_is_empty(&disp_kmsc->tex.fresh) &&
+			list_is_empty(&disp_kmsc->tex.dead)) {
+		pthread_mutex_unlock(&disp_kmsc->tex.lock);
+		return;
+	}
+	list_init(&fresh);
+	list_init(&dead);
+	list_for_each_entry_safe(buf_kmsc, tmp, &disp_kmsc->tex.fresh, queue) {
+		list_del(&buf_kmsc->queue);
+		list_append(&buf_kmsc->queue, &fresh);
+	}
+	list_for_each_entry_safe(buf_kmsc, tmp, &disp_kmsc->tex.dead, queue) {
+		list_del(&buf_kmsc->queue);
+		list_append(&buf_kmsc->queue, &dead);
+	}
+	pthread_mutex_unlock(&disp_kmsc->tex.lock);
+
+	list_for_each_entry_safe(buf_kmsc, tmp, &dead, queue) {
+		for (face = 0; face < MAX_FACES; face++)
+			if (disp_kmsc->current_buffers[face] == &buf_kmsc->base)
+				disp_kmsc->current_buffers[face] = NULL;
+		list_del(&buf_kmsc->queue);
+		release_texture(disp_kmsc, &buf_kmsc->base);
+		for (i = 0; i < buf_kmsc->base.nbo; i++) {
+			close(buf_kmsc->base.fd[i]);
+			omap_bo_del(buf_kmsc->base.bo[i]);
+		}
+		free(buf_kmsc);
+	}
+
+	list_for_each_entry_safe(buf_kmsc, tmp, &fresh, queue) {
+		list_del(&buf_kmsc->queue);
+		if (!buf_kmsc->texture_name)
+			create_texture(disp_kmsc, &buf_kmsc->base);
+	}
+
+	/* from the tail, skipping whatever is on a face right now */
+	pos = disp_kmsc->tex.lru.prev;
+	while (disp_kmsc->tex.count > disp_kmsc->tex.max &&
+			pos != &disp_kmsc->tex.lru) {
+		buf_kmsc = list_entry(pos, struct buffer_kmscube, lru);
+		pos = pos->prev;
+		if (buffer_in_use(disp_kmsc, &buf_kmsc->base))
+			continue;
+		release_texture(disp_kmsc, &buf_kmsc->base);
+		disp_kmsc->tex.evictions++;
+	}
+}
+
 static int
 get_texture(struct display_kmscube *disp_kmsc, int face)
 {
@@ -1078,22 +1431,28 @@ get_texture(struct display_kmscube *disp_kmsc, int face)
 
 	buf_kmsc = to_buffer_kmscube(buf);
 	if(buf_kmsc->texture_name == 0) {
+		/* evicted, or its image could not be created up front */
+		disp_kmsc->tex.misses++;
 		create_texture(disp_kmsc, buf);
+	} else {
+		disp_kmsc->tex.hits++;
+		list_del(&buf_kmsc->lru);
+		list_add(&buf_kmsc->lru, &disp_kmsc->tex.lru);
 	}
 
 	return buf_kmsc->texture_name;
 }
 
+/* Import the buffer as an EGLImage, no GL context needed */
 static int
-create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
+create_image(struct display_kmscube *disp_kmsc, struct buffer *buf)
 {
 
 	struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(buf);
-	// Create EGLImage and return.
 	// TODO: cropping attributes when this will be supported.
 	EGLint attr[20];
 	bool isRGB;
-	int dfd = omap_bo_dmabuf(buf->bo[0]);
+	int dfd = buf->fd[0];
 	struct gbm_import_fd_data gbm_dmabuf = {
 		.fd     = dfd,
 		.width  = buf->width,
@@ -1150,9 +1509,9 @@ create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
 		memcpy(attr, __attr, sizeof(__attr));
 		isRGB = false;
 	} else if(buf->fourcc == FOURCC('A','R','2','4')) {
-		disp_kmsc->gbm.bo  = gbm_bo_import(disp_kmsc->gbm.dev, GBM_BO_IMPORT_FD, &gbm_dmabuf,
+		buf_kmsc->gbm_bo = gbm_bo_import(disp_kmsc->gbm.dev, GBM_BO_IMPORT_FD, &gbm_dmabuf,
 				GBM_BO_USE_SCANOUT);
-		if(!disp_kmsc->gbm.bo){
+		if(!buf_kmsc->gbm_bo){
 			ERROR("gbm_bo_import failed\n");
 			return -1;
 		}
@@ -1169,13 +1528,27 @@ create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
 		EGLint attrib_list = EGL_NONE;
 		buf_kmsc->egl_img =
 			disp_kmsc->gl.eglCreateImageKHR(disp_kmsc->gl.display, EGL_NO_CONTEXT,
-					EGL_NATIVE_PIXMAP_KHR, disp_kmsc->gbm.bo, &attrib_list);
+					EGL_NATIVE_PIXMAP_KHR, buf_kmsc->gbm_bo, &attrib_list);
 	}
 	if (buf_kmsc->egl_img == EGL_NO_IMAGE_KHR) {
 		ERROR("eglCreateImageKHR failed!\n");
-		goto fail;
+		return -1;
 	}
 
+	return 0;
+}
+
+/* Bind the buffer's EGLImage to a new texture, render thread only */
+static int
+create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
+{
+
+	struct buffer_kmscube *buf_kmsc = to_buffer_kmscube(buf);
+
+	if (buf_kmsc->egl_img == EGL_NO_IMAGE_KHR &&
+			create_image(disp_kmsc, buf))
+		goto fail;
+
 	// Texture.
 	glGenTextures(1, &buf_kmsc->texture_name);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buf_kmsc->texture_name);
@@ -1195,15 +1568,29 @@ create_texture(struct display_kmscube *disp_kmsc, struct buffer *buf)
 		ERROR("glEGLImageTargetTexture2DOES!\n");
 		goto fail;
 	}
+
+	list_add(&buf_kmsc->lru, &disp_kmsc->tex.lru);
+	disp_kmsc->tex.count++;
 	return 0;
 
 fail:
+	if (buf_kmsc->texture_name) {
+		glDeleteTextures(1, &buf_kmsc->texture_name);
+		buf_kmsc->texture_name = 0;
+	}
 	return -1;
 }
 
 static void
 close_kmscube(struct display *disp)
 {
+	struct display_kmscube *disp_kmsc = to_display_kmscube(disp);
+
+	MSG("texture cache: %u hits, %u misses, %u evictions",
+			disp_kmsc->tex.hits, disp_kmsc->tex.misses,
+			disp_kmsc->tex.evictions);
+	MSG("rendered %lu frames, skipped %lu", disp_kmsc->damage.rendered,
+			disp_kmsc->damage.skipped);
 }
 
 void
@@ -1214,6 +1601,9 @@ disp_kmscube_usage(void)
 	MSG("\t--fov <float>\tset field of vision (default 45.0)");
 	MSG("\t--kmscube\tEnable display kmscube (default: disabled)");
 	MSG("\t--connector <connector_id>\tset the connector ID (default: LCD)");
+	MSG("\t--tex-cache <n>\tkeep at most n video textures (default 64)");
+	MSG("\t--damage <ms>\tredraw only on new buffers, animate every ms (0: never)");
+	MSG("\t--bench-frames <n>\tprint render thread cost every n frames");
 }
 
 struct display *
@@ -1223,6 +1613,9 @@ disp_kmscube_open(int argc, char **argv)
 	struct display *disp;
 	int ret, i, enabled = 0;
 	float fov = 45, distance = 8, connector_id = 4;
+	unsigned int tex_cache = 64, anim_ms = 0, bench_frames = 0;
+	bool damage = false;
+	pthread_condattr_t cattr;
 
 	/* note: set args to NULL after we've parsed them so other modules know
 	 * that it is already parsed (since the arg parsing is decentralized)
@@ -1249,6 +1642,25 @@ disp_kmscube_open(int argc, char **argv)
 				ERROR("invalid arg: %s", argv[i]);
 				goto fail;
 			}
+		} else if (!strcmp("--tex-cache", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &tex_cache) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+		} else if (!strcmp("--damage", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &anim_ms) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
+			damage = true;
+		} else if (!strcmp("--bench-frames", argv[i])) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%u", &bench_frames) != 1) {
+				ERROR("invalid arg: %s", argv[i]);
+				goto fail;
+			}
 		} else if (!strcmp("--kmscube", argv[i])) {
 			enabled = 1;
 		} else {
@@ -1272,11 +1684,24 @@ disp_kmscube_open(int argc, char **argv)
 	disp_kmsc->user_connector_id = connector_id;
 	disp = &disp_kmsc->base;
 
-	for (i=0; i<MAX_FACES; i++) {
-		pthread_mutex_init(&disp_kmsc->lock[i], NULL);
-	}
 	pthread_mutex_init(&disp_kmsc->init_lock, NULL);
 
+	pthread_mutex_init(&disp_kmsc->tex.lock, NULL);
+	list_init(&disp_kmsc->tex.fresh);
+	list_init(&disp_kmsc->tex.dead);
+	list_init(&disp_kmsc->tex.lru);
+	disp_kmsc->tex.max = tex_cache;
+
+	disp_kmsc->bench.n = bench_frames;
+
+	disp_kmsc->damage.enabled = damage;
+	disp_kmsc->damage.anim_ms = anim_ms;
+	pthread_mutex_init(&disp_kmsc->damage.lock, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&disp_kmsc->damage.cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
 	disp->fd = drmOpen("omapdrm", NULL);
 	if (disp->fd < 0) {
 		ERROR("could not open drm device: %s (%d)", strerror(errno), errno);
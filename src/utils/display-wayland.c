@@ -20,14 +20,19 @@
 #endif
 
 #include "util.h"
-#include <pthread.h>
+#include <poll.h>
 #include <xf86drmMode.h>
 #include <wayland-client.h>
 #include <wayland-drm-client-protocol.h>
 #include <viewporter-client-protocol.h>
+#include <linux-dmabuf-unstable-v1-client-protocol.h>
+#include <drm_fourcc.h>
 
 /* NOTE: healthy dose of recycling from libdrm modetest app.. */
 
+/* longest wait for a frame callback before committing anyway */
+#define FRAME_TIMEOUT_MS 100
+
 
 #define to_display_wl(x) container_of(x, struct display_wl, base)
 struct display_wl {
@@ -39,39 +44,84 @@ struct display_wl {
 	struct wl_surface *surface;
 	struct wl_shell *shell;
 	struct wl_drm *drm;
-	struct wl_callback *callback;
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+	uint32_t dmabuf_version;
+	uint32_t formats[32];		/* advertised by zwp_linux_dmabuf_v1 */
+	uint32_t nformats;
+	bool force_wl_drm;
+	struct wl_callback *callback;	/* frame callback of the last commit */
 	struct wp_viewport *viewport;
 	struct wp_viewporter *viewporter;
-	pthread_t threadID;
+	unsigned int releases;		/* bumped by every wl_buffer.release */
+	unsigned int posts, paced, held, late;
 };
 
 #define to_buffer_wl(x) container_of(x, struct buffer_wl, base)
 struct buffer_wl {
 	struct buffer base;
 
+	struct display_wl *disp_wl;
 	struct wl_buffer *wl_buf;
 	uint32_t name;
+	uint32_t offsets[4];
+	bool busy;		/* attached, no wl_buffer.release yet */
+	bool held;		/* put back by the producer while busy */
 };
 
 static int global_fd = 0;
 static uint32_t used_planes = 0;
 static int ndisplays = 0;
 
-int wayland_process_events(struct display_wl *disp_wl)
+/*
+ * Dispatch Wayland events, waiting at most timeout_ms for some to arrive.
+ * Everything runs on the default queue in the caller's thread: announce
+ * the read with prepare_read so events already queued get dispatched
+ * first, flush our requests, then poll the fd and read or cancel.
+ */
+static int
+wait_events(struct display_wl *disp_wl, int timeout_ms)
 {
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(disp_wl->display),
+		.events = POLLIN,
+	};
+	int ret;
+
+	while (wl_display_prepare_read(disp_wl->display) != 0)
+		wl_display_dispatch_pending(disp_wl->display);
+
+	/* a full socket buffer is fine, the rest goes out next time */
+	if (wl_display_flush(disp_wl->display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(disp_wl->display);
+		return -1;
+	}
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0) {
+		wl_display_cancel_read(disp_wl->display);
+		return ret;
+	}
 
-	wl_display_dispatch(disp_wl->display);
+	if (wl_display_read_events(disp_wl->display) < 0)
+		return -1;
 
-	return 0;
+	return wl_display_dispatch_pending(disp_wl->display) < 0 ? -1 : ret;
 }
-void* wayland_ev_task(void *arg)
+
+static int
+get_event_fd(struct display *disp)
 {
-	int ret;
-	while(1) {
-		ret = wayland_process_events((struct display_wl *)arg);
-	}
+	struct display_wl *disp_wl = to_display_wl(disp);
 
-	return NULL;
+	return wl_display_get_fd(disp_wl->display);
+}
+
+static int
+handle_events(struct display *disp)
+{
+	struct display_wl *disp_wl = to_display_wl(disp);
+
+	return wait_events(disp_wl, 0) < 0 ? -1 : 0;
 }
 
 static struct omap_bo *
@@ -95,6 +145,143 @@ alloc_bo(struct display *disp, uint32_t bpp, uint32_t width, uint32_t height,
 	return bo;
 }
 
+static bool
+dmabuf_has_format(struct display_wl *disp_wl, uint32_t fourcc)
+{
+	uint32_t i;
+
+	if (!disp_wl->dmabuf || disp_wl->dmabuf_version < 2 ||
+			disp_wl->force_wl_drm)
+		return false;
+
+	/* nothing advertised yet, let the compositor decide */
+	if (!disp_wl->nformats)
+		return true;
+
+	for (i = 0; i < disp_wl->nformats; i++)
+		if (disp_wl->formats[i] == fourcc)
+			return true;
+	return false;
+}
+
+/*
+ * Hand the buffer to the compositor as dmabuf fds with the real pitches
+ * and offsets of every plane, so it can import or scan it out directly.
+ * omapdrm dmabufs are linear in the CPU/GPU view, TILER ones included.
+ */
+static struct wl_buffer *
+create_dmabuf_buffer(struct display_wl *disp_wl, struct buffer *buf,
+		uint32_t nplanes)
+{
+	struct buffer_wl *buf_wl = to_buffer_wl(buf);
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wl_buffer *wl_buf;
+	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+	uint32_t i;
+
+	params = zwp_linux_dmabuf_v1_create_params(disp_wl->dmabuf);
+	for (i = 0; i < nplanes; i++) {
+		int fd = buf->fd[buf->nbo > 1 ? i : 0];
+
+		zwp_linux_buffer_params_v1_add(params, fd, i,
+				buf_wl->offsets[i], buf->pitches[i],
+				modifier >> 32, modifier & 0xffffffff);
+	}
+
+	wl_buf = zwp_linux_buffer_params_v1_create_immed(params,
+			buf->width, buf->height, buf->fourcc, 0);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	return wl_buf;
+}
+
+/*
+ * The compositor is done with the buffer: tell the producer, and if it
+ * already gave the buffer back, return it to the pool now.
+ */
+static void
+buffer_release(void *data, struct wl_buffer *wl_buf)
+{
+	struct buffer_wl *buf_wl = data;
+	struct display_wl *disp_wl = buf_wl->disp_wl;
+
+	buf_wl->busy = false;
+	disp_wl->releases++;
+	disp_buffer_released(&disp_wl->base, &buf_wl->base);
+
+	if (buf_wl->held) {
+		buf_wl->held = false;
+		disp_put_vid_buffer(&disp_wl->base, &buf_wl->base);
+	}
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release,
+};
+
+static bool
+hold_vid_buffer(struct display *disp, struct buffer *buf)
+{
+	struct display_wl *disp_wl = to_display_wl(disp);
+	struct buffer_wl *buf_wl = to_buffer_wl(buf);
+
+	if (!buf_wl->busy)
+		return false;
+
+	buf_wl->held = true;
+	disp_wl->held++;
+	return true;
+}
+
+/* wait up to a second for the compositor to release a buffer */
+static int
+wait_vid_buffer(struct display *disp)
+{
+	struct display_wl *disp_wl = to_display_wl(disp);
+	unsigned int releases = disp_wl->releases;
+	uint64_t deadline = now_us() + 1000000;
+	int64_t left;
+
+	while (disp_wl->releases == releases) {
+		left = (int64_t)(deadline - now_us());
+		if (left <= 0 || wait_events(disp_wl, left / 1000 + 1) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* legacy path: a global flink name, so only single-bo buffers */
+static struct wl_buffer *
+create_drm_buffer(struct display_wl *disp_wl, struct buffer *buf)
+{
+	struct buffer_wl *buf_wl = to_buffer_wl(buf);
+
+	if (buf->nbo > 1) {
+		ERROR("wl_drm can't share multi-bo buffers");
+		return NULL;
+	}
+
+	if (omap_bo_get_name(buf->bo[0], &buf_wl->name)) {
+		ERROR("could not get a flink name: %s", strerror(errno));
+		return NULL;
+	}
+
+	switch (buf->fourcc) {
+	case FOURCC('N','V','1','2'):
+		return wl_drm_create_planar_buffer(disp_wl->drm,
+			buf_wl->name, buf->width, buf->height,
+			WL_DRM_FORMAT_NV12,
+			buf_wl->offsets[0], buf->pitches[0],
+			buf_wl->offsets[1], buf->pitches[1],
+			0, 0);
+	default:
+		/* the WL_DRM_FORMATs we use are the DRM fourccs */
+		return wl_drm_create_buffer(disp_wl->drm,
+			buf_wl->name, buf->width, buf->height,
+			buf->pitches[0], buf->fourcc);
+	}
+}
+
 static struct buffer *
 alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 {
@@ -102,7 +289,7 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	struct buffer_wl *buf_wl;
 	struct buffer *buf;
 	uint32_t bo_handles[4] = {0};
-	uint32_t wl_fmt = WL_DRM_FORMAT_NV12;
+	uint32_t i, nplanes = 1;
 
 	buf_wl = calloc(1, sizeof(*buf_wl));
 	if (!buf_wl) {
@@ -111,6 +298,9 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 	}
 	buf = &buf_wl->base;
 
+	if (!fourcc)
+		fourcc = FOURCC('A','R','2','4');
+
 	buf->fourcc = fourcc;
 	buf->width = w;
 	buf->height = h;
@@ -118,69 +308,59 @@ alloc_buffer(struct display *disp, uint32_t fourcc, uint32_t w, uint32_t h)
 
 	buf->nbo = 1;
 
-	if (!fourcc)
-		fourcc = FOURCC('A','R','2','4');
-
 	switch (fourcc) {
 	case FOURCC('A','R','2','4'):
-		wl_fmt = WL_DRM_FORMAT_ARGB8888;
-		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 32, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
-		omap_bo_get_name(buf->bo[0], &buf_wl->name);
-		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
-
-		/* ARGB: stride is four times width */
-		buf_wl->wl_buf = wl_drm_create_buffer(disp_wl->drm,
-			buf_wl->name, buf->width, buf->height,
-			buf->width * 4, wl_fmt);
 		break;
 	case FOURCC('U','Y','V','Y'):
-		wl_fmt = WL_DRM_FORMAT_UYVY;
-		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
-				&bo_handles[0], &buf->pitches[0]);
-
-		omap_bo_get_name(buf->bo[0], &buf_wl->name);
-		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
-		/* YUYV; stride is double width */
-		buf_wl->wl_buf = wl_drm_create_buffer(disp_wl->drm,
-			buf_wl->name, buf->width, buf->height,
-			buf->width * 2, wl_fmt);
-		break;
 	case FOURCC('Y','U','Y','V'):
-		wl_fmt = WL_DRM_FORMAT_YUYV;
-		buf->nbo = 1;
 		buf->bo[0] = alloc_bo(disp, 16, buf->width, buf->height,
 				&bo_handles[0], &buf->pitches[0]);
-
-		omap_bo_get_name(buf->bo[0], &buf_wl->name);
-		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
-		/* YUYV; stride is double width */
-		buf_wl->wl_buf = wl_drm_create_buffer(disp_wl->drm,
-			buf_wl->name, buf->width, buf->height,
-			buf->width * 2, wl_fmt);
 		break;
 	case FOURCC('N','V','1','2'):
-		wl_fmt = WL_DRM_FORMAT_NV12;
-		buf->nbo = 1;
-		buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height * 3 / 2,
-				&bo_handles[0], &buf->pitches[0]);
-
-		omap_bo_get_name(buf->bo[0], &buf_wl->name);
-		buf->fd[0] = omap_bo_dmabuf(buf->bo[0]);
-		/* NV12: Create a planar buffer */
-		buf_wl->wl_buf = wl_drm_create_planar_buffer(disp_wl->drm,
-			buf_wl->name, buf->width, buf->height, wl_fmt,
-			0, buf->width,
-			buf->width * buf->height, buf->width,
-			0, 0);
+		nplanes = 2;
+		if (disp->multiplanar && dmabuf_has_format(disp_wl, fourcc)) {
+			buf->nbo = 2;
+			buf->multiplanar = true;
+			buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height,
+					&bo_handles[0], &buf->pitches[0]);
+			buf->bo[1] = alloc_bo(disp, 16, buf->width/2, buf->height/2,
+					&bo_handles[1], &buf->pitches[1]);
+		} else {
+			buf->bo[0] = alloc_bo(disp, 8, buf->width, buf->height * 3 / 2,
+					&bo_handles[0], &buf->pitches[0]);
+			buf->pitches[1] = buf->pitches[0];
+			buf_wl->offsets[1] = buf->pitches[0] * buf->height;
+		}
 		break;
 	default:
 		ERROR("invalid format: 0x%08x", fourcc);
 		goto fail;
 	}
 
+	for (i = 0; i < buf->nbo; i++) {
+		if (!buf->bo[i]) {
+			ERROR("allocation failed");
+			goto fail;
+		}
+		buf->fd[i] = omap_bo_dmabuf(buf->bo[i]);
+	}
+
+	if (dmabuf_has_format(disp_wl, fourcc))
+		buf_wl->wl_buf = create_dmabuf_buffer(disp_wl, buf, nplanes);
+	else if (disp_wl->drm)
+		buf_wl->wl_buf = create_drm_buffer(disp_wl, buf);
+
+	if (!buf_wl->wl_buf) {
+		ERROR("could not share %4.4s buffer with the compositor",
+				(char *)&fourcc);
+		goto fail;
+	}
+
+	buf_wl->disp_wl = disp_wl;
+	wl_buffer_add_listener(buf_wl->wl_buf, &buffer_listener, buf_wl);
+
 	return buf;
 
 fail:
@@ -191,16 +371,21 @@ fail:
 static void
 free_buffers(struct display *disp, uint32_t n)
 {
-	uint32_t i;
+	uint32_t i, j;
 	for (i = 0; i < n; i++) {
-		if (disp->buf[i]) {
-			close(disp->buf[i]->fd[0]);
-			omap_bo_del(disp->buf[i]->bo[0]);
-			if (disp->multiplanar) {
-				close(disp->buf[i]->fd[1]);
-				omap_bo_del(disp->buf[i]->bo[1]);
-			}
+		struct buffer *buf = disp->buf[i];
+		struct buffer_wl *buf_wl;
+
+		if (!buf)
+			continue;
+		buf_wl = to_buffer_wl(buf);
+		/* no more release events for it once destroyed */
+		wl_buffer_destroy(buf_wl->wl_buf);
+		for (j = 0; j < buf->nbo; j++) {
+			close(buf->fd[j]);
+			omap_bo_del(buf->bo[j]);
 		}
+		free(buf_wl);
 	}
 	free(disp->buf);
 }
@@ -251,6 +436,7 @@ post_buffer(struct display *disp, struct buffer *buf)
 {
 	return -1;
 }
+/* the last commit made it to the screen, the next one may go */
 static void redraw(void *data, struct wl_callback *callback, uint32_t time) {
        struct display_wl *disp_wl = (struct display_wl *) data;
 
@@ -258,6 +444,28 @@ static void redraw(void *data, struct wl_callback *callback, uint32_t time) {
        disp_wl->callback = NULL;
 }
 
+/*
+ * One commit per compositor frame: wait for the previous commit's frame
+ * callback.  A hidden surface gets no callbacks, so don't wait forever.
+ */
+static void
+wait_frame(struct display_wl *disp_wl)
+{
+	uint64_t deadline = now_us() + FRAME_TIMEOUT_MS * 1000;
+	int64_t left;
+
+	if (disp_wl->callback)
+		disp_wl->paced++;
+
+	while (disp_wl->callback) {
+		left = (int64_t)(deadline - now_us());
+		if (left <= 0 || wait_events(disp_wl, left / 1000 + 1) < 0) {
+			disp_wl->late++;
+			break;
+		}
+	}
+}
+
 static const struct wl_callback_listener frame_listener = { redraw };
 
 static int
@@ -268,7 +476,11 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	struct buffer_wl *buf_wl = to_buffer_wl(buf);
 	int ret = 0;
 
+	wait_frame(disp_wl);
+
 	wl_surface_attach(disp_wl->surface, buf_wl->wl_buf, 0, 0);
+	buf_wl->busy = true;
+	disp_wl->posts++;
 	wl_surface_damage(disp_wl->surface,
 			0, 0, disp->width, disp->height);
 	wp_viewport_set_source(disp_wl->viewport,
@@ -282,7 +494,16 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	wl_callback_add_listener(disp_wl->callback, &frame_listener, disp_wl);
 
 	wl_surface_commit(disp_wl->surface);
-	wl_display_flush(disp_wl->display);
+
+	/*
+	 * Flushes the commit and handles whatever came in meanwhile, so the
+	 * compositor's pings get answered even if the caller never polls
+	 * disp_get_event_fd().
+	 */
+	if (wait_events(disp_wl, 0) < 0) {
+		ERROR("lost the wayland connection: %s", strerror(errno));
+		ret = -1;
+	}
 
 	return ret;
 }
@@ -291,7 +512,13 @@ static void
 close_kms(struct display *disp)
 {
 	struct display_wl *disp_wl = to_display_wl(disp);
-	pthread_cancel(disp_wl->threadID);
+
+	MSG("wayland: %u posts, %u paced by frame callbacks (%u timed out), "
+			"%u buffers held until released", disp_wl->posts,
+			disp_wl->paced, disp_wl->late, disp_wl->held);
+
+	wl_display_flush(disp_wl->display);
+	wl_display_disconnect(disp_wl->display);
 
 	omap_device_del(disp->dev);
 	disp->dev = NULL;
@@ -308,8 +535,40 @@ disp_wayland_usage(void)
 {
 	MSG("WAYLAND Display Options:");
 	MSG("\t-w <width>x<height>\tset the dimensions of client window");
+	MSG("\t--wl-drm\tshare buffers through wl_drm even if linux-dmabuf is there");
+	MSG("\t--wl-multiplanar\tallocate NV12 as separate Y and UV buffers (linux-dmabuf)");
 }
 
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format)
+{
+	struct display_wl *disp_wl = data;
+	uint32_t i;
+
+	for (i = 0; i < disp_wl->nformats; i++)
+		if (disp_wl->formats[i] == format)
+			return;
+	if (disp_wl->nformats < sizeof(disp_wl->formats) / sizeof(disp_wl->formats[0]))
+		disp_wl->formats[disp_wl->nformats++] = format;
+}
+
+static void
+dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	uint64_t modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+
+	/* our buffers are linear, or implicit for older compositors */
+	if (modifier == DRM_FORMAT_MOD_LINEAR ||
+			modifier == DRM_FORMAT_MOD_INVALID)
+		dmabuf_format(data, dmabuf, format);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format,
+	dmabuf_modifier,
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 	const char *interface, uint32_t version)
@@ -325,6 +584,13 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 	} else if (strcmp(interface, "wl_drm") == 0) {
 		disp_wl->drm = wl_registry_bind(registry, id,
 			&wl_drm_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 && version >= 2) {
+		/* create_immed needs v2, v3 announces modifiers instead */
+		disp_wl->dmabuf_version = version < 3 ? version : 3;
+		disp_wl->dmabuf = wl_registry_bind(registry, id,
+			&zwp_linux_dmabuf_v1_interface, disp_wl->dmabuf_version);
+		zwp_linux_dmabuf_v1_add_listener(disp_wl->dmabuf,
+			&dmabuf_listener, disp_wl);
 	} else if (strcmp(interface, "wp_viewporter") == 0) {
 		disp_wl->viewporter = wl_registry_bind(registry, id,
 			&wp_viewporter_interface, 1);
@@ -348,11 +614,11 @@ disp_wayland_open(int argc, char **argv)
 	struct display_wl *disp_wl = NULL;
 	struct display *disp;
 	int i, enabled = 0, width, height;
+	bool force_wl_drm = false, multiplanar = false;
 
 	struct wl_registry *registry;
 	struct wl_shell_surface *shell_surface;
 	struct wl_region *region;
-	int ret;
 
 	/* note: set args to NULL after we've parsed them so other modules know
 	 * that it is already parsed (since the arg parsing is decentralized)
@@ -368,6 +634,10 @@ disp_wayland_open(int argc, char **argv)
 				goto fail;
 			}
 			enabled = 1;
+		} else if (!strcmp("--wl-drm", argv[i])) {
+			force_wl_drm = true;
+		} else if (!strcmp("--wl-multiplanar", argv[i])) {
+			multiplanar = true;
 		} else {
 			/* ignore */
 			continue;
@@ -409,12 +679,17 @@ disp_wayland_open(int argc, char **argv)
 	disp->post_vid_buffer = post_vid_buffer;
 	disp->close = close_kms;
 	disp->disp_free_buf = free_buffers;
+	disp->get_event_fd = get_event_fd;
+	disp->handle_events = handle_events;
+	disp->hold_vid_buffer = hold_vid_buffer;
+	disp->wait_vid_buffer = wait_vid_buffer;
 
-	disp->multiplanar = false;
+	disp->multiplanar = multiplanar;
 	disp->width = width;
 	disp->height = height;
 
 	disp_wl->bo_flags = OMAP_BO_SCANOUT|OMAP_BO_WC;
+	disp_wl->force_wl_drm = force_wl_drm;
 
 	disp_wl->display = wl_display_connect(NULL);
 	if (disp_wl->display == NULL) {
@@ -428,8 +703,22 @@ disp_wayland_open(int argc, char **argv)
 	registry = wl_display_get_registry(disp_wl->display);
 	wl_registry_add_listener(registry, &registry_listener, disp_wl);
 	wl_display_roundtrip(disp_wl->display);
+	/* and once more for the linux-dmabuf format events */
+	wl_display_roundtrip(disp_wl->display);
 	MSG("wayland registries obtained\n");
 
+	if ((!disp_wl->dmabuf || disp_wl->force_wl_drm) && !disp_wl->drm) {
+		ERROR("compositor has neither linux-dmabuf v2 nor wl_drm");
+		goto fail;
+	}
+	if (disp->multiplanar && !dmabuf_has_format(disp_wl,
+				FOURCC('N','V','1','2'))) {
+		MSG("no NV12 over linux-dmabuf, using single buffer NV12");
+		disp->multiplanar = false;
+	}
+	MSG("sharing buffers through %s", disp_wl->dmabuf &&
+			!disp_wl->force_wl_drm ? "linux-dmabuf" : "wl_drm");
+
 	disp_wl->surface = wl_compositor_create_surface(disp_wl->compositor);
 	shell_surface = wl_shell_get_shell_surface(disp_wl->shell,
 						disp_wl->surface);
@@ -442,10 +731,13 @@ disp_wayland_open(int argc, char **argv)
 						disp_wl->surface);
 	wp_viewport_set_destination(disp_wl->viewport, width, height);
 
-	ret = pthread_create(&disp_wl->threadID, NULL, wayland_ev_task, disp_wl);
-	if(ret) {
-		MSG("could not create task for wayland event processing");
-        }
+	/* no event thread: events are read in post_vid_buffer() or when the
+	 * caller's loop sees disp_get_event_fd() readable
+	 */
+	if (wl_display_roundtrip(disp_wl->display) < 0) {
+		ERROR("wayland roundtrip failed: %s", strerror(errno));
+		goto fail;
+	}
 
 	return disp;
 
@@ -38,6 +38,8 @@ struct display_x11 {
 	struct display base;
 	Display *dpy;
 	Window win;
+	/* last posted, released when the next one replaces it */
+	struct buffer *shown;
 };
 
 #define to_buffer_x11(x) container_of(x, struct buffer_x11, base)
@@ -148,6 +150,11 @@ post_vid_buffer(struct display *disp, struct buffer *buf,
 	DBG("DRI2SwapBuffersVid[%u]: count=%llu",
 			buf_x11->dri2buf->attachment, count);
 
+	/* the server doesn't tell, assume the previous one is off screen */
+	if (disp_x11->shown && disp_x11->shown != buf)
+		disp_buffer_released(disp, disp_x11->shown);
+	disp_x11->shown = buf;
+
 	return 0;
 }
 
@@ -223,6 +223,48 @@ esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
 }
 
 
+void ESUTIL_API
+esModelViewProjection(ESMatrix *modelview, ESMatrix *mvp, GLfloat normal[9],
+                      const ESMatrix *projection, GLfloat tx, GLfloat ty, GLfloat tz,
+                      GLfloat ax, GLfloat ay, GLfloat az)
+{
+   GLfloat sx = sinf(ax * PI / 180.0f), cx = cosf(ax * PI / 180.0f);
+   GLfloat sy = sinf(ay * PI / 180.0f), cy = cosf(ay * PI / 180.0f);
+   GLfloat sz = sinf(az * PI / 180.0f), cz = cosf(az * PI / 180.0f);
+   GLfloat (*m)[4] = modelview->m;
+   const GLfloat (*p)[4] = projection->m;
+   int i, j;
+
+   // Rz * Ry * Rx, since esRotate() multiplies the rotation in from the left
+   m[0][0] = cz * cy;
+   m[0][1] = cz * sy * sx - sz * cx;
+   m[0][2] = cz * sy * cx + sz * sx;
+   m[1][0] = sz * cy;
+   m[1][1] = sz * sy * sx + cz * cx;
+   m[1][2] = sz * sy * cx - cz * sx;
+   m[2][0] = -sy;
+   m[2][1] = cy * sx;
+   m[2][2] = cy * cx;
+   m[0][3] = m[1][3] = m[2][3] = 0.0f;
+
+   m[3][0] = tx;
+   m[3][1] = ty;
+   m[3][2] = tz;
+   m[3][3] = 1.0f;
+
+   // the last column of the modelview is (0, 0, 0, 1)
+   for (i = 0; i < 3; i++)
+      for (j = 0; j < 4; j++)
+         mvp->m[i][j] = m[i][0] * p[0][j] + m[i][1] * p[1][j] + m[i][2] * p[2][j];
+   for (j = 0; j < 4; j++)
+      mvp->m[3][j] = tx * p[0][j] + ty * p[1][j] + tz * p[2][j] + p[3][j];
+
+   if (normal)
+      for (i = 0; i < 3; i++)
+         for (j = 0; j < 3; j++)
+            normal[i * 3 + j] = m[i][j];
+}
+
 void ESUTIL_API
 esMatrixLoadIdentity(ESMatrix *result)
 {
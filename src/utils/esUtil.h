@@ -290,6 +290,19 @@ void ESUTIL_API esOrtho(ESMatrix *result, float left, float right, float bottom,
 //
 void ESUTIL_API esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
 
+//
+/// \brief build a modelview, its modelview-projection and normal matrix in one pass
+/// \param modelview Returns identity translated by tx, ty, tz then rotated by ax, ay
+///        and az degrees about the x, y and z axes, as esTranslate() followed by
+///        three esRotate() calls would
+/// \param mvp Returns modelview * projection
+/// \param normal Returns the upper 3x3 of modelview, may be NULL
+/// \param projection Projection matrix, usually computed once
+//
+void ESUTIL_API esModelViewProjection(ESMatrix *modelview, ESMatrix *mvp, GLfloat normal[9],
+                                      const ESMatrix *projection, GLfloat tx, GLfloat ty, GLfloat tz,
+                                      GLfloat ax, GLfloat ay, GLfloat az);
+
 //
 //// \brief return an indentity matrix 
 //// \param result returns identity matrix
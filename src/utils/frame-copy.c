@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2020 DeVdistress
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Frame copy into display buffers.
+ *
+ * For when a frame has to go through the CPU (capture without dmabuf):
+ * the source is a packed V4L2 single-planar frame with a line pitch, the
+ * destination one of our display buffers, with its own pitches and one,
+ * two or three bos.  Every plane is copied line by line with 64 byte
+ * bursts into the write-combined mapping; frames above SPLIT_BYTES are
+ * cut into horizontal bands, one per core, each band covering the same
+ * rows of every plane.
+ *
+ * ARMv7 NEON has no non-temporal store hint.  The WC mapping already
+ * keeps the destination out of the cache, what matters there is that
+ * the write buffer drains in whole bursts; the source is prefetched a
+ * few lines ahead.  On SSE2 builds (DEBUG_ON_PC_SIDE) movntdq is used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+#include <pthread.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MAX_COPY_THREADS 4
+#define SPLIT_BYTES (1024 * 1024)
+#define PREFETCH_AHEAD 256
+
+struct copy_plane {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch, src_pitch, len, rows;
+};
+
+struct copy_job {
+	struct copy_plane plane[3];
+	int nplanes;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	pthread_t thread[MAX_COPY_THREADS];
+	int nthreads;		/* bands per frame, the caller does band 0 */
+	int running;		/* workers started */
+	int pending;		/* bands not finished yet */
+	unsigned int gen;	/* bumped for every new job */
+	const struct copy_job *job;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+void
+frame_copy_row(uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	while (len >= 64) {
+		uint8x16_t q0, q1, q2, q3;
+
+		__builtin_prefetch(src + PREFETCH_AHEAD);
+		q0 = vld1q_u8(src);
+		q1 = vld1q_u8(src + 16);
+		q2 = vld1q_u8(src + 32);
+		q3 = vld1q_u8(src + 48);
+		vst1q_u8(dst, q0);
+		vst1q_u8(dst + 16, q1);
+		vst1q_u8(dst + 32, q2);
+		vst1q_u8(dst + 48, q3);
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+#elif defined(__SSE2__)
+	while (len && ((uintptr_t)dst & 15)) {
+		*dst++ = *src++;
+		len--;
+	}
+	while (len >= 64) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, x0);
+		_mm_stream_si128((__m128i *)(dst + 16), x1);
+		_mm_stream_si128((__m128i *)(dst + 32), x2);
+		_mm_stream_si128((__m128i *)(dst + 48), x3);
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+void
+frame_copy_fence(void)
+{
+#if !(defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__SSE2__)
+	_mm_sfence();
+#endif
+}
+
+/* band b of n: the same share of rows of every plane */
+static void
+copy_band(const struct copy_job *job, int b, int n)
+{
+	int p;
+
+	for (p = 0; p < job->nplanes; p++) {
+		const struct copy_plane *pl = &job->plane[p];
+		uint32_t y = pl->rows * b / n, end = pl->rows * (b + 1) / n;
+		uint8_t *dst = pl->dst + y * pl->dst_pitch;
+		const uint8_t *src = pl->src + y * pl->src_pitch;
+
+		for (; y < end; y++) {
+			frame_copy_row(dst, src, pl->len);
+			dst += pl->dst_pitch;
+			src += pl->src_pitch;
+		}
+	}
+	frame_copy_fence();
+}
+
+static void *
+copy_worker(void *arg)
+{
+	int band = (int)(intptr_t)arg;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.gen == gen)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		gen = pool.gen;
+		if (band >= pool.nthreads)
+			continue;
+
+		pthread_mutex_unlock(&pool.lock);
+		copy_band(pool.job, band, pool.nthreads);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+
+	return NULL;
+}
+
+void
+frame_copy_threads(int n)
+{
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > MAX_COPY_THREADS)
+		n = MAX_COPY_THREADS;
+	if (n < 1)
+		n = 1;
+
+	pthread_mutex_lock(&pool.lock);
+	for (; pool.running < n - 1; pool.running++) {
+		if (pthread_create(&pool.thread[pool.running], NULL, copy_worker,
+				(void *)(intptr_t)(pool.running + 1))) {
+			ERROR("could not start copy thread");
+			break;
+		}
+		pthread_detach(pool.thread[pool.running]);
+	}
+	pool.nthreads = pool.running + 1;
+	if (pool.nthreads > n)
+		pool.nthreads = n;
+	pthread_mutex_unlock(&pool.lock);
+
+	DBG("frame copy: %d thread(s)", pool.nthreads);
+}
+
+static void
+run_job(const struct copy_job *job, uint32_t bytes)
+{
+	if (!pool.nthreads)
+		frame_copy_threads(0);
+
+	if (pool.nthreads == 1 || bytes < SPLIT_BYTES) {
+		copy_band(job, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.pending = pool.nthreads - 1;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	copy_band(job, 0, pool.nthreads);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Planes of the V4L2 source and of the display buffer, in the same order.
+ * Single-bo NV12/I420 display buffers keep chroma at pitches[0] * height,
+ * as set up by alloc_buffer() in display-kms.c.
+ */
+static int
+setup_job(struct copy_job *job, struct buffer *buf, const void *src,
+		uint32_t src_pitch, uint32_t *bytes)
+{
+	uint32_t w = buf->width, h = buf->height;
+	const uint8_t *s = src;
+	uint8_t *y = omap_bo_map(buf->bo[0]);
+	int p;
+
+	if (!y)
+		return -1;
+
+	switch (buf->fourcc) {
+	case FOURCC('Y','U','Y','V'):
+	case FOURCC('U','Y','V','Y'):
+		job->nplanes = 1;
+		job->plane[0] = (struct copy_plane){ y, s,
+				buf->pitches[0], src_pitch, w * 2, h };
+		break;
+	case FOURCC('N','V','1','2'):
+		job->nplanes = 2;
+		job->plane[0] = (struct copy_plane){ y, s,
+				buf->pitches[0], src_pitch, w, h };
+		job->plane[1] = (struct copy_plane){
+				buf->nbo > 1 ? omap_bo_map(buf->bo[1]) :
+						y + buf->pitches[0] * h,
+				s + src_pitch * h,
+				buf->nbo > 1 ? buf->pitches[1] : buf->pitches[0],
+				src_pitch, w, h / 2 };
+		break;
+	case FOURCC('I','4','2','0'):
+		job->nplanes = 3;
+		job->plane[0] = (struct copy_plane){ y, s,
+				buf->pitches[0], src_pitch, w, h };
+		s += src_pitch * h;
+		if (buf->nbo == 3) {
+			job->plane[1] = (struct copy_plane){ omap_bo_map(buf->bo[1]),
+					s, buf->pitches[1], src_pitch / 2, w / 2, h / 2 };
+			job->plane[2] = (struct copy_plane){ omap_bo_map(buf->bo[2]),
+					s + (src_pitch / 2) * (h / 2),
+					buf->pitches[2], src_pitch / 2, w / 2, h / 2 };
+		} else {
+			uint8_t *u = y + buf->pitches[0] * h;
+
+			job->plane[1] = (struct copy_plane){ u, s,
+					buf->pitches[0] / 2, src_pitch / 2, w / 2, h / 2 };
+			job->plane[2] = (struct copy_plane){
+					u + (buf->pitches[0] / 2) * (h / 2),
+					s + (src_pitch / 2) * (h / 2),
+					buf->pitches[0] / 2, src_pitch / 2, w / 2, h / 2 };
+		}
+		break;
+	default:
+		ERROR("unsupported format: 0x%08x", buf->fourcc);
+		return -1;
+	}
+
+	*bytes = 0;
+	for (p = 0; p < job->nplanes; p++) {
+		if (!job->plane[p].dst)
+			return -1;
+		*bytes += job->plane[p].len * job->plane[p].rows;
+	}
+
+	return 0;
+}
+
+int
+frame_copy(struct buffer *buf, const void *src, uint32_t src_pitch)
+{
+	struct copy_job job;
+	uint32_t bytes;
+	int i;
+
+	if (setup_job(&job, buf, src, src_pitch, &bytes))
+		return -1;
+
+	/* Call this before you start accessing display buffers */
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+
+	run_job(&job, bytes);
+
+	/* Call this after you are done with accessing display buffers */
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+
+	return 0;
+}
+
+/* the loop v4l2capturedisplay used before: libc memcpy() per line */
+static void
+copy_memcpy(const struct copy_job *job)
+{
+	int p;
+	uint32_t y;
+
+	for (p = 0; p < job->nplanes; p++) {
+		const struct copy_plane *pl = &job->plane[p];
+
+		for (y = 0; y < pl->rows; y++)
+			memcpy(pl->dst + y * pl->dst_pitch,
+					pl->src + y * pl->src_pitch, pl->len);
+	}
+}
+
+static int
+check_job(const struct copy_job *job)
+{
+	int p;
+	uint32_t y;
+
+	for (p = 0; p < job->nplanes; p++) {
+		const struct copy_plane *pl = &job->plane[p];
+
+		for (y = 0; y < pl->rows; y++)
+			if (memcmp(pl->dst + y * pl->dst_pitch,
+					pl->src + y * pl->src_pitch, pl->len))
+				return -1;
+	}
+	return 0;
+}
+
+int
+frame_copy_bench(struct buffer *buf, uint32_t src_pitch, int reps)
+{
+	static const char *names[] = { "memcpy rows", "burst, 1 thread",
+			"burst, threaded" };
+	struct copy_job job;
+	struct buffer narrow = *buf;
+	uint32_t bytes, size = src_pitch * buf->height * 2;
+	uint8_t *src;
+	int threads, m, r, i;
+
+	if (reps <= 0)
+		reps = 100;
+
+	/*
+	 * Copy a frame narrower than the buffer, so the destination pitch
+	 * is padded as with TILER, and a plane placed by width instead of
+	 * by pitch overlaps the luma and fails the check.
+	 */
+	if (narrow.width > 64)
+		narrow.width -= 64;
+	buf = &narrow;
+
+	src = malloc(size);
+	if (!src)
+		return -1;
+	for (i = 0; i < (int)size; i++)
+		src[i] = i * 7 + (i >> 12);
+
+	if (setup_job(&job, buf, src, src_pitch, &bytes)) {
+		free(src);
+		return -1;
+	}
+
+	if (!pool.nthreads)
+		frame_copy_threads(0);
+	threads = pool.nthreads;
+
+	MSG("frame copy benchmark, %ux%u %.4s, %u bytes/frame, %d frames:",
+			buf->width, buf->height, (char *)&buf->fourcc, bytes, reps);
+	MSG("  method             ms/frame      MB/s");
+
+	for (m = 0; m < 3; m++) {
+		uint64_t t0;
+		double us;
+
+		if (m == 2 && threads == 1)
+			break;
+		/* workers check their band against it under the lock */
+		pthread_mutex_lock(&pool.lock);
+		pool.nthreads = m == 2 ? threads : 1;
+		pthread_mutex_unlock(&pool.lock);
+
+		for (i = 0; i < buf->nbo; i++)
+			omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+		t0 = now_us();
+		for (r = 0; r < reps; r++) {
+			if (m == 0)
+				copy_memcpy(&job);
+			else
+				run_job(&job, bytes);
+		}
+		us = now_us() - t0;
+		for (i = 0; i < buf->nbo; i++)
+			omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+
+		MSG("  %-16s %10.3f %9.1f%s", names[m], us / reps / 1000,
+				us > 0 ? (double)bytes * reps / us : 0,
+				check_job(&job) ? "  MISMATCH" : "");
+		memset(job.plane[0].dst, 0, job.plane[0].dst_pitch);
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.nthreads = threads;
+	pthread_mutex_unlock(&pool.lock);
+
+	free(src);
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2020 DeVdistress
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Synthetic frame source.
+ *
+ * Produces moving diagonal tiles like fill(), but fast enough to stand in
+ * for a live capture device.  fill() colours a pixel from both the
+ * quotient and the remainder of (n + i + j) / width; here the quotient
+ * term is dropped, so the colour only depends on (n + i + j) % width and
+ * every row of every frame is a window into one precomputed line.  The
+ * frames match fill()'s while n + i + j < 64 * width, i.e. for roughly the
+ * first 64 * width frames; after that fill() shifts its palette and this
+ * pattern keeps cycling through the first one.  The lines are built once,
+ * with integer RGB->YUV, and a frame is then just a row copy per line plus
+ * the frame number stamp.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "util.h"
+
+/* frame number stamp: one block per bit, msb first, top-left corner.
+ * Narrow frames only carry the low bits of the frame number.
+ */
+#define STAMP_BITS	32
+#define STAMP_BLOCK	16
+#define STAMP_BLACK	16
+#define STAMP_WHITE	235
+
+struct pattern {
+	uint32_t fourcc, width, height;
+
+	/* precomputed lines, each at least 2 * width pixels long.  The
+	 * chroma lines exist twice, for an even and an odd start pixel,
+	 * so that the window always begins on a chroma sample.
+	 */
+	uint8_t *y;		/* NV12, I420 */
+	uint8_t *yuyv[2];	/* YUYV */
+	uint8_t *uv[2];		/* NV12 */
+	uint8_t *u[2], *v[2];	/* I420 */
+	uint8_t *mem;
+};
+
+static inline uint8_t
+clamp8(int x)
+{
+	return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+/* fill()'s colour for k = n + i + j and its (BT.601) coefficients, in
+ * 8.8 fixed point; the lines only use k < 2 * width + 2, where the
+ * quotient term is still 0
+ */
+static void
+pattern_color(uint32_t k, uint32_t width, uint8_t *y, uint8_t *u, uint8_t *v)
+{
+	uint32_t rgb = 0x00130502 * ((k / width) >> 6) +
+			0x000a1120 * ((k % width) >> 6);
+	int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+	int luma = (77 * r + 150 * g + 29 * b) >> 8;
+
+	*y = clamp8(luma);
+	*u = clamp8((((b - luma) * 145) >> 8) + 128);
+	*v = clamp8((((r - luma) * 183) >> 8) + 128);
+}
+
+struct pattern *
+pattern_new(uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	struct pattern *pat;
+	uint32_t len = 2 * width + 2, k, p;
+	uint8_t *y, *u, *v;
+
+	if (!width || !height || (width & 1) || (height & 1)) {
+		ERROR("invalid size: %ux%u", width, height);
+		return NULL;
+	}
+
+	pat = calloc(1, sizeof(*pat));
+	if (!pat) {
+		ERROR("allocation failed");
+		return NULL;
+	}
+	pat->fourcc = fourcc;
+	pat->width = width;
+	pat->height = height;
+
+	/* 3 scratch planes + the largest set of lines (YUYV: 2 x 2 bpp) */
+	pat->mem = malloc(3 * len + 4 * len);
+	if (!pat->mem) {
+		ERROR("allocation failed");
+		free(pat);
+		return NULL;
+	}
+	y = pat->mem;
+	u = y + len;
+	v = u + len;
+
+	for (k = 0; k < len; k++)
+		pattern_color(k, width, &y[k], &u[k], &v[k]);
+
+	switch (fourcc) {
+	case FOURCC('Y','U','Y','V'):
+		for (p = 0; p < 2; p++) {
+			uint8_t *line = v + len + p * 2 * len;
+			pat->yuyv[p] = line;
+			for (k = p; k + 1 < len; k += 2) {
+				*(line++) = y[k];
+				*(line++) = u[k];
+				*(line++) = y[k + 1];
+				*(line++) = v[k];
+			}
+		}
+		break;
+	case FOURCC('N','V','1','2'):
+		pat->y = y;
+		for (p = 0; p < 2; p++) {
+			uint8_t *line = v + len + p * len;
+			pat->uv[p] = line;
+			for (k = p; k + 1 < len; k += 2) {
+				*(line++) = u[k];
+				*(line++) = v[k];
+			}
+		}
+		break;
+	case FOURCC('I','4','2','0'):
+		pat->y = y;
+		for (p = 0; p < 2; p++) {
+			uint8_t *ul = v + len + p * len;
+			uint8_t *vl = ul + len / 2;
+			pat->u[p] = ul;
+			pat->v[p] = vl;
+			for (k = p; k + 1 < len; k += 2) {
+				*(ul++) = u[k];
+				*(vl++) = v[k];
+			}
+		}
+		break;
+	default:
+		ERROR("invalid format: 0x%08x", fourcc);
+		pattern_free(pat);
+		return NULL;
+	}
+
+	return pat;
+}
+
+void
+pattern_free(struct pattern *pat)
+{
+	if (!pat)
+		return;
+	free(pat->mem);
+	free(pat);
+}
+
+static void
+stamp_luma(uint8_t *row, uint32_t n, uint32_t bits, uint32_t step)
+{
+	uint32_t b;
+
+	for (b = 0; b < bits; b++) {
+		uint8_t val = (n & (1u << (bits - 1 - b))) ?
+				STAMP_WHITE : STAMP_BLACK;
+		if (step == 1) {
+			memset(row + b * STAMP_BLOCK, val, STAMP_BLOCK);
+		} else {
+			uint8_t *p = row + b * STAMP_BLOCK * step;
+			uint32_t i;
+			for (i = 0; i < STAMP_BLOCK; i++, p += step)
+				*p = val;
+		}
+	}
+}
+
+/* number of stamp bits that fit in a line of the given width */
+static inline uint32_t
+stamp_bits(uint32_t width)
+{
+	return MIN(STAMP_BITS, width / STAMP_BLOCK);
+}
+
+static void
+fill_yuyv(struct pattern *pat, uint8_t *dst, uint32_t stride, uint32_t n)
+{
+	uint32_t j, w = pat->width, bits = stamp_bits(w);
+
+	for (j = 0; j < pat->height; j++, dst += stride) {
+		uint32_t o = (n + j) % w;
+		frame_copy_row(dst, pat->yuyv[o & 1] + (o >> 1) * 4, w * 2);
+		if (j < STAMP_BLOCK) {
+			/* neutral chroma, then the bits on the luma samples */
+			memset(dst, 128, bits * STAMP_BLOCK * 2);
+			stamp_luma(dst, n, bits, 2);
+		}
+	}
+}
+
+static void
+fill_luma(struct pattern *pat, uint8_t *dst, uint32_t stride, uint32_t n)
+{
+	uint32_t j, w = pat->width, bits = stamp_bits(w);
+
+	for (j = 0; j < pat->height; j++, dst += stride) {
+		frame_copy_row(dst, pat->y + (n + j) % w, w);
+		if (j < STAMP_BLOCK)
+			stamp_luma(dst, n, bits, 1);
+	}
+}
+
+static void
+fill_nv12_chroma(struct pattern *pat, uint8_t *dst, uint32_t stride, uint32_t n)
+{
+	uint32_t c, w = pat->width, bits = stamp_bits(w);
+
+	for (c = 0; c < pat->height / 2; c++, dst += stride) {
+		uint32_t o = (n + 2 * c) % w;
+		frame_copy_row(dst, pat->uv[o & 1] + (o >> 1) * 2, w);
+		if (c < STAMP_BLOCK / 2)
+			memset(dst, 128, bits * STAMP_BLOCK);
+	}
+}
+
+static void
+fill_i420_chroma(struct pattern *pat, uint8_t *du, uint8_t *dv,
+		uint32_t stride, uint32_t n)
+{
+	uint32_t c, w = pat->width, bits = stamp_bits(w);
+
+	for (c = 0; c < pat->height / 2; c++, du += stride, dv += stride) {
+		uint32_t o = (n + 2 * c) % w;
+		frame_copy_row(du, pat->u[o & 1] + (o >> 1), w / 2);
+		frame_copy_row(dv, pat->v[o & 1] + (o >> 1), w / 2);
+		if (c < STAMP_BLOCK / 2) {
+			memset(du, 128, bits * STAMP_BLOCK / 2);
+			memset(dv, 128, bits * STAMP_BLOCK / 2);
+		}
+	}
+}
+
+int
+pattern_fill(struct pattern *pat, struct buffer *buf, uint32_t n)
+{
+	uint8_t *y, *u;
+	int i;
+
+	if (buf->fourcc != pat->fourcc ||
+			buf->width < pat->width || buf->height < pat->height) {
+		ERROR("buffer %ux%u/0x%08x does not match pattern %ux%u/0x%08x",
+				buf->width, buf->height, buf->fourcc,
+				pat->width, pat->height, pat->fourcc);
+		return -1;
+	}
+
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+
+	y = omap_bo_map(buf->bo[0]);
+
+	switch (pat->fourcc) {
+	case FOURCC('Y','U','Y','V'):
+		fill_yuyv(pat, y, buf->pitches[0], n);
+		break;
+	case FOURCC('N','V','1','2'):
+		fill_luma(pat, y, buf->pitches[0], n);
+		if (buf->nbo > 1) {
+			u = omap_bo_map(buf->bo[1]);
+			fill_nv12_chroma(pat, u, buf->pitches[1], n);
+		} else {
+			/* single plane: chroma follows the luma */
+			u = y + buf->pitches[0] * buf->height;
+			fill_nv12_chroma(pat, u, buf->pitches[0], n);
+		}
+		break;
+	case FOURCC('I','4','2','0'):
+		fill_luma(pat, y, buf->pitches[0], n);
+		if (buf->nbo == 3) {
+			fill_i420_chroma(pat, omap_bo_map(buf->bo[1]),
+					omap_bo_map(buf->bo[2]),
+					buf->pitches[1], n);
+		} else {
+			/* single plane: U and V follow the luma, half pitch */
+			u = y + buf->pitches[0] * buf->height;
+			fill_i420_chroma(pat, u,
+					u + (buf->pitches[0] / 2) * (buf->height / 2),
+					buf->pitches[0] / 2, n);
+		}
+		break;
+	}
+	frame_copy_fence();
+
+	for (i = 0; i < buf->nbo; i++)
+		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+
+	return 0;
+}
+
+uint32_t
+pattern_read_stamp(struct buffer *buf)
+{
+	uint32_t b, n = 0, step, bits = stamp_bits(buf->width);
+	uint8_t *row;
+
+	switch (buf->fourcc) {
+	case FOURCC('U','Y','V','Y'):
+	case FOURCC('Y','U','Y','V'):
+		step = 2;
+		break;
+	case FOURCC('N','V','1','2'):
+	case FOURCC('I','4','2','0'):
+		step = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	omap_bo_cpu_prep(buf->bo[0], OMAP_GEM_READ);
+	/* sample the middle of each block, away from scaler filter edges */
+	row = (uint8_t *)omap_bo_map(buf->bo[0]) +
+			(STAMP_BLOCK / 2) * buf->pitches[0];
+	if (buf->fourcc == FOURCC('U','Y','V','Y'))
+		row++;
+	for (b = 0; b < bits; b++) {
+		uint8_t val = row[(b * STAMP_BLOCK + STAMP_BLOCK / 2) * step];
+		n = (n << 1) | (val > 128);
+	}
+	omap_bo_cpu_fini(buf->bo[0], OMAP_GEM_READ);
+
+	return n;
+}
@@ -177,6 +177,12 @@ struct buffer *
 disp_get_vid_buffer(struct display *disp)
 {
 	struct buffer *buf = NULL;
+
+	/* everything may still be with the compositor */
+	while (list_is_empty(&disp->unlocked) && disp->wait_vid_buffer)
+		if (disp->wait_vid_buffer(disp) <= 0)
+			break;
+
 	if (!list_is_empty(&disp->unlocked)) {
 		buf = list_last_entry(&disp->unlocked, struct buffer, unlocked);
 		list_del(&buf->unlocked);
@@ -193,9 +199,102 @@ disp_get_vid_buffer(struct display *disp)
 void
 disp_put_vid_buffer(struct display *disp, struct buffer *buf)
 {
+	if (disp->hold_vid_buffer && disp->hold_vid_buffer(disp, buf))
+		return;
 	list_add(&buf->unlocked, &disp->unlocked);
 }
 
+int
+disp_get_output(struct display *disp, uint32_t n, uint32_t *w, uint32_t *h)
+{
+	if (!disp->get_output) {
+		/* one output, the whole display */
+		if (n)
+			return -1;
+		*w = disp->width;
+		*h = disp->height;
+		return 0;
+	}
+	return disp->get_output(disp, n, w, h);
+}
+
+int
+disp_post_output_buffer(struct display *disp, uint32_t n, struct buffer *buf)
+{
+	buf->present.posted_us = now_us();
+	if (!disp->post_output_buffer)
+		return n ? -1 : disp->post_buffer(disp, buf);
+	return disp->post_output_buffer(disp, n, buf);
+}
+
+struct buffer *
+disp_import_vid_buffer(struct display *disp, uint32_t fourcc,
+		uint32_t w, uint32_t h, const int *fds,
+		const uint32_t *pitches, const uint32_t *offsets)
+{
+	if (!disp->import_vid_buffer) {
+		ERROR("display can't import dmabufs");
+		return NULL;
+	}
+	return disp->import_vid_buffer(disp, fourcc, w, h, fds, pitches, offsets);
+}
+
+void
+disp_set_release_callback(struct display *disp,
+		void (*cb)(struct display *disp, struct buffer *buf, void *data),
+		void *data)
+{
+	disp->release_cb = cb;
+	disp->release_data = data;
+}
+
+void
+disp_buffer_released(struct display *disp, struct buffer *buf)
+{
+	if (disp->release_cb)
+		disp->release_cb(disp, buf, disp->release_data);
+}
+
+void
+disp_set_present_callback(struct display *disp,
+		void (*cb)(struct display *disp, struct buffer *buf, void *data),
+		void *data)
+{
+	disp->present_cb = cb;
+	disp->present_data = data;
+}
+
+void
+disp_buffer_presented(struct display *disp, struct buffer *buf)
+{
+	if (disp->present_cb)
+		disp->present_cb(disp, buf, disp->present_data);
+}
+
+int
+disp_get_event_fd(struct display *disp)
+{
+	if (!disp->get_event_fd)
+		return -1;
+	return disp->get_event_fd(disp);
+}
+
+int
+disp_handle_events(struct display *disp)
+{
+	if (!disp->handle_events)
+		return 0;
+	return disp->handle_events(disp);
+}
+
+int
+disp_supports_format(struct display *disp, uint32_t fourcc)
+{
+	if (!disp->supports_format)
+		return -1;
+	return disp->supports_format(disp, fourcc);
+}
+
 /* Maintain playback rate if fps > 0. */
 static void maintain_playback_rate(struct rate_control *p)
 {
@@ -235,6 +334,7 @@ disp_post_buffer(struct display *disp, struct buffer *buf)
 {
 	int ret;
 
+	buf->present.posted_us = now_us();
 	ret = disp->post_buffer(disp, buf);
 	if(!ret)
 		maintain_playback_rate(&disp->rtctl);
@@ -248,6 +348,7 @@ disp_post_vid_buffer(struct display *disp, struct buffer *buf,
 {
 	int ret;
 
+	buf->present.posted_us = now_us();
 	ret = disp->post_vid_buffer(disp, buf, x, y, w, h);
 	if(!ret)
 		maintain_playback_rate(&disp->rtctl);
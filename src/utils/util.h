@@ -50,6 +50,16 @@ typedef enum {
  * both cases.
  */
 
+/* When and how a posted buffer reached the screen, CLOCK_MONOTONIC */
+struct disp_presentation {
+	uint64_t posted_us;	/* disp_post_buffer() was called */
+	uint64_t presented_us;	/* scanout started, from the flip event */
+	uint32_t sequence;	/* vblank counter at that time */
+	int32_t vblanks;	/* since the previous buffer: 1 is on time, 0 is
+				 * two flips in one vblank, n > 1 means the
+				 * previous one stayed up n refreshes */
+};
+
 struct buffer {
 	uint32_t fourcc, width, height;
 	int nbo;
@@ -59,6 +69,7 @@ struct buffer {
 	bool multiplanar;	/* True when Y and U/V are in separate buffers. */
 	int fd[4];		/* dmabuf */
 	bool noScale;
+	struct disp_presentation present;	/* filled in by the display */
 };
 
 /* State variables, used to maintain the playback rate. */
@@ -85,8 +96,36 @@ struct display {
 	void (*close)(struct display *disp);
 	void (*disp_free_buf) (struct display *disp, uint32_t n);
 
+	/* optional: */
+	int (*get_output)(struct display *disp, uint32_t n,
+			uint32_t *w, uint32_t *h);
+	int (*post_output_buffer)(struct display *disp, uint32_t n,
+			struct buffer *buf);
+	struct buffer * (*import_vid_buffer)(struct display *disp,
+			uint32_t fourcc, uint32_t w, uint32_t h, const int *fds,
+			const uint32_t *pitches, const uint32_t *offsets);
+	/* optional, for backends that complete posts asynchronously: */
+	int (*get_event_fd)(struct display *disp);
+	int (*handle_events)(struct display *disp);
+	/* optional, for backends that keep using a buffer after the next
+	 * post: return true to keep buf out of the pool until it is released,
+	 * when the backend puts it back, and wait for a release when the pool
+	 * runs dry:
+	 */
+	bool (*hold_vid_buffer)(struct display *disp, struct buffer *buf);
+	int (*wait_vid_buffer)(struct display *disp);
+	/* optional: whether video of this format can be shown as is */
+	bool (*supports_format)(struct display *disp, uint32_t fourcc);
+
 	bool multiplanar;	/* True when Y and U/V are in separate buffers. */
 	struct buffer **buf;
+
+	/* see disp_set_release_callback() */
+	void (*release_cb)(struct display *disp, struct buffer *buf, void *data);
+	void *release_data;
+	/* see disp_set_present_callback() */
+	void (*present_cb)(struct display *disp, struct buffer *buf, void *data);
+	void *present_data;
 };
 
 /* Print display related help */
@@ -126,10 +165,66 @@ int
 disp_post_vid_buffer(struct display *disp, struct buffer *buf,
 		uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 
-/* Get plane (id = 1) for every connector and update the overlay */
+/* Called once a posted buffer has been replaced on screen (or dropped
+ * without ever being shown), ie. when the producer may write to it
+ * again.  Backends that do not queue posts release the previous buffer
+ * before disp_post_buffer() returns.
+ */
+void disp_set_release_callback(struct display *disp,
+		void (*cb)(struct display *disp, struct buffer *buf, void *data),
+		void *data);
+
+/* for backends: hand a buffer back through the release callback */
+void disp_buffer_released(struct display *disp, struct buffer *buf);
+
+/* Called when a buffer from disp_post_buffer() has reached the screen,
+ * once buf->present is filled in (so far only KMS page flips report it)
+ */
+void disp_set_present_callback(struct display *disp,
+		void (*cb)(struct display *disp, struct buffer *buf, void *data),
+		void *data);
+
+/* for backends: buf->present is up to date */
+void disp_buffer_presented(struct display *disp, struct buffer *buf);
+
+/* fd to poll for readability in the caller's event loop, or -1 if the
+ * display has nothing to wait for; call disp_handle_events() when it
+ * becomes readable (that is where release callbacks run)
+ */
+int disp_get_event_fd(struct display *disp);
+int disp_handle_events(struct display *disp);
+
+/* 1 when video buffers of this fourcc can be posted without conversion,
+ * 0 when they can't, -1 when the display doesn't say
+ */
+int disp_supports_format(struct display *disp, uint32_t fourcc);
+
+/* The outputs of a display (KMS connectors given with -s) are normally
+ * one side-by-side buffer.  They can also be driven one by one instead,
+ * each at its own refresh rate: disp_get_output() gives the size of
+ * output n (-1 past the last one), disp_post_output_buffer() flips
+ * a buffer of that size on it alone.
+ */
+int disp_get_output(struct display *disp, uint32_t n, uint32_t *w, uint32_t *h);
+int disp_post_output_buffer(struct display *disp, uint32_t n,
+		struct buffer *buf);
+
+/* Reserve a video plane on every connector, on top unless --zorder */
 int
 get_overlay_plane(struct display *disp, struct buffer *buf);
 
+/* Wrap dmabufs from elsewhere (capture, decoder, another process) as a
+ * video buffer that can be posted without a copy.  fds, pitches and
+ * offsets are per plane (the same fd may be given for every plane).
+ * The buffer belongs to the display, which keeps a limited number of
+ * imports: it is only good until the next import, which may evict it
+ * once it is off the screen.  So import again for every post rather
+ * than keeping it; repeated imports are just a lookup.
+ */
+struct buffer * disp_import_vid_buffer(struct display *disp, uint32_t fourcc,
+		uint32_t w, uint32_t h, const int *fds,
+		const uint32_t *pitches, const uint32_t *offsets);
+
 /* allocate a buffer from pool created by disp_get_vid_buffers() */
 struct buffer * disp_get_vid_buffer(struct display *disp);
 /* free to video buffer pool */
@@ -173,6 +268,61 @@ int check_args(int argc, char **argv);
 
 void fill(struct buffer *buf, int i);
 
+/* Synthetic frame source (YUYV, NV12, I420), same tiles as fill() but
+ * cheap enough to stand in for a capture device.  Frame number n is
+ * stamped in the top-left corner and can be read back from any copy
+ * of the frame (after capture, VPE, display readback...).
+ */
+struct pattern;
+struct pattern * pattern_new(uint32_t fourcc, uint32_t width, uint32_t height);
+int pattern_fill(struct pattern *pat, struct buffer *buf, uint32_t n);
+uint32_t pattern_read_stamp(struct buffer *buf);
+void pattern_free(struct pattern *pat);
+
+/* Linear vs TILER layout of omap bos, per buffer role: the faster one is
+ * measured by bo_layout_bench() and kept in a policy file at path.
+ */
+enum bo_role {
+	BO_ROLE_SCANOUT,	/* UI/primary buffers, drawn by the CPU */
+	BO_ROLE_VIDEO,		/* video buffers, filled by capture/VPE/copy */
+};
+int bo_layout_bench(struct omap_device *dev, uint32_t width, uint32_t height,
+		const char *path);
+bool bo_layout_tiled(const char *path, enum bo_role role, uint32_t bpp);
+
+/* Copy a packed V4L2 frame (YUYV, UYVY, NV12, I420; luma line pitch
+ * src_pitch) into a display buffer of the same format and size.  Large
+ * frames are split across frame_copy_threads() threads, 0 means one per
+ * core.  frame_copy_bench() times it against a plain memcpy() per line.
+ */
+int frame_copy(struct buffer *buf, const void *src, uint32_t src_pitch);
+void frame_copy_threads(int n);
+int frame_copy_bench(struct buffer *buf, uint32_t src_pitch, int reps);
+void frame_copy_row(uint8_t *dst, const uint8_t *src, uint32_t len);
+void frame_copy_fence(void);
+
+/* Capture format negotiation (capture-caps.c): out of what the V4L2
+ * capture device fd offers, pick the format, size and rate closest to
+ * width x height that the display shows without conversion, and print
+ * the chosen path with its estimated memory traffic.  If accept is not
+ * NULL, formats (display fourccs) it returns false for are not used on
+ * either side of the path.
+ */
+struct capture_path {
+	uint32_t v4l2_fourcc;	/* V4L2 pixelformat to capture */
+	uint32_t fourcc;	/* what the display gets */
+	uint32_t width, height;
+	uint32_t fps_num, fps_den;	/* fps_num / fps_den, 0 if unknown */
+	uint32_t bpp, out_bpp;
+	bool convert;		/* display can't show it, needs a VPE pass */
+	double mbps;		/* estimated DDR traffic, MB/s */
+};
+int capture_negotiate(int fd, struct display *disp, uint32_t width,
+		uint32_t height, bool (*accept)(uint32_t fourcc),
+		struct capture_path *path);
+int capture_set_rate(int fd, const struct capture_path *path);
+void capture_path_print(const struct capture_path *path);
+
 #define FOURCC(a, b, c, d) ((uint32_t)(uint8_t)(a) | ((uint32_t)(uint8_t)(b) << 8) | ((uint32_t)(uint8_t)(c) << 16) | ((uint32_t)(uint8_t)(d) << 24 ))
 #define FOURCC_STR(str)    FOURCC(str[0], str[1], str[2], str[3])
 
@@ -210,6 +360,17 @@ void fill(struct buffer *buf, int i);
 #define ALIGN2(x,n)   (((x) + ((1 << (n)) - 1)) & ~((1 << (n)) - 1))
 
 #include <sys/time.h>
+#include <time.h>
+
+/* monotonic time in usecs, same clock as DRM vblank timestamps */
+static inline uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline long
 mark(long *last)
 {
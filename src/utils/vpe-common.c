@@ -421,12 +421,15 @@ int vpe_output_init(struct vpe *vpe)
 	disp_get_fb(vpe->disp);
 
 	for (i = 0; i < NUMBUF; i++) {
-		vpe->output_buf_dmafd[i] = omap_bo_dmabuf(vpe->disp_bufs[i]->bo[0]);
-		vpe->disp_bufs[i]->fd[0] = vpe->output_buf_dmafd[i];
+		/* the display may already have exported (and cached) the fds */
+		if (vpe->disp_bufs[i]->fd[0] <= 0)
+			vpe->disp_bufs[i]->fd[0] = omap_bo_dmabuf(vpe->disp_bufs[i]->bo[0]);
+		vpe->output_buf_dmafd[i] = vpe->disp_bufs[i]->fd[0];
 
 		if(vpe->dst.coplanar) {
-			vpe->output_buf_dmafd_uv[i] = omap_bo_dmabuf(vpe->disp_bufs[i]->bo[1]);
-			vpe->disp_bufs[i]->fd[1] = vpe->output_buf_dmafd_uv[i];
+			if (vpe->disp_bufs[i]->fd[1] <= 0)
+				vpe->disp_bufs[i]->fd[1] = omap_bo_dmabuf(vpe->disp_bufs[i]->bo[1]);
+			vpe->output_buf_dmafd_uv[i] = vpe->disp_bufs[i]->fd[1];
 		}
 		/* No Scale back to display resolution */
 		vpe->disp_bufs[i]->noScale = true;
@@ -20,7 +20,16 @@
  * This is a drm test app to capture and display frames from a v4l2 device
  * It uses standard single planar V4L2 API to capture progressive frames
  * Displays the buffers via drm in fullscreen
- * Currently only YUYV format is allowed
+ * The capture format, size and rate are negotiated with the display
+ * (capture_negotiate()): formats the display can't show as is are not used
+ *
+ * Capture buffers reach the display in one of three ways (--io):
+ *   dmabuf: the display buffers are queued to the capture device as
+ *           V4L2_MEMORY_DMABUF, so the hardware captures straight into them
+ *   expbuf: the capture device's MMAP buffers are exported with
+ *           VIDIOC_EXPBUF and imported into the display
+ *   copy:   MMAP buffers are copied into display buffers by the CPU
+ * auto (default) tries them in that order.
  * This can be used to test VIP (Video Input Port) on DRA7xx SoC
  * For this, vpdma firmware should be copied in /lib/firmware on target
  */
@@ -35,15 +44,35 @@
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 
 #define NBUF 6
 
+enum io_mode { IO_AUTO, IO_DMABUF, IO_EXPBUF, IO_COPY };
+static const char *io_names[] = { "auto", "dmabuf", "expbuf", "copy" };
+
 int width = 640, height = 480;
+uint32_t fourcc = FOURCC('Y','U','Y','V');
+uint32_t bytesperline;
 
 void *buffer_addr[NBUF];
 int size[NBUF];
 
+/*
+ * Zero-copy capture buffers, indexed like the device's.  A buffer goes
+ * back to the device only once the display releases it, see
+ * capture_released().
+ */
+struct capture_bufs {
+	int fd;
+	enum v4l2_memory memory;
+	struct buffer **buffers;	/* dmabuf: the display's own */
+	int expfd[NBUF];		/* expbuf: exported by the device */
+	struct buffer *posted[NBUF];	/* with the display */
+	int queued;			/* with the device */
+};
+
 static int xioctl(int fd, int request, void *arg)
 {
 	int r;
@@ -54,13 +83,10 @@ static int xioctl(int fd, int request, void *arg)
 	return r;
 }
 
-int init_device(int fd)
+int init_device(int fd, const struct capture_path *path)
 {
-	char fourcc[5];
-	unsigned int i;
+	char name[5];
 	struct v4l2_format fmt;
-	struct v4l2_requestbuffers req;
-	struct v4l2_buffer buf;
 	struct v4l2_capability caps;
 
 	/* Check for capture device */
@@ -76,20 +102,25 @@ int init_device(int fd)
 		return 1;
 	}
 
-	/* Set capture format to YUYV */
+	/* Set the negotiated capture format */
 	memset(&fmt, 0, sizeof(fmt));
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = width;
-	fmt.fmt.pix.height = height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.width = path->width;
+	fmt.fmt.pix.height = path->height;
+	fmt.fmt.pix.pixelformat = path->v4l2_fourcc;
 	fmt.fmt.pix.field = V4L2_FIELD_NONE;
 
 	if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
 		perror("Setting Pixel Format");
 		return 1;
 	}
+	if (fmt.fmt.pix.pixelformat != path->v4l2_fourcc) {
+		ERROR("device did not take the negotiated format");
+		return 1;
+	}
 
-	strncpy(fourcc, (char *)&fmt.fmt.pix.pixelformat, 4);
+	name[4] = '\0';
+	strncpy(name, (char *)&fmt.fmt.pix.pixelformat, 4);
 	MSG( "Selected Camera Mode:\n"
 		"  Width: %d\n"
 		"  Height: %d\n"
@@ -97,22 +128,224 @@ int init_device(int fd)
 		"  Field: %d",
 		fmt.fmt.pix.width,
 		fmt.fmt.pix.height,
-		fourcc,
+		name,
 		fmt.fmt.pix.field);
+	width = fmt.fmt.pix.width;
+	height = fmt.fmt.pix.height;
+	bytesperline = fmt.fmt.pix.bytesperline;
+
+	return capture_set_rate(fd, path) ? 1 : 0;
+}
+
+static int request_buffers(int fd, enum v4l2_memory memory, int count)
+{
+	struct v4l2_requestbuffers req;
 
-	/* Currently driver supports only mmap buffers
-	 * Request memory mapped buffers */
 	memset(&req, 0, sizeof(req));
-	req.count = 6;
+	req.count = count;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.memory = memory;
+
+	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+		return -1;
+	return req.count;
+}
+
+static int queue_buffer(int fd, enum v4l2_memory memory, int idx, int dmafd,
+		uint32_t length)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = memory;
+	buf.index = idx;
+	if (memory == V4L2_MEMORY_DMABUF) {
+		buf.m.fd = dmafd;
+		buf.length = length;
+	}
+	if(-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
+		perror("Queue Buffer");
+		return -1;
+	}
+	return 0;
+}
+
+static int dequeue_buffer(int fd, enum v4l2_memory memory)
+{
+	struct v4l2_buffer buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = memory;
+	if(-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+		perror("Dequeue Buffer");
+		return -1;
+	}
+	return buf.index;
+}
+
+static int start_capture(int fd)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if(-1 == xioctl(fd, VIDIOC_STREAMON, &type)) {
+		perror("Start Capture");
+		return 1;
+	}
+	return 0;
+}
+
+/* bytes of a single-planar capture frame with the given luma pitch */
+static uint32_t frame_length(uint32_t pitch)
+{
+	if (fourcc == FOURCC('N','V','1','2') || fourcc == FOURCC('I','4','2','0'))
+		return pitch * height * 3 / 2;
+	return pitch * height;
+}
+
+/*
+ * Capture straight into the display buffers.  The device has to write
+ * with the display's pitch, which may be wider than the capture line.
+ */
+static int init_dmabuf(int fd, struct buffer **buffers)
+{
+	struct v4l2_format fmt;
+	uint32_t length = frame_length(buffers[0]->pitches[0]);
+	int i;
+
+	/* the device writes one plane after the other into a single buffer */
+	if (buffers[0]->nbo > 1) {
+		MSG("dmabuf: display buffers have one bo per plane");
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
+		return -1;
+
+	if (fmt.fmt.pix.bytesperline != buffers[0]->pitches[0]) {
+		fmt.fmt.pix.bytesperline = buffers[0]->pitches[0];
+		if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
+			MSG("dmabuf: S_FMT failed: %s", strerror(errno));
+			return -1;
+		}
+		/*
+		 * The device may have picked a pitch of its own, which the
+		 * other modes then read with: keep it whether or not it fits.
+		 */
+		bytesperline = fmt.fmt.pix.bytesperline;
+		if (bytesperline != buffers[0]->pitches[0]) {
+			MSG("dmabuf: device can't capture with a %u byte pitch",
+					buffers[0]->pitches[0]);
+			return -1;
+		}
+	}
+
+	if (request_buffers(fd, V4L2_MEMORY_DMABUF, NBUF) != NBUF) {
+		MSG("dmabuf: REQBUFS failed: %s", strerror(errno));
+		request_buffers(fd, V4L2_MEMORY_DMABUF, 0);
+		return -1;
+	}
+
+	for (i = 0; i < NBUF; i++) {
+		if (queue_buffer(fd, V4L2_MEMORY_DMABUF, i,
+				buffers[i]->fd[0], length)) {
+			request_buffers(fd, V4L2_MEMORY_DMABUF, 0);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Import capture buffer idx into the display.  The display only keeps
+ * the import until the next one, so this is done for every post.
+ */
+static struct buffer *import_capture(struct display *disp,
+		struct capture_bufs *cap, int idx)
+{
+	/* single-planar capture: chroma follows the luma */
+	uint32_t pitches[3] = { bytesperline, bytesperline, bytesperline / 2 };
+	uint32_t offsets[3] = { 0, bytesperline * height,
+			bytesperline * height * 5 / 4 };
+	int fds[3] = { cap->expfd[idx], cap->expfd[idx], cap->expfd[idx] };
+
+	if (fourcc == FOURCC('I','4','2','0'))
+		pitches[1] = bytesperline / 2;
+	return disp_import_vid_buffer(disp, fourcc, width, height,
+			fds, pitches, offsets);
+}
+
+/*
+ * Let the display scan out the capture buffers: export them and import
+ * the dmabufs, which only works with displays that can import.
+ */
+static int init_expbuf(int fd, struct display *disp, struct capture_bufs *cap)
+{
+	struct v4l2_exportbuffer expbuf;
+	int i, n;
+
+	for (i = 0; i < NBUF; i++)
+		cap->expfd[i] = -1;
+
+	n = request_buffers(fd, V4L2_MEMORY_MMAP, NBUF);
+	if (n != NBUF) {
+		MSG("expbuf: got %d of %d buffers", n, NBUF);
+		goto fail;
+	}
+
+	for (i = 0; i < NBUF; i++) {
+		memset(&expbuf, 0, sizeof(expbuf));
+		expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		expbuf.index = i;
+		expbuf.flags = O_CLOEXEC | O_RDWR;
+		if (-1 == xioctl(fd, VIDIOC_EXPBUF, &expbuf)) {
+			MSG("expbuf: VIDIOC_EXPBUF failed: %s", strerror(errno));
+			goto fail;
+		}
+		cap->expfd[i] = expbuf.fd;
+
+		if (!import_capture(disp, cap, i)) {
+			MSG("expbuf: display can't import capture buffers");
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < NBUF; i++)
+		if (queue_buffer(fd, V4L2_MEMORY_MMAP, i, -1, 0))
+			goto fail;
+
+	return 0;
+
+fail:
+	for (i = 0; i < NBUF; i++) {
+		if (cap->expfd[i] >= 0)
+			close(cap->expfd[i]);
+		cap->expfd[i] = -1;
+	}
+	request_buffers(fd, V4L2_MEMORY_MMAP, 0);
+	return -1;
+}
+
+static int init_copy(int fd)
+{
+	struct v4l2_buffer buf;
+	int i, n;
 
-	if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+	/* Request memory mapped buffers */
+	n = request_buffers(fd, V4L2_MEMORY_MMAP, NBUF);
+	if (n < 0) {
 		perror("Requesting Buffer");
 		return 1;
 	}
+	if (n > NBUF)
+		n = NBUF;
+
+	for (i = 0; i < n; i++) {
 
-	for (i = 0; i < req.count; i++) {
 		memset(&buf, 0, sizeof(buf));
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
@@ -139,13 +372,54 @@ int init_device(int fd)
 		}
 
 	}
-	if(-1 == xioctl(fd, VIDIOC_STREAMON, &buf.type)) {
-		perror("Start Capture");
-		return 1;
-	}
 	return 0;
 }
 
+/*
+ * Display release callback: the buffer is off the screen, so the device
+ * can capture into it again.
+ */
+static void capture_released(struct display *disp, struct buffer *buf,
+		void *data)
+{
+	struct capture_bufs *cap = data;
+	int idx, dmafd = -1;
+	uint32_t length = 0;
+
+	for (idx = 0; idx < NBUF; idx++)
+		if (cap->posted[idx] == buf)
+			break;
+	if (idx == NBUF)
+		return;
+	cap->posted[idx] = NULL;
+
+	if (cap->memory == V4L2_MEMORY_DMABUF) {
+		dmafd = cap->buffers[idx]->fd[0];
+		length = frame_length(cap->buffers[idx]->pitches[0]);
+	}
+	if (!queue_buffer(cap->fd, cap->memory, idx, dmafd, length))
+		cap->queued++;
+}
+
+/* The display has every capture buffer: wait until it lets one go. */
+static int wait_release(struct display *disp)
+{
+	struct pollfd pfd = {
+		.fd = disp_get_event_fd(disp),
+		.events = POLLIN,
+	};
+
+	if (pfd.fd < 0) {
+		ERROR("display holds all capture buffers and can't release one");
+		return -1;
+	}
+	if (poll(&pfd, 1, 1000) <= 0) {
+		ERROR("display did not release a capture buffer");
+		return -1;
+	}
+	return disp_handle_events(disp);
+}
+
 void release_device(int fd)
 {
 	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -161,42 +435,64 @@ static void usage(char *name) {
 	MSG("\t-h, --help: Print this help and exit.");
 	MSG("\t-n:\t Number of frames to capture (0 for infinite)");
 	MSG("\t-d:\t Device node to be used as capture device");
+	MSG("\t--pattern:\t Use a synthetic pattern instead of the capture device");
+	MSG("\t--io <auto|dmabuf|expbuf|copy>:\t How capture buffers reach the display (default auto)");
+	MSG("\t--copy-threads <n>:\t Threads for the copy path (default: one per core)");
+	MSG("\t--copy-bench <frames>:\t Time the copy path on the display buffers and exit");
 	MSG("");
 	disp_usage();
 }
 
 void copy_buf(struct buffer *buf, void *deqbuf)
 {
-	int i, height = buf->height, stride = buf->pitches[0];
-	int capStride = 2 * width;
-	uint8_t *dst, *src;
+	if (frame_copy(buf, deqbuf, bytesperline))
+		ERROR("could not copy frame into display buffer");
+}
 
-	dst = omap_bo_map(buf->bo[0]);
-	src = deqbuf;
+/* Stand in for the capture device: generate frames with the pattern
+ * source and report the rate at which they were produced and posted.
+ */
+static int pattern_loop(struct display *disp, struct buffer **buffers, int count)
+{
+	struct pattern *pat;
+	struct timeval start, end;
+	long usecs;
+	int i, ret = 0;
 
-	/* Call this before you start accessing display buffers */
-	for (i = 0; i < buf->nbo; i++)
-		omap_bo_cpu_prep(buf->bo[i], OMAP_GEM_WRITE);
+	pat = pattern_new(FOURCC_STR("YUYV"), width, height);
+	if (!pat)
+		return 1;
+
+	gettimeofday(&start, NULL);
+	for (i = 1; i != count; i++) {
+		struct buffer *dispbuf = buffers[i % NBUF];
 
-	/* YUYV format - Only one bo expected
-	 * TODO: Change this for all formats */
-	for(i=0; i<height; i++) {
-		dst += stride;
-		src += capStride;
-		memcpy(dst, src, capStride);
+		pattern_fill(pat, dispbuf, i);
+		ret = disp_post_vid_buffer(disp, dispbuf, 0, 0, width, height);
+		if (ret)
+			break;
 	}
+	gettimeofday(&end, NULL);
 
-	/* Call this after you are done with accessing display buffers */
-	for (i = 0; i < buf->nbo; i++)
-		omap_bo_cpu_fini(buf->bo[i], OMAP_GEM_WRITE);
+	usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_usec - start.tv_usec);
+	if (usecs > 0)
+		MSG("pattern: %d frames in %ld ms, %.02f fps", i - 1,
+				usecs / 1000, (i - 1) * 1000000.0 / usecs);
 
+	pattern_free(pat);
+	return ret;
 }
 
 int main(int argc, char **argv)
 {
 	struct display *disp;
 	struct buffer **buffers;
-	int ret, i, idx, fd, count = 0;
+	int ret, i, idx, fd = -1, count = 0;
+	int use_pattern = 0, copy_bench = 0;
+	enum io_mode io = IO_AUTO;
+	enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+	struct capture_bufs cap = { 0 };
 	char devnode[100] = "/dev/video1";
 
 	/* Parse command line arguments */
@@ -226,20 +522,47 @@ int main(int argc, char **argv)
 			argv[i++] = NULL;
 			strncpy(devnode, argv[i],100);
 			argv[i] = NULL;
+		} else if (!strcmp(argv[i], "--pattern")) {
+			use_pattern = 1;
+			argv[i] = NULL;
+		} else if (!strcmp(argv[i], "--io")) {
+			argv[i++] = NULL;
+			for (io = IO_AUTO; io <= IO_COPY; io++)
+				if (argv[i] && !strcmp(argv[i], io_names[io]))
+					break;
+			if (io > IO_COPY) {
+				ERROR("invalid io mode: %s", argv[i]);
+				return 1;
+			}
+			argv[i] = NULL;
+		} else if (!strcmp(argv[i], "--copy-threads")) {
+			int n;
+
+			argv[i++] = NULL;
+			if (!argv[i] || sscanf(argv[i], "%d", &n) != 1) {
+				ERROR("invalid thread count: %s", argv[i]);
+				return 1;
+			}
+			frame_copy_threads(n);
+			argv[i] = NULL;
+		} else if (!strcmp(argv[i], "--copy-bench")) {
+			argv[i++] = NULL;
+			if (!argv[i] || sscanf(argv[i], "%d", &copy_bench) != 1) {
+				ERROR("invalid frame count: %s", argv[i]);
+				return 1;
+			}
+			argv[i] = NULL;
 		}
 	}
 
-	MSG("Opening Video device %s", devnode);
-	fd = open(devnode, O_RDWR);
-	if (fd == -1) {
-		perror("Opening video device");
-		return 1;
-	}
+	if (!use_pattern) {
+		MSG("Opening Video device %s", devnode);
+		fd = open(devnode, O_RDWR);
+		if (fd == -1) {
+			perror("Opening video device");
+			return 1;
+		}
 
-	ret = init_device(fd);
-	if (0 != ret) {
-		MSG("Exiting");
-		return ret;
 	}
 
 	MSG("Opening Display..");
@@ -255,48 +578,127 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (!use_pattern) {
+		struct capture_path path;
+
+		if (capture_negotiate(fd, disp, width, height, NULL, &path))
+			return 1;
+		if (path.convert) {
+			ERROR("the display can't show any capture format as is, "
+					"use capturevpedisplay to convert");
+			return 1;
+		}
+		fourcc = path.fourcc;
+
+		ret = init_device(fd, &path);
+		if (0 != ret) {
+			MSG("Exiting");
+			return ret;
+		}
+	}
+
 	/* Request drm to allocate some buffers */
-	buffers = disp_get_vid_buffers(disp, NBUF, FOURCC_STR("YUYV"), width, height);
+	buffers = disp_get_vid_buffers(disp, NBUF, fourcc, width, height);
 	if (!buffers) {
 		return 1;
 	}
 
+	if (copy_bench) {
+		ret = frame_copy_bench(buffers[0],
+				bytesperline ? bytesperline : width * 2, copy_bench);
+		disp_free_buffers(disp, NBUF);
+		disp_close(disp);
+		return ret;
+	}
+
+	if (use_pattern) {
+		ret = pattern_loop(disp, buffers, count);
+		disp_free_buffers(disp, NBUF);
+		disp_close(disp);
+		return ret;
+	}
+
+	/* fall through the zero-copy modes to the one the pair supports */
+	if ((io == IO_AUTO || io == IO_DMABUF) && !init_dmabuf(fd, buffers)) {
+		io = IO_DMABUF;
+		memory = V4L2_MEMORY_DMABUF;
+	} else if ((io == IO_AUTO || io == IO_EXPBUF) &&
+			!init_expbuf(fd, disp, &cap)) {
+		io = IO_EXPBUF;
+	} else if (io == IO_AUTO || io == IO_COPY) {
+		io = IO_COPY;
+		if (init_copy(fd))
+			return 1;
+	} else {
+		ERROR("--io %s is not supported by this device/display",
+				io_names[io]);
+		return 1;
+	}
+	MSG("Capture io mode: %s%s", io_names[io], io == IO_COPY ?
+			"" : " (no CPU copy of the frames)");
+
+	if (io != IO_COPY) {
+		cap.fd = fd;
+		cap.memory = memory;
+		cap.buffers = buffers;
+		cap.queued = NBUF;
+		disp_set_release_callback(disp, capture_released, &cap);
+	}
+
+	if (start_capture(fd))
+		return 1;
+
 	for (i = 1; i != count; i++) {
 		struct buffer *dispbuf = buffers[i % NBUF];
-		struct v4l2_buffer buf;
+
+		while (io != IO_COPY && !cap.queued)
+			if (wait_release(disp))
+				return 1;
 
 		/* Dequeue one buffer */
-		memset(&buf, 0, sizeof(buf));
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		if(-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-			perror("Queue Buffer");
+		idx = dequeue_buffer(fd, memory);
+		if (idx < 0)
 			return 1;
+
+		if (io == IO_COPY) {
+			/* Copy data from dequeued buffer into display buffer */
+			copy_buf(dispbuf, buffer_addr[idx]);
+		} else if (io == IO_EXPBUF) {
+			dispbuf = import_capture(disp, &cap, idx);
+			if (!dispbuf)
+				return 1;
+		} else {
+			dispbuf = buffers[idx];
+		}
+
+		/*
+		 * Zero-copy: idx stays off the device until the display
+		 * releases it, which may be during this very post.
+		 */
+		if (io != IO_COPY) {
+			cap.queued--;
+			cap.posted[idx] = dispbuf;
 		}
-		idx = buf.index;
 
-		/* Copy data from dequeued buffer into display buffer */
-		copy_buf(dispbuf, buffer_addr[idx]);
 		/* Give it to display */
 		ret = disp_post_vid_buffer(disp, dispbuf, 0, 0, width, height);
 		if (ret) {
 			return ret;
 		}
 
-		/* Queue it back for next capture */
-		memset(&buf, 0, sizeof(buf));
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = idx;
-		if(-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
-			perror("Queue Buffer");
-			return 1;
+		if (io == IO_COPY) {
+			/* Queue it back for next capture */
+			if (queue_buffer(fd, memory, idx, -1, 0))
+				return 1;
 		}
 	}
 
+	disp_set_release_callback(disp, NULL, NULL);
 	disp_free_buffers(disp, NBUF);
 	disp_close(disp);
 	release_device(fd);
+	for (i = 0; io == IO_EXPBUF && i < NBUF; i++)
+		close(cap.expfd[i]);
 
 	return 0;
 }
@@ -25,6 +25,8 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <sys/resource.h>
+#include <stdarg.h>
 
 #include "util.h"
 #include "demux.h"
@@ -38,6 +40,52 @@
 /* omap drm device handle */
 struct omap_device *dev = NULL;
 
+/* Input prefetch: a demux thread per decoder fills a ring of DCE-locked
+ * input bos ahead of the decoder, so file I/O and parsing overlap with
+ * VIDDEC3_process() instead of running in series with it.  A slot with
+ * n == 0 marks the end of the stream.
+ */
+struct input_slot {
+	struct omap_bo *bo;
+	char *map;
+	size_t fd;		/* dmabuf, locked with dce */
+	int n;
+};
+
+struct input_ring {
+	struct input_slot *slot;
+	int nslots;
+	int head;		/* next slot the demux thread fills */
+	int tail;		/* next slot the decoder takes */
+	int count;		/* filled slots */
+	bool stop, eos;
+	pthread_t thread;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* decoder waiting on the demux thread */
+	unsigned int gets, waits;
+	uint64_t idle_us, start_us;
+	/* demux thread: time in demux_read(), and its CPU clock */
+	unsigned int demuxed;
+	uint64_t demux_us;
+	clockid_t cpu_clock;
+	uint64_t cpu_us;
+};
+
+/* --bench: per decoder numbers, written out as JSON at exit */
+struct bench {
+	uint32_t *process_us;	/* every VIDDEC3_process() */
+	unsigned int nprocess, cap;
+	unsigned int frames, posted;
+	uint64_t post_us;
+	/* output buffers given to the codec and not freed yet */
+	int in_flight, in_flight_max;
+	uint64_t in_flight_sum;
+	unsigned int samples;
+};
+
 struct decoder {
 	struct display *disp;
 	struct demux *demux;
@@ -51,8 +99,7 @@ struct decoder {
 	XDM2_BufDesc *outBufs;
 	VIDDEC3_InArgs *inArgs;
 	VIDDEC3_OutArgs *outArgs;
-	char *input;
-	struct omap_bo *input_bo;
+	struct input_ring ring;
 	int input_sz, uv_offset;
 	int padded_width;
 	int padded_height;
@@ -62,12 +109,50 @@ struct decoder {
 	int id;
 	struct buffer *lastOutBuf;
 	int outBufsInUseFlag;
+
+	/* multi-stream scheduling, see sched_worker() */
+	struct list link;
+	int prio;
+	uint64_t interval_us, deadline;
+	unsigned int frames, late;
+	uint64_t busy_us;
+
+	const char *name;
+	struct bench bench;
 };
 
 
-struct decoder *decoders[8] = {};
+struct decoder **decoders = NULL;
 int ndecoders = 0;
 
+/* Multi-stream scheduling.  Rather than one thread per stream, a few
+ * workers (--workers) take turns on the streams, so more streams than
+ * threads can share the IVA-HD, and one worker can demux and post while
+ * another is blocked in VIDDEC3_process().  Every stream has a deadline,
+ * when its next frame is due at the stream's own frame rate, and is not
+ * decoded before it: workers sleep until the earliest one when nothing
+ * is due.  Among the streams that are due, the best priority (--prio,
+ * per stream, lower first) and then the earliest deadline is decoded
+ * next, one frame at a time.  So priority only orders streams that are
+ * all behind, and a stream that keeps up leaves room for the others.
+ * A stream is never handled by two workers at once, so the codec state
+ * needs no locking.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list ready;
+	int active;		/* streams not finished yet */
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* worker threads for multiple streams */
+static int nworkers = 2;
+
+/* a stream this far behind gives up on catching up */
+#define MAX_LAG_US 1000000
+
 /* When true, do not actually call VIDDEC3_process. For benchmarking. */
 static int no_process = 0;
 static int inloop = 0;
@@ -75,6 +160,20 @@ static int inloop = 0;
 /* When true, loop at end of playback. */
 static int loop = 0;
 
+/* input buffers demuxed ahead of the decoder */
+static int nprefetch = 4;
+
+/* --bench output, NULL when not benchmarking; the records of the
+ * decoders that have finished are collected in bench_json
+ */
+static FILE *bench_file;
+static char *bench_json;
+static size_t bench_len;
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* --synthetic WxH[:frames] instead of an input file */
+static int synthetic_w, synthetic_h, synthetic_frames = 300;
+
 static void
 usage(char *name)
 {
@@ -86,10 +185,363 @@ usage(char *name)
 	MSG("\t--loop\tRestart playback at end of stream.");
 	MSG("\t--inloop\tRestart playback at end of stream along with decoder reinitialization.");
 	MSG("\t--no-process\tDo not actually call VIDDEC3_process method. For benchmarking.");
+	MSG("\t--bench <file>\tWrite per decoder statistics as JSON to file (- for stdout).");
+	MSG("\t--synthetic <w>x<h>[:frames]\tFeed generated packets instead of a file, implies --no-process.");
+	MSG("\t--prefetch <n>\tInput buffers demuxed ahead of the decoder (default %d).", nprefetch);
+	MSG("\t--workers <n>\tThreads decoding multiple streams (default %d).", nworkers);
+	MSG("\t--prio <n>\tPriority of this stream, lower is decoded first (default 0).");
+	MSG("\t--seek <[[hh:]mm:]ss>\tStart this stream at the keyframe at or before the given time.");
+	MSG("\t--ff <n>\tFast-forward this stream: decode only every n-th keyframe.");
 	MSG("");
 	disp_usage();
 }
 
+/* [[hh:]mm:]ss[.frac] to ms, -1 if malformed */
+static int64_t
+parse_time(const char *str)
+{
+	double part, t = 0;
+	char *end;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		part = strtod(str, &end);
+		if (end == str || part < 0)
+			return -1;
+		t = t * 60 + part;
+		if (!*end)
+			return (int64_t)(t * 1000);
+		if (*end != ':')
+			return -1;
+		str = end + 1;
+	}
+
+	return -1;
+}
+
+static void *
+ring_thread(void *arg)
+{
+	struct decoder *decoder = arg;
+	struct input_ring *ring = &decoder->ring;
+	struct input_slot *slot;
+	uint64_t t;
+	int n;
+
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->stop && !ring->eos) {
+		if (ring->count == ring->nslots) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+			continue;
+		}
+		/* only this thread touches free slots */
+		slot = &ring->slot[ring->head];
+		pthread_mutex_unlock(&ring->lock);
+
+		t = now_us();
+		n = demux_read(decoder->demux, slot->map, decoder->input_sz);
+		ring->demux_us += now_us() - t;
+		ring->demuxed++;
+		if (!n && loop) {
+			/* In loop mode: rewind and retry once, --inloop
+			 * reopens the decoder on the rewound stream instead.
+			 */
+			int err = demux_rewind(decoder->demux);
+			if (err < 0)
+				ERROR("%p: demux_rewind returned error: %d", decoder, err);
+			else
+				MSG("%p: rewound.", decoder);
+			if (err >= 0 && !inloop)
+				n = demux_read(decoder->demux, slot->map,
+						decoder->input_sz);
+		}
+		slot->n = n;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->head = (ring->head + 1) % ring->nslots;
+		ring->count++;
+		if (!n)
+			ring->eos = true;
+		pthread_cond_broadcast(&ring->cond);
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+static int
+ring_init(struct decoder *decoder, int nslots)
+{
+	struct input_ring *ring = &decoder->ring;
+	int i;
+
+	memset(ring, 0, sizeof(*ring));
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	ring->slot = calloc(nslots, sizeof(*ring->slot));
+	if (!ring->slot)
+		return -1;
+	ring->nslots = nslots;
+
+	for (i = 0; i < nslots; i++) {
+		struct input_slot *slot = &ring->slot[i];
+
+		slot->bo = omap_bo_new(decoder->disp->dev, decoder->input_sz,
+				OMAP_BO_WC);
+		if (!slot->bo)
+			return -1;
+		slot->map = omap_bo_map(slot->bo);
+		slot->fd = omap_bo_dmabuf(slot->bo);
+		dce_buf_lock(1, &slot->fd);
+	}
+
+	return 0;
+}
+
+static int
+ring_start(struct decoder *decoder)
+{
+	struct input_ring *ring = &decoder->ring;
+
+	ring->start_us = now_us();
+	if (pthread_create(&ring->thread, NULL, ring_thread, decoder)) {
+		ERROR("%p: could not start demux thread", decoder);
+		return -1;
+	}
+	ring->running = true;
+	if (pthread_getcpuclockid(ring->thread, &ring->cpu_clock))
+		ring->cpu_clock = (clockid_t)-1;
+	return 0;
+}
+
+/* next access unit, waiting for the demux thread if it isn't there yet */
+static struct input_slot *
+ring_get(struct decoder *decoder)
+{
+	struct input_ring *ring = &decoder->ring;
+	struct input_slot *slot;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->gets++;
+	if (!ring->count) {
+		uint64_t t = now_us();
+
+		ring->waits++;
+		while (!ring->count)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		ring->idle_us += now_us() - t;
+	}
+	slot = &ring->slot[ring->tail];
+	pthread_mutex_unlock(&ring->lock);
+
+	return slot;
+}
+
+/* the codec is done with the slot from ring_get() */
+static void
+ring_put(struct decoder *decoder)
+{
+	struct input_ring *ring = &decoder->ring;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->tail = (ring->tail + 1) % ring->nslots;
+	ring->count--;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void
+ring_stop(struct decoder *decoder)
+{
+	struct input_ring *ring = &decoder->ring;
+	struct timespec ts;
+	uint64_t wall;
+
+	if (!ring->running)
+		return;
+
+	/* the clock goes away with the thread */
+	if (ring->cpu_clock != (clockid_t)-1 &&
+			!clock_gettime(ring->cpu_clock, &ts))
+		ring->cpu_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stop = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->thread, NULL);
+	ring->running = false;
+
+	wall = now_us() - ring->start_us;
+	MSG("%p: input: %u of %u frames waited on demux, %.1f ms idle "
+			"(%.1f%%)", decoder, ring->waits, ring->gets,
+			ring->idle_us / 1000.0,
+			wall ? 100.0 * ring->idle_us / wall : 0.0);
+}
+
+static void
+ring_free(struct decoder *decoder)
+{
+	struct input_ring *ring = &decoder->ring;
+	int i;
+
+	ring_stop(decoder);
+
+	for (i = 0; ring->slot && i < ring->nslots; i++) {
+		struct input_slot *slot = &ring->slot[i];
+
+		if (!slot->bo)
+			continue;
+		dce_buf_unlock(1, &slot->fd);
+		close(slot->fd);
+		omap_bo_del(slot->bo);
+	}
+	free(ring->slot);
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+	memset(ring, 0, sizeof(*ring));
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_process(struct decoder *decoder, uint32_t us)
+{
+	struct bench *b = &decoder->bench;
+
+	if (b->nprocess == b->cap) {
+		unsigned int cap = b->cap ? 2 * b->cap : 1024;
+		uint32_t *p = realloc(b->process_us, cap * sizeof(*p));
+
+		if (!p)
+			return;
+		b->process_us = p;
+		b->cap = cap;
+	}
+	b->process_us[b->nprocess++] = us;
+}
+
+static void
+bench_append(const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	p = realloc(bench_json, bench_len + n + 1);
+	if (!p)
+		return;
+	bench_json = p;
+	va_start(ap, fmt);
+	vsnprintf(bench_json + bench_len, n + 1, fmt, ap);
+	va_end(ap);
+	bench_len += n;
+}
+
+/* str as a JSON string */
+static void
+bench_append_str(const char *str)
+{
+	bench_append("\"");
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			bench_append("\\%c", c);
+		else if (c < 0x20)
+			bench_append("\\u%04x", c);
+		else
+			bench_append("%c", c);
+	}
+	bench_append("\"");
+}
+
+/*
+ * One JSON object per decoder run, called once the demux thread is done.
+ * Without VIDDEC3_process() nothing is decoded or posted, so those
+ * figures are null.
+ */
+static void
+bench_record(struct decoder *decoder)
+{
+	struct bench *b = &decoder->bench;
+	struct input_ring *ring = &decoder->ring;
+	uint64_t wall = now_us() - ring->start_us;
+	uint32_t *lat = b->process_us;
+	unsigned int n = b->nprocess;
+
+	if (lat)
+		qsort(lat, n, sizeof(*lat), cmp_u32);
+
+#define PCT(p) (n ? lat[(n - 1) * (p) / 100] : 0)
+	pthread_mutex_lock(&bench_lock);
+	bench_append("%s\n    {\"id\": %d, \"input\": ", bench_len ? "," : "",
+			decoder->id);
+	bench_append_str(decoder->name ? decoder->name : "");
+	bench_append(", \"width\": %d, \"height\": %d, \"frames\": %u, "
+			"\"wall_ms\": %.1f, \"fps\": %.2f,\n",
+			decoder->demux->cc->width, decoder->demux->cc->height, b->frames,
+			wall / 1000.0, wall ? b->frames * 1e6 / wall : 0.0);
+	if (no_process)
+		bench_append("     \"process_us\": null,\n");
+	else
+		bench_append("     \"process_us\": {\"count\": %u, \"p50\": %u, "
+				"\"p90\": %u, \"p99\": %u, \"max\": %u},\n",
+				n, PCT(50), PCT(90), PCT(99), n ? lat[n - 1] : 0);
+	bench_append("     \"demux_us_mean\": %.1f, \"demux_cpu_ms\": %.1f, "
+			"\"input_waits\": %u, \"input_idle_ms\": %.1f,\n",
+			ring->demuxed ? (double)ring->demux_us / ring->demuxed : 0.0,
+			ring->cpu_us / 1000.0, ring->waits, ring->idle_us / 1000.0);
+	if (no_process)
+		bench_append("     \"post_us_mean\": null, "
+				"\"buffers_in_flight\": null}");
+	else
+		bench_append("     \"post_us_mean\": %.1f, \"buffers_in_flight\": "
+				"{\"mean\": %.2f, \"max\": %d}}",
+				b->posted ? (double)b->post_us / b->posted : 0.0,
+				b->samples ? (double)b->in_flight_sum / b->samples : 0.0,
+				b->in_flight_max);
+	pthread_mutex_unlock(&bench_lock);
+#undef PCT
+
+	free(b->process_us);
+	memset(b, 0, sizeof(*b));
+}
+
+static void
+bench_write(uint64_t start_us, const struct rusage *ru0)
+{
+	struct rusage ru1;
+	uint64_t wall = now_us() - start_us, cpu;
+
+	getrusage(RUSAGE_SELF, &ru1);
+	cpu = (ru1.ru_utime.tv_sec - ru0->ru_utime.tv_sec) * 1000000ull +
+			(ru1.ru_utime.tv_usec - ru0->ru_utime.tv_usec) +
+			(ru1.ru_stime.tv_sec - ru0->ru_stime.tv_sec) * 1000000ull +
+			(ru1.ru_stime.tv_usec - ru0->ru_stime.tv_usec);
+
+	fprintf(bench_file, "{\"tool\": \"viddec3test\", \"no_process\": %s, "
+			"\"synthetic\": %s, \"workers\": %d, \"prefetch\": %d,\n"
+			" \"wall_ms\": %.1f, \"cpu_ms\": %.1f, \"cpu_pct\": %.1f, "
+			"\"cpus\": %ld,\n \"decoders\": [%s\n ]}\n",
+			no_process ? "true" : "false", synthetic_w ? "true" : "false",
+			nworkers, nprefetch, wall / 1000.0, cpu / 1000.0,
+			wall ? 100.0 * cpu / wall : 0.0, sysconf(_SC_NPROCESSORS_ONLN),
+			bench_json ? bench_json : "");
+	if (bench_file != stdout)
+		fclose(bench_file);
+}
+
 static void
 decoder_close(struct decoder *decoder)
 {
@@ -100,17 +552,17 @@ decoder_close(struct decoder *decoder)
 	if (decoder->status)         dce_free(decoder->status);
 	if (decoder->params)         dce_free(decoder->params);
 	if (decoder->dynParams)      dce_free(decoder->dynParams);
-	if (decoder->inBufs) {
-		dce_buf_unlock(1, &(decoder->inBufs->descs[0].buf));
-		close(decoder->inBufs->descs[0].buf);
-		dce_free(decoder->inBufs);
-	}
+	/* stop the demux thread first, it updates the stats */
+	ring_stop(decoder);
+	if (bench_file && decoder->ring.start_us)
+		bench_record(decoder);
+	ring_free(decoder);
+	if (decoder->inBufs)         dce_free(decoder->inBufs);
 	if (decoder->outBufs)        dce_free(decoder->outBufs);
 	if (decoder->inArgs)         dce_free(decoder->inArgs);
 	if (decoder->outArgs)        dce_free(decoder->outArgs);
 	if (decoder->codec)          VIDDEC3_delete(decoder->codec);
 	if (decoder->engine)         Engine_close(decoder->engine);
-    if (decoder->input_bo)       omap_bo_del(decoder->input_bo);
 	if (decoder->outBuf_fd)	     free(decoder->outBuf_fd);
 	if(inloop < 2) {
 		if (dev)		             dce_deinit(dev);
@@ -129,6 +581,8 @@ decoder_open(int argc, char **argv)
 	char *infile = NULL;
 	int i;
 	static int width, height, padded_width, padded_height;
+	int64_t seek_ms = -1;
+	int ff = 0;
 	Engine_Error ec;
 	XDAS_Int32 err;
 
@@ -137,13 +591,35 @@ decoder_open(int argc, char **argv)
 		if (!decoder)
 			return NULL;
 
+		for (i = 1; i < argc; i++) {
+			if (argv[i] && !strcmp(argv[i], "--prio") && i + 1 < argc) {
+				argv[i++] = NULL;
+				decoder->prio = atoi(argv[i]);
+				argv[i] = NULL;
+			} else if (argv[i] && !strcmp(argv[i], "--seek") &&
+					i + 1 < argc) {
+				argv[i++] = NULL;
+				seek_ms = parse_time(argv[i]);
+				if (seek_ms < 0) {
+					ERROR("%p: invalid time: %s", decoder, argv[i]);
+					goto usage;
+				}
+				argv[i] = NULL;
+			} else if (argv[i] && !strcmp(argv[i], "--ff") &&
+					i + 1 < argc) {
+				argv[i++] = NULL;
+				ff = atoi(argv[i]);
+				argv[i] = NULL;
+			}
+		}
+
 		MSG("%p: Opening Display..", decoder);
 		decoder->disp = disp_open(argc, argv);
 		if (!decoder->disp)
 			goto usage;
 
 	    /* loop thru args, find input file.. */
-		for (i = 1; i < argc; i++) {
+		for (i = 1; i < argc && !synthetic_w; i++) {
 			int fd;
 			    if (!argv[i]) {
 				    continue;
@@ -157,16 +633,42 @@ decoder_open(int argc, char **argv)
 			}
 			break;
 		}
+		if (synthetic_w)
+			infile = "synthetic";
 		if (check_args(argc, argv) || !infile)
 			goto usage;
 		MSG("%p: Opening Demuxer..", decoder);
-		decoder->demux = demux_init(infile, &width, &height);
+		if (synthetic_w) {
+			width = synthetic_w;
+			height = synthetic_h;
+			decoder->demux = demux_init_synthetic(width, height,
+					synthetic_frames);
+		} else {
+			decoder->demux = demux_init(infile, &width, &height);
+		}
+		decoder->name = infile;
 		if (!decoder->demux) {
 			ERROR("%p: could not open demuxer", decoder);
 			goto fail;
 		}
 		MSG("%p: infile=%s, width=%d, height=%d", decoder, infile, width, height);
 
+		if (ff > 0 && demux_set_ff(decoder->demux, ff))
+			ERROR("%p: fast-forward needs an input file", decoder);
+		if (seek_ms >= 0 && demux_seek(decoder->demux, seek_ms)) {
+			ERROR("%p: could not seek to %lld ms", decoder,
+					(long long)seek_ms);
+			goto fail;
+		}
+
+		if (decoder->demux->st->avg_frame_rate.num > 0 &&
+				decoder->demux->st->avg_frame_rate.den > 0)
+			decoder->interval_us = 1000000ull *
+					decoder->demux->st->avg_frame_rate.den /
+					decoder->demux->st->avg_frame_rate.num;
+		else
+			decoder->interval_us = 1000000 / 30;
+
 		/* calculate output buffer parameters: */
 		width  = ALIGN2 (width, 4);        /* round up to macroblocks */
 		height = ALIGN2 (height, 4);       /* round up to macroblocks */
@@ -210,9 +712,10 @@ decoder_open(int argc, char **argv)
 	}
 
 	decoder->input_sz = width * height;
-	decoder->input_bo = omap_bo_new(decoder->disp->dev,
-			decoder->input_sz, OMAP_BO_WC);
-	decoder->input = omap_bo_map(decoder->input_bo);
+	if (ring_init(decoder, nprefetch)) {
+		ERROR("%p: could not allocate input buffers", decoder);
+		goto fail;
+	}
 
 
 
@@ -247,16 +750,16 @@ decoder_open(int argc, char **argv)
 
 	if (decoder->demux->cc->codec_id == AV_CODEC_ID_MPEG2VIDEO) {
             decoder->codec = VIDDEC3_create(decoder->engine,
-                                        "ivahd_mpeg2vdec", decoder->params);
+			            "ivahd_mpeg2vdec", decoder->params);
         }
         else if (decoder->demux->cc->codec_id == AV_CODEC_ID_H264) {
             decoder->codec = VIDDEC3_create(decoder->engine,
-                                        "ivahd_h264dec", decoder->params);
+			            "ivahd_h264dec", decoder->params);
         }
 	else if (decoder->demux->cc->codec_id == AV_CODEC_ID_MPEG4) {
 		decoder->demux->first_in_buff = 1;
 		decoder->codec = VIDDEC3_create(decoder->engine,
-                                        "ivahd_mpeg4dec", decoder->params);
+			            "ivahd_mpeg4dec", decoder->params);
 	}
 
 	if (!decoder->codec) {
@@ -294,9 +797,9 @@ decoder_open(int argc, char **argv)
 
 	decoder->inBufs = dce_alloc(sizeof(XDM2_BufDesc));
 	decoder->inBufs->numBufs = 1;
-	decoder->inBufs->descs[0].buf =	(XDAS_Int8 *)omap_bo_dmabuf(decoder->input_bo);
-	dce_buf_lock(1, &(decoder->inBufs->descs[0].buf));
-	decoder->inBufs->descs[0].bufSize.bytes = omap_bo_size(decoder->input_bo);
+	/* buf and size are set per access unit, from the input ring */
+	decoder->inBufs->descs[0].buf = (XDAS_Int8 *)decoder->ring.slot[0].fd;
+	decoder->inBufs->descs[0].bufSize.bytes = decoder->input_sz;
 	decoder->inBufs->descs[0].memType = XDM_MEMTYPE_RAW;
 
 
@@ -315,6 +818,9 @@ decoder_open(int argc, char **argv)
 
 	decoder->tdisp = mark(NULL);
 
+	if (ring_start(decoder))
+		goto fail;
+
 	return decoder;
 
 usage:
@@ -333,77 +839,70 @@ decoder_process(struct decoder *decoder)
 	XDM2_BufDesc *outBufs = decoder->outBufs;
 	VIDDEC3_InArgs *inArgs = decoder->inArgs;
 	VIDDEC3_OutArgs *outArgs = decoder->outArgs;
+	struct input_slot *slot;
 	struct buffer *buf;
 	int freeBufCount =0;
 	int i, n;
 	XDAS_Int32 err;
 	int eof = 0; /* end of file flag */
 
-	/* demux; in loop mode, we can do two tries at the end of the stream. */
-	for (i = 0; i < 2; i++) {
-		n = demux_read(decoder->demux, decoder->input, decoder->input_sz);
-		if (n) {
-			if(decoder->outBufsInUseFlag == XDAS_FALSE){
-				buf = disp_get_vid_buffer(decoder->disp);
-				if (!buf) {
-					ERROR("%p: fail: out of buffers", decoder);
-					return -1;
-				}
-				decoder->lastOutBuf = buf;
-
-                                inArgs->inputID = (XDAS_Int32)buf;
-                                outBufs->descs[0].buf = buf->fd[0];
-                                outBufs->descs[1].buf = (buf->multiplanar) ?buf->fd[1]:(XDAS_Int8 *)((outBufs->descs[0].buf));
-
-                                if(buf->multiplanar){
-                                    decoder->outBuf_fd[0] = buf->fd[0];
-                                    decoder->outBuf_fd[1] = buf->fd[1];
-                                    dce_buf_lock(2,decoder->outBuf_fd);
-                                }
-                                else{
-                                    decoder->outBuf_fd[0] = buf->fd[0];
-                                    dce_buf_lock(1,decoder->outBuf_fd);
-                                }
-                                decoder->outBufs->descs[0].bufSize.bytes =decoder->padded_width*decoder->padded_height;
-                                decoder->outBufs->descs[1].bufSize.bytes = decoder->padded_width* (decoder->padded_height/2);
+	/* the demux thread has normally read it already; rewinding in loop
+	 * mode happens there too
+	 */
+	slot = ring_get(decoder);
+	n = slot->n;
+	if (n) {
+		if(decoder->outBufsInUseFlag == XDAS_FALSE){
+			buf = disp_get_vid_buffer(decoder->disp);
+			if (!buf) {
+				ERROR("%p: fail: out of buffers", decoder);
+				return -1;
 			}
-			else{
-				/*For second field decoding, send last output buffer
-				  decoder uses buffer which was sent for first field
-				  decoding. No need to pass the buffer. This decision is
-				  taken based on outArgs->outBufsInUseFlag
-				 */
-				buf = decoder->lastOutBuf;
+			decoder->lastOutBuf = buf;
+			if (++decoder->bench.in_flight > decoder->bench.in_flight_max)
+				decoder->bench.in_flight_max = decoder->bench.in_flight;
+
+			inArgs->inputID = (XDAS_Int32)buf;
+			outBufs->descs[0].buf = buf->fd[0];
+			outBufs->descs[1].buf = (buf->multiplanar) ?buf->fd[1]:(XDAS_Int8 *)((outBufs->descs[0].buf));
+
+			if(buf->multiplanar){
+				decoder->outBuf_fd[0] = buf->fd[0];
+				decoder->outBuf_fd[1] = buf->fd[1];
+				dce_buf_lock(2,decoder->outBuf_fd);
 			}
-			inBufs->descs[0].bufSize.bytes = n;
-			inArgs->numBytes = n;
-			DBG("%p: push: %d bytes (%p)", decoder, n, buf);
-		} else {
-			/* end of input.. do we need to flush? */
-			MSG("%p: end of input", decoder);
-
-			/* In loop mode: rewind and retry once. */
-			if (loop && i == 0) {
-				int err = demux_rewind(decoder->demux);
-				if (err < 0) {
-					ERROR("%p: demux_rewind returned error: %d", decoder, err);
-					return -1;
-				}
-				MSG("%p: rewound.", decoder);
-				if(!inloop) continue;
+			else{
+				decoder->outBuf_fd[0] = buf->fd[0];
+				dce_buf_lock(1,decoder->outBuf_fd);
 			}
-			eof = 1; /* set the flag for end of file to 1 */
-			/* Control call call with XDM_FLUSH command */
-			err = VIDDEC3_control(decoder->codec, XDM_FLUSH,
-					decoder->dynParams, decoder->status);
-			inBufs->numBufs = 0;
-			outBufs->numBufs = 0;
-			inArgs->inputID = 0;
+			decoder->outBufs->descs[0].bufSize.bytes =decoder->padded_width*decoder->padded_height;
+			decoder->outBufs->descs[1].bufSize.bytes = decoder->padded_width* (decoder->padded_height/2);
 		}
-		break;
+		else{
+			/*For second field decoding, send last output buffer
+			  decoder uses buffer which was sent for first field
+			  decoding. No need to pass the buffer. This decision is
+			  taken based on outArgs->outBufsInUseFlag
+			 */
+			buf = decoder->lastOutBuf;
+		}
+		inBufs->descs[0].bufSize.bytes = n;
+		inArgs->numBytes = n;
+		DBG("%p: push: %d bytes (%p)", decoder, n, buf);
+		inBufs->descs[0].buf = (XDAS_Int8 *)slot->fd;
+	} else {
+		/* end of input.. do we need to flush? */
+		MSG("%p: end of input", decoder);
+
+		eof = 1; /* set the flag for end of file to 1 */
+		/* Control call call with XDM_FLUSH command */
+		err = VIDDEC3_control(decoder->codec, XDM_FLUSH,
+				decoder->dynParams, decoder->status);
+		inBufs->numBufs = 0;
+		outBufs->numBufs = 0;
+		inArgs->inputID = 0;
 	}
 
-
 	do {
 		if (no_process) {
 			/* Do not process. This is for benchmarking. We need to "fake"
@@ -422,7 +921,10 @@ decoder_process(struct decoder *decoder)
 			suseconds_t tproc;
 			tproc = mark(NULL);
 			err = VIDDEC3_process(decoder->codec, inBufs, outBufs, inArgs, outArgs);
-			DBG("%p: processed returned in: %ldus", decoder, (long int)mark(&tproc));
+			tproc = mark(&tproc);
+			DBG("%p: processed returned in: %ldus", decoder, (long int)tproc);
+			if (bench_file)
+				bench_process(decoder, tproc);
 			if (err) {
 				ERROR("%p: process returned error: %d", decoder, err);
 				ERROR("%p: extendedError: %08x", decoder, outArgs->extendedError);
@@ -437,16 +939,23 @@ decoder_process(struct decoder *decoder)
 
 			/* get the output buffer and write it to file */
 			buf = (struct buffer *)outArgs->outputID[i];
-			if(!no_process)
-                               disp_post_vid_buffer(decoder->disp, buf,
+			decoder->bench.frames++;
+			if(!no_process) {
+				uint64_t t = now_us();
+
+				disp_post_vid_buffer(decoder->disp, buf,
 					r->topLeft.x, r->topLeft.y,
 					r->bottomRight.x - r->topLeft.x,
 					r->bottomRight.y - r->topLeft.y);
+				decoder->bench.post_us += now_us() - t;
+				decoder->bench.posted++;
+			}
 		}
 
 		for (i = 0; outArgs->freeBufID[i]; i++) {
 			buf = (struct buffer *)outArgs->freeBufID[i];
 			disp_put_vid_buffer(decoder->disp, buf);
+			decoder->bench.in_flight--;
 
 			if(buf->multiplanar){
 				decoder->outBuf_fd[freeBufCount++] = buf->fd[0];
@@ -463,10 +972,17 @@ decoder_process(struct decoder *decoder)
 			freeBufCount =0;
 		}
 
+		decoder->bench.in_flight_sum += decoder->bench.in_flight;
+		decoder->bench.samples++;
+
 		decoder->outBufsInUseFlag = outArgs->outBufsInUseFlag;
 
 	} while ((err == 0) && eof && !no_process);
 
+	/* entire-frame input: the codec is done with it once process returns */
+	if (n)
+		ring_put(decoder);
+
 	return (inBufs->numBufs > 0) ? 0 : -1;
 }
 
@@ -510,11 +1026,163 @@ exit:
 }
 
 
+/* the stream to decode now, or NULL and when the next one is due */
+static struct decoder *
+sched_pick(uint64_t now, uint64_t *next)
+{
+	struct decoder *decoder, *best = NULL;
+
+	*next = UINT64_MAX;
+	list_for_each_entry(decoder, &sched.ready, link) {
+		if (decoder->deadline > now) {
+			if (decoder->deadline < *next)
+				*next = decoder->deadline;
+			continue;
+		}
+		if (!best || decoder->prio < best->prio ||
+				(decoder->prio == best->prio &&
+				 decoder->deadline < best->deadline))
+			best = decoder;
+	}
+	return best;
+}
+
+static void *
+sched_worker(void *arg)
+{
+	struct decoder *decoder;
+	struct timespec ts;
+	uint64_t t, next;
+	int ret, i;
+
+	(void)arg;
+
+	pthread_mutex_lock(&sched.lock);
+	while (sched.active) {
+		if (needQuit()) {
+			inloop = 1;
+			break;
+		}
+		if (list_is_empty(&sched.ready)) {
+			pthread_cond_wait(&sched.cond, &sched.lock);
+			continue;
+		}
+
+		decoder = sched_pick(now_us(), &next);
+		if (!decoder) {
+			ts.tv_sec = next / 1000000;
+			ts.tv_nsec = (next % 1000000) * 1000;
+			pthread_cond_timedwait(&sched.cond, &sched.lock, &ts);
+			continue;
+		}
+		list_del(&decoder->link);
+		pthread_mutex_unlock(&sched.lock);
+
+		t = now_us();
+		if (t > decoder->deadline) {
+			decoder->late++;
+			if (t - decoder->deadline > MAX_LAG_US)
+				decoder->deadline = t;
+		}
+		ret = decoder_process(decoder);
+		decoder->busy_us += now_us() - t;
+		decoder->frames++;
+		decoder->deadline += decoder->interval_us;
+
+		if (ret) {
+			MSG("%p: %u frames, %u late, %.1f ms/frame", decoder,
+					decoder->frames, decoder->late, decoder->frames ?
+					decoder->busy_us / 1000.0 / decoder->frames : 0.0);
+			i = decoder->id;
+			decoder_close(decoder);
+			decoders[i] = NULL;
+		}
+
+		pthread_mutex_lock(&sched.lock);
+		if (ret)
+			sched.active--;
+		else
+			list_add(&decoder->link, &sched.ready);
+		pthread_cond_broadcast(&sched.cond);
+	}
+	pthread_cond_broadcast(&sched.cond);
+	pthread_mutex_unlock(&sched.lock);
+
+	return NULL;
+}
+
+static int
+sched_run(void)
+{
+	pthread_t *threads;
+	pthread_condattr_t cattr;
+	uint64_t start = now_us();
+	int i, n = 0;
+
+	/* deadlines are now_us() times */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched.cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	list_init(&sched.ready);
+	for (i = 0; i < ndecoders; i++) {
+		if (!decoders[i])
+			continue;
+		decoders[i]->deadline = start;
+		list_add(&decoders[i]->link, &sched.ready);
+		sched.active++;
+	}
+
+	threads = calloc(nworkers, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	MSG("decoding %d streams with %d workers", sched.active, nworkers);
+	for (i = 0; i < nworkers; i++) {
+		int ret = pthread_create(&threads[n], NULL, sched_worker, NULL);
+		if (ret != 0)
+			ERROR("creation of pthread, error: %d", ret);
+		else
+			n++;
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/* streams still open were interrupted, close them for --bench */
+	for (i = 0; i < ndecoders; i++) {
+		if (decoders[i]) {
+			decoder_close(decoders[i]);
+			decoders[i] = NULL;
+		}
+	}
+
+	return n ? 0 : -1;
+}
+
+static struct decoder *
+add_decoder(int argc, char **argv)
+{
+	struct decoder **d = realloc(decoders, (ndecoders + 1) * sizeof(*d));
+
+	if (!d)
+		return NULL;
+	decoders = d;
+	decoders[ndecoders] = decoder_open(argc, argv);
+	if (decoders[ndecoders])
+		decoders[ndecoders]->id = ndecoders;
+	return decoders[ndecoders++];
+}
+
 static void sig_handler(int signo)
 {
   if (signo == SIGINT) {
-	  int i=0;
 	  pthread_mutex_unlock(&mtx);
+	  /* with --bench, main() winds down and writes the results */
+	  if (bench_file)
+		  return;
 	  sleep(1);
 	  exit(0);
   }
@@ -526,9 +1194,13 @@ main(int argc, char **argv)
 {
 
    int i, first = 0;
+   uint64_t start_us = now_us();
+   struct rusage ru;
 
    struct sigaction sa;
 
+   getrusage(RUSAGE_SELF, &ru);
+
    sa.sa_handler = sig_handler;
    sigemptyset(&sa.sa_mask);
    sa.sa_flags = 0;
@@ -559,11 +1231,45 @@ main(int argc, char **argv)
 			DBG("detected inloop = %d\n", inloop);
 			loop = 1; //we want rewind as well
 			argv[i] = NULL;
+		} else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+			argv[i++] = NULL;
+			bench_file = strcmp(argv[i], "-") ? fopen(argv[i], "w") : stdout;
+			if (!bench_file) {
+				ERROR("could not open %s: %s", argv[i], strerror(errno));
+				return 1;
+			}
+			argv[i] = NULL;
+
+		} else if (!strcmp(argv[i], "--synthetic") && i + 1 < argc) {
+			argv[i++] = NULL;
+			if (sscanf(argv[i], "%dx%d:%d", &synthetic_w, &synthetic_h,
+					&synthetic_frames) < 2 ||
+					synthetic_w <= 0 || synthetic_h <= 0) {
+				ERROR("invalid synthetic stream: %s", argv[i]);
+				return 1;
+			}
+			/* the packets are filler, the codec can't decode them */
+			no_process = 1;
+			argv[i] = NULL;
+
+		} else if (!strcmp(argv[i], "--prefetch") && i + 1 < argc) {
+			argv[i++] = NULL;
+			nprefetch = atoi(argv[i]);
+			if (nprefetch < 1)
+				nprefetch = 1;
+			argv[i] = NULL;
+
+		} else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			argv[i++] = NULL;
+			nworkers = atoi(argv[i]);
+			if (nworkers < 1)
+				nworkers = 1;
+			argv[i] = NULL;
+
 		} else if (!strcmp(argv[i], "--")) {
 			argv[first] = argv[0];
-			decoders[ndecoders] = decoder_open(i - first, &argv[first]);
-			decoders[ndecoders]->id = ndecoders;
-			ndecoders++;
+			if (!add_decoder(i - first, &argv[first]))
+				return 1;
 			first = i;
 		}
 	}
@@ -572,40 +1278,28 @@ main(int argc, char **argv)
 	argc = i - first;
 
 	if(ndecoders) {
-	    decoders[ndecoders] = decoder_open(argc ,&argv[first]);
-		decoders[ndecoders]->id = ndecoders;
-		ndecoders++;
+		if (!add_decoder(argc, &argv[first]))
+			return 1;
 	}
 
 	if (ndecoders > 1) {
-		pthread_t threadIds[8];
-
-		for (i = 0; i < ndecoders; i++) {
-			if (decoders[i]) {
-				int ret = pthread_create(&threadIds[i], NULL,
-						&decode_stream, decoders[i]);
-				if (ret != 0)
-					ERROR("%p: creation of pthread, error: %d",
-							decoders[i], ret);
-			}
-		}
-
-		for (i = 0; i < ndecoders; i++) {
-			pthread_join(threadIds[i], NULL);
-		}
+		sched_run();
 	}
 	else {
 		int itr = 0;
 		do {
-			decoders[0] = decoder_open(argc, &argv[first]);
-			decoders[0]->id = 0;
-			ndecoders++;
+			ndecoders = 0;
+			if (!add_decoder(argc, &argv[first]))
+				return 1;
 			decode_stream(decoders[0]);
 			if (inloop) {
 				MSG("=================Iteration %d complete =============== %d\n", ++itr);
 			}
-		}while(inloop);
+		}while(inloop && !needQuit());
 	}
 
+	if (bench_file)
+		bench_write(start_us, &ru);
+
 	return 0;
 }